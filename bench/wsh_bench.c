@@ -0,0 +1,324 @@
+//Benchmark harness for wsh
+//It pulls in the shell itself (with its main renamed) so single launches and PATH
+//lookups can be timed directly, and runs the built shell on generated batch scripts
+//for end to end throughput. Every result is printed as one JSON object per line.
+//
+//Usage: wsh_bench path/to/wsh [commands]
+//  BENCH_LS_SIZES   comma separated directory sizes for the ls benchmark
+//                   (default 10,10000,1000000)
+#define main wsh_main
+#include "wsh.c"
+#undef main
+
+#include <time.h>
+
+//Default number of commands in each generated batch script
+#define BENCH_COMMANDS 2000
+//Number of launches timed for the spawn latency percentiles
+#define BENCH_SPAWNS 1000
+//Number of lookups timed for the PATH resolution cost
+#define BENCH_LOOKUPS 20000
+//Number of executables put on PATH for the completion benchmark
+#define BENCH_EXECUTABLES 10000
+//Number of completions timed against the warm index
+#define BENCH_COMPLETIONS 1000
+
+//Used to read the monotonic clock in seconds
+double bench_now(){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+//Used to sort latency samples for the percentiles
+int compare_samples(const void *a, const void *b){
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+//Used to pick a percentile out of sorted samples
+double percentile(double *samples, int count, double p){
+	int index = (int)(p * (count - 1));
+	return samples[index];
+}
+
+//This method will write a batch script of the given kind into path
+//builtin  - only Built-In commands, nothing is launched
+//external - only external commands resolved through PATH
+//variable - assignments and lookups of many shell variables
+void write_script(const char *path, const char *kind, int commands){
+	FILE *file = fopen(path, "w");
+	if(file == NULL){
+		perror(path);
+		exit(1);
+	}
+	for(int i = 0; i < commands; i++){
+		if(strcmp(kind, "builtin") == 0){
+			switch(i % 3){
+				case 0: fprintf(file, "local B%d=%d\n", i % 100, i); break;
+				case 1: fprintf(file, "cd .\n"); break;
+				default: fprintf(file, "hash -r\n"); break;
+			}
+		}
+		else if(strcmp(kind, "external") == 0){
+			fprintf(file, "true\n");
+		}
+		else{
+			if(i < 200){
+				fprintf(file, "local V%d=value%d\n", i, i);
+			}
+			else{
+				fprintf(file, "local R%d=$V%d\n", i % 50, (i * 7) % 200);
+			}
+		}
+	}
+	fclose(file);
+}
+
+//This method will time the shell running a batch script and report commands per second
+void bench_batch(const char *shell, const char *directory, const char *kind, int commands){
+	char script[4096];
+	snprintf(script, sizeof(script), "%s/%s.wsh", directory, kind);
+	write_script(script, kind, commands);
+	double start = bench_now();
+	pid_t pid = fork();
+	if(pid == 0){
+		int null_fd = open("/dev/null", O_WRONLY);
+		dup2(null_fd, STDOUT_FILENO);
+		execl(shell, shell, script, (char *)NULL);
+		_exit(127);
+	}
+	int status;
+	waitpid(pid, &status, 0);
+	double seconds = bench_now() - start;
+	printf("{\"bench\":\"batch\",\"script\":\"%s\",\"commands\":%d,\"seconds\":%.6f,\"commands_per_sec\":%.1f,\"status\":%d}\n",
+		kind, commands, seconds, commands / seconds, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+	unlink(script);
+}
+
+//This method will time single launches of /bin/true through launch_command
+//launch is how long the shell is busy starting the command, total also waits for it
+void bench_spawn(int mode, const char *name){
+	double launches[BENCH_SPAWNS];
+	double totals[BENCH_SPAWNS];
+	char *args[] = { "true", NULL };
+	int fds[3] = { -1, -1, -1 };
+	launch_mode = mode;
+	for(int i = 0; i < BENCH_SPAWNS; i++){
+		pid_t pid;
+		int status;
+		double start = bench_now();
+		if(launch_command("/bin/true", args, fds, &pid, NULL) != 0){
+			exit(1);
+		}
+		launches[i] = (bench_now() - start) * 1e6;
+		wait_for_child(pid, &status, 0);
+		totals[i] = (bench_now() - start) * 1e6;
+		arena_reset(&command_arena);
+	}
+	qsort(launches, BENCH_SPAWNS, sizeof(double), compare_samples);
+	qsort(totals, BENCH_SPAWNS, sizeof(double), compare_samples);
+	printf("{\"bench\":\"spawn\",\"backend\":\"%s\",\"launches\":%d,\"launch_p50_us\":%.1f,\"launch_p99_us\":%.1f,\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}\n",
+		name, BENCH_SPAWNS, percentile(launches, BENCH_SPAWNS, 0.50), percentile(launches, BENCH_SPAWNS, 0.99),
+		percentile(totals, BENCH_SPAWNS, 0.50), percentile(totals, BENCH_SPAWNS, 0.90),
+		percentile(totals, BENCH_SPAWNS, 0.99), totals[BENCH_SPAWNS - 1]);
+}
+
+//This method will time retrieve_command_path with a cold and a warm cache
+//PATH is made of 16 empty directories before /bin, like a long real world PATH
+void bench_path(const char *directory){
+	char path[8192] = "";
+	for(int i = 0; i < 16; i++){
+		char entry[4096];
+		snprintf(entry, sizeof(entry), "%s/path%d", directory, i);
+		mkdir(entry, 0755);
+		strcat(path, entry);
+		strcat(path, ":");
+	}
+	strcat(path, "/bin");
+	const char *current = lookup_environment("PATH", 4);
+	char *saved = current != NULL ? strdup(current) : NULL;
+	set_environment_variable("PATH", path);
+
+	const char *kinds[] = { "cold", "warm" };
+	for(int warm = 0; warm < 2; warm++){
+		clear_path_cache();
+		double start = bench_now();
+		for(int i = 0; i < BENCH_LOOKUPS; i++){
+			if(!warm){
+				clear_path_cache();
+			}
+			retrieve_command_path("true");
+			arena_reset(&command_arena);
+		}
+		double seconds = bench_now() - start;
+		printf("{\"bench\":\"path\",\"cache\":\"%s\",\"path_dirs\":17,\"lookups\":%d,\"ns_per_lookup\":%.1f}\n",
+			kinds[warm], BENCH_LOOKUPS, seconds * 1e9 / BENCH_LOOKUPS);
+	}
+	clear_path_cache();
+	if(saved != NULL){
+		set_environment_variable("PATH", saved);
+		free(saved);
+	}
+	for(int i = 0; i < 16; i++){
+		char entry[4096];
+		snprintf(entry, sizeof(entry), "%s/path%d", directory, i);
+		rmdir(entry);
+	}
+}
+
+//This method will time command completion with BENCH_EXECUTABLES executables on PATH
+//cold builds the index, warm completes against it unchanged and changed completes
+//right after a file was added, when only that directory is read again
+void bench_complete(const char *directory){
+	char bin[4096];
+	snprintf(bin, sizeof(bin), "%s/bin", directory);
+	mkdir(bin, 0755);
+	int dir_fd = open(bin, O_RDONLY | O_DIRECTORY);
+	for(int i = 0; i < BENCH_EXECUTABLES; i++){
+		char name[64];
+		snprintf(name, sizeof(name), "tool%05d", i);
+		int fd = openat(dir_fd, name, O_WRONLY | O_CREAT, 0755);
+		if(fd >= 0){
+			close(fd);
+		}
+	}
+	char path[8192];
+	snprintf(path, sizeof(path), "%s:/bin", bin);
+	set_environment_variable("PATH", path);
+	//The directory was just written, wait until its timestamp can be trusted
+	sleep(2);
+
+	CompletionMatches matches = { .count = 0 };
+	double start = bench_now();
+	complete_command_names("tool0123", 8, &matches);
+	double cold = bench_now() - start;
+	int found = matches.count;
+	arena_reset(&command_arena);
+
+	start = bench_now();
+	for(int i = 0; i < BENCH_COMPLETIONS; i++){
+		CompletionMatches warm = { .count = 0 };
+		complete_command_names("tool0123", 8, &warm);
+		arena_reset(&command_arena);
+	}
+	double warm = (bench_now() - start) / BENCH_COMPLETIONS;
+
+	int fd = openat(dir_fd, "tool-new", O_WRONLY | O_CREAT, 0755);
+	if(fd >= 0){
+		close(fd);
+	}
+	CompletionMatches changed_matches = { .count = 0 };
+	start = bench_now();
+	complete_command_names("tool0123", 8, &changed_matches);
+	double changed = bench_now() - start;
+	arena_reset(&command_arena);
+
+	printf("{\"bench\":\"complete\",\"executables\":%d,\"matches\":%d,\"cold_us\":%.1f,\"warm_us\":%.2f,\"changed_us\":%.1f}\n",
+		BENCH_EXECUTABLES, found, cold * 1e6, warm * 1e6, changed * 1e6);
+	fflush(stdout);
+
+	free_completion_index();
+	set_environment_variable("PATH", "/bin");
+	unlinkat(dir_fd, "tool-new", 0);
+	for(int i = 0; i < BENCH_EXECUTABLES; i++){
+		char name[64];
+		snprintf(name, sizeof(name), "tool%05d", i);
+		unlinkat(dir_fd, name, 0);
+	}
+	close(dir_fd);
+	rmdir(bin);
+}
+
+//This method will time the ls builtin on a directory of the given size
+void bench_ls(const char *directory, long entries){
+	char listing_dir[4096];
+	snprintf(listing_dir, sizeof(listing_dir), "%s/ls%ld", directory, entries);
+	mkdir(listing_dir, 0755);
+	int dir_fd = open(listing_dir, O_RDONLY | O_DIRECTORY);
+	for(long i = 0; i < entries; i++){
+		char name[64];
+		snprintf(name, sizeof(name), "file%08ld", (i * 7919) % entries);
+		int fd = openat(dir_fd, name, O_WRONLY | O_CREAT, 0644);
+		if(fd >= 0){
+			close(fd);
+		}
+	}
+	char cwd[4096];
+	if(getcwd(cwd, sizeof(cwd)) == NULL || chdir(listing_dir) != 0){
+		perror("ls bench");
+		return;
+	}
+	//Send the listing to /dev/null so only the builtin is measured
+	int saved_stdout = dup(STDOUT_FILENO);
+	int null_fd = open("/dev/null", O_WRONLY);
+	fflush(stdout);
+	dup2(null_fd, STDOUT_FILENO);
+	close(null_fd);
+	char *args[] = { "ls", NULL };
+	double start = bench_now();
+	execute_ls(args);
+	out_flush();
+	double seconds = bench_now() - start;
+	dup2(saved_stdout, STDOUT_FILENO);
+	close(saved_stdout);
+	if(chdir(cwd) != 0){
+		perror("ls bench");
+	}
+	printf("{\"bench\":\"ls\",\"entries\":%ld,\"seconds\":%.6f}\n", entries, seconds);
+	fflush(stdout);
+
+	for(long i = 0; i < entries; i++){
+		char name[64];
+		snprintf(name, sizeof(name), "file%08ld", i);
+		unlinkat(dir_fd, name, 0);
+	}
+	close(dir_fd);
+	rmdir(listing_dir);
+}
+
+int main(int argc, char *argv[]){
+	if(argc < 2){
+		fprintf(stderr, "Usage: %s path/to/wsh [commands]\n", argv[0]);
+		return 1;
+	}
+	int commands = argc > 2 ? atoi(argv[2]) : BENCH_COMMANDS;
+	char directory[] = "/tmp/wsh-bench-XXXXXX";
+	if(mkdtemp(directory) == NULL){
+		perror("mkdtemp");
+		return 1;
+	}
+	//The generated scripts run external commands through PATH=/bin like the shell sets up
+	setenv("PATH", "/bin", 1);
+
+	bench_batch(argv[1], directory, "builtin", commands);
+	bench_batch(argv[1], directory, "external", commands);
+	bench_batch(argv[1], directory, "variable", commands);
+	fflush(stdout);
+
+	bench_spawn(LAUNCH_SPAWN, "posix_spawn");
+	bench_spawn(LAUNCH_FORK, "fork");
+	//The pool is filled before timing, like a shell that has been idle between commands
+	start_zygote_pool();
+	usleep(100000);
+	bench_spawn(LAUNCH_ZYGOTE, "zygote");
+	printf("{\"bench\":\"zygote\",\"hits\":%ld,\"misses\":%ld}\n", zygote_pool.hits, zygote_pool.misses);
+	free_zygote_pool();
+	fflush(stdout);
+
+	bench_path(directory);
+	fflush(stdout);
+
+	bench_complete(directory);
+
+	const char *sizes = getenv("BENCH_LS_SIZES");
+	char *list = strdup(sizes != NULL ? sizes : "10,10000,1000000");
+	for(char *size = strtok(list, ","); size != NULL; size = strtok(NULL, ",")){
+		bench_ls(directory, atol(size));
+	}
+	free(list);
+
+	rmdir(directory);
+	return 0;
+}
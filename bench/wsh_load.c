@@ -0,0 +1,157 @@
+//Load generator for wsh server mode
+//It starts the given shell with --serve on a temporary socket, then has a number
+//of client processes send requests over their own connections as fast as the server
+//answers them. The result is printed as one JSON object, like the benchmark harness.
+//
+//Usage: wsh_load path/to/wsh [clients] [requests] [command]
+//  clients   concurrent connections (default 8)
+//  requests  requests sent in all, split between the clients (default 20000)
+//  command   the command every request runs (default "true")
+#include "wsh.h"
+
+#include <time.h>
+
+//Used to read the monotonic clock in seconds
+double load_now(){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+//Used to sort latency samples for the percentiles
+int compare_samples(const void *a, const void *b){
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+//Used to read exactly length bytes from the server, or skip them if buffer is NULL
+//Returns 0 once they are all read
+int read_exactly(int fd, char *buffer, size_t length){
+	char discard[BATCH_READ_SIZE];
+	while(length > 0){
+		char *target = buffer != NULL ? buffer : discard;
+		size_t chunk = buffer != NULL || length < sizeof(discard) ? length : sizeof(discard);
+		ssize_t bytes = read(fd, target, chunk);
+		if(bytes < 0 && errno == EINTR){
+			continue;
+		}
+		if(bytes <= 0){
+			return -1;
+		}
+		if(buffer != NULL){
+			buffer += bytes;
+		}
+		length -= bytes;
+	}
+	return 0;
+}
+
+//Used to connect to the server's socket
+//Returns -1 if nothing is listening there yet
+int connect_server(const char *path){
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(fd >= 0 && connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0){
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+//This method will send count requests over one connection, one at a time
+//Each request's latency in microseconds goes into samples. Returns the number of failed requests
+int run_client(const char *path, const char *command, int count, double *samples){
+	int fd = connect_server(path);
+	if(fd < 0){
+		return count;
+	}
+	size_t length = strlen(command);
+	char request[4 + length];
+	uint32_t frame = htonl((uint32_t)length);
+	memcpy(request, &frame, 4);
+	memcpy(request + 4, command, length);
+	int failed = 0;
+	for(int i = 0; i < count; i++){
+		double start = load_now();
+		ServeResponseHeader header;
+		if(write(fd, request, sizeof(request)) != (ssize_t)sizeof(request) ||
+			read_exactly(fd, (char *)&header, sizeof(header)) != 0 ||
+			read_exactly(fd, NULL, ntohl(header.out_length) + ntohl(header.err_length)) != 0){
+			failed += count - i;
+			break;
+		}
+		failed += header.status != 0;
+		samples[i] = (load_now() - start) * 1e6;
+	}
+	close(fd);
+	return failed;
+}
+
+int main(int argc, char *argv[]){
+	if(argc < 2){
+		fprintf(stderr, "Usage: %s path/to/wsh [clients] [requests] [command]\n", argv[0]);
+		return 1;
+	}
+	int clients = argc > 2 ? atoi(argv[2]) : 8;
+	int requests = argc > 3 ? atoi(argv[3]) : 20000;
+	const char *command = argc > 4 ? argv[4] : "true";
+	if(clients < 1 || requests < clients){
+		fprintf(stderr, "%s: need at least one request per client\n", argv[0]);
+		return 1;
+	}
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/wsh-load-%d.sock", (int)getpid());
+
+	pid_t server = fork();
+	if(server == 0){
+		execl(argv[1], argv[1], "--serve", path, (char *)NULL);
+		_exit(127);
+	}
+	//Wait for the server to start listening
+	int probe = -1;
+	for(int tries = 0; tries < 500 && (probe = connect_server(path)) < 0; tries++){
+		usleep(10000);
+	}
+	if(probe < 0){
+		fprintf(stderr, "%s: server did not start\n", argv[0]);
+		kill(server, SIGTERM);
+		return 1;
+	}
+	close(probe);
+
+	//Every client writes its latencies into its own part of a shared mapping
+	int per_client = requests / clients;
+	requests = per_client * clients;
+	double *samples = mmap(NULL, requests * sizeof(double), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	int *failures = mmap(NULL, clients * sizeof(int), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	pid_t *pids = calloc(clients, sizeof(pid_t));
+	double start = load_now();
+	for(int c = 0; c < clients; c++){
+		pids[c] = fork();
+		if(pids[c] == 0){
+			failures[c] = run_client(path, command, per_client, samples + c * per_client);
+			_exit(0);
+		}
+	}
+	//Only the clients are waited for here, the server runs until it is told to stop
+	for(int c = 0; c < clients; c++){
+		waitpid(pids[c], NULL, 0);
+	}
+	free(pids);
+	double seconds = load_now() - start;
+	kill(server, SIGTERM);
+	waitpid(server, NULL, 0);
+
+	int failed = 0;
+	for(int c = 0; c < clients; c++){
+		failed += failures[c];
+	}
+	qsort(samples, requests, sizeof(double), compare_samples);
+	printf("{\"bench\":\"serve\",\"clients\":%d,\"requests\":%d,\"failed\":%d,\"seconds\":%.6f,\"requests_per_sec\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f}\n",
+		clients, requests, failed, seconds, requests / seconds, samples[(int)(0.50 * (requests - 1))], samples[(int)(0.99 * (requests - 1))]);
+	return failed != 0;
+}
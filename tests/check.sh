@@ -0,0 +1,89 @@
+#!/bin/sh
+#Regression checks for wsh
+#Each case runs a script through the shell under a time limit and compares what it
+#prints (stdout and stderr together) with what is expected.
+#
+#Usage: tests/check.sh path/to/wsh
+SHELL_UNDER_TEST=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+WORK=$(mktemp -d /tmp/wsh-check-XXXXXX)
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK" || exit 1
+FAILED=0
+
+#Used to run one case: check name expected-output script
+check(){
+	printf '%s\n' "$3" > case.wsh
+	actual=$(timeout 20 "$SHELL_UNDER_TEST" case.wsh 2>&1; echo "rc=$?")
+	if [ "$actual" = "$2" ]; then
+		echo "ok   $1"
+	else
+		echo "FAIL $1"
+		printf 'expected:\n%s\nactual:\n%s\n' "$2" "$actual"
+		FAILED=1
+	fi
+}
+
+#Used to run one case and compare only its stdout: check_stdout name expected script [options]
+check_stdout(){
+	printf '%s\n' "$3" > case.wsh
+	actual=$(timeout 20 "$SHELL_UNDER_TEST" $4 case.wsh 2>/dev/null; echo "rc=$?")
+	if [ "$actual" = "$2" ]; then
+		echo "ok   $1"
+	else
+		echo "FAIL $1"
+		printf 'expected:\n%s\nactual:\n%s\n' "$2" "$actual"
+		FAILED=1
+	fi
+}
+
+#More data than a pipe holds, so every stage has to be running at once
+seq 1 2000000 > big.txt
+
+check "builtin | external | builtin" "$(grep -c 1 big.txt)
+rc=0" 'cat big.txt | /bin/grep 1 | cat >out.txt
+/bin/wc -l <out.txt'
+
+check "builtin | external | builtin | external" "$(grep -c 1 big.txt)
+rc=0" 'cat big.txt | /bin/grep 1 | cat | /bin/wc -l'
+
+#Built-In commands report failure, so conditions see it
+check "failing builtins" "cd: No such file or directory
+1
+wait: No such job
+1
+cd: No such file or directory
+right
+rc=0" 'cd /nonexistent
+echo $?
+wait 5
+echo $?
+if cd /nonexistent
+then
+echo wrong
+else
+echo right
+fi'
+
+#cat stops quietly once its reader is gone, like /bin/cat killed by SIGPIPE
+check "cat into a closed pipe" "1
+rc=0" 'cat big.txt | /bin/head -1'
+
+#A timed cd still changes the directory of the shell in parallel mode
+mkdir sub
+check_stdout "time cd under -j" "$WORK/sub
+rc=0" 'time cd sub
+/bin/pwd' "-j 4"
+
+#The shell starts without PATH in its environment and still finds commands in /bin
+printf 'echo $PATH\nhead -1 big.txt\n' > case.wsh
+actual=$(timeout 20 env -u PATH "$SHELL_UNDER_TEST" case.wsh 2>&1; echo "rc=$?")
+if [ "$actual" = "/bin
+1
+rc=0" ]; then
+	echo "ok   no PATH in the environment"
+else
+	echo "FAIL no PATH in the environment"
+	printf 'actual:\n%s\n' "$actual"
+	FAILED=1
+fi
+exit $FAILED
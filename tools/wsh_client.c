@@ -0,0 +1,125 @@
+//Client for wsh server mode (wsh --serve socket)
+//It sends each command as one request and prints the captured stdout and stderr
+//of the response. With no command on the command line, every line of stdin is
+//sent as its own request. Exits with the status of the last request.
+//
+//Usage: wsh_client socket [command ...]
+#include "wsh.h"
+
+//Used to read exactly length bytes from the server
+//Returns 0 once they are all read
+int read_all(int fd, char *buffer, size_t length){
+	while(length > 0){
+		ssize_t bytes = read(fd, buffer, length);
+		if(bytes < 0 && errno == EINTR){
+			continue;
+		}
+		if(bytes <= 0){
+			return -1;
+		}
+		buffer += bytes;
+		length -= bytes;
+	}
+	return 0;
+}
+
+//Used to write exactly length bytes to an fd
+//Returns 0 once they are all written
+int write_all(int fd, const char *buffer, size_t length){
+	while(length > 0){
+		ssize_t written = write(fd, buffer, length);
+		if(written < 0 && errno == EINTR){
+			continue;
+		}
+		if(written < 0){
+			return -1;
+		}
+		buffer += written;
+		length -= written;
+	}
+	return 0;
+}
+
+//This method will copy length bytes of a response from the server into fd
+int copy_response(int server, int fd, uint32_t length){
+	char buffer[BATCH_READ_SIZE];
+	while(length > 0){
+		size_t chunk = length < sizeof(buffer) ? length : sizeof(buffer);
+		if(read_all(server, buffer, chunk) != 0){
+			return -1;
+		}
+		write_all(fd, buffer, chunk);
+		length -= chunk;
+	}
+	return 0;
+}
+
+//This method will send one request and print its response
+//Returns the request's exit status, or -1 if the server went away
+int send_request(int server, const char *command, size_t length){
+	uint32_t frame = htonl((uint32_t)length);
+	ServeResponseHeader header;
+	if(write_all(server, (const char *)&frame, sizeof(frame)) != 0 || write_all(server, command, length) != 0 ||
+		read_all(server, (char *)&header, sizeof(header)) != 0){
+		return -1;
+	}
+	if(copy_response(server, STDOUT_FILENO, ntohl(header.out_length)) != 0 ||
+		copy_response(server, STDERR_FILENO, ntohl(header.err_length)) != 0){
+		return -1;
+	}
+	return (int)ntohl(header.status);
+}
+
+int main(int argc, char *argv[]){
+	if(argc < 2){
+		fprintf(stderr, "Usage: %s socket [command ...]\n", argv[0]);
+		return 2;
+	}
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, argv[1], sizeof(address.sun_path) - 1);
+	int server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(server < 0 || connect(server, (struct sockaddr *)&address, sizeof(address)) != 0){
+		perror(argv[1]);
+		return 2;
+	}
+	int status = 0;
+	//The words on the command line make up a single request
+	if(argc > 2){
+		size_t length = 0;
+		for(int i = 2; i < argc; i++){
+			length += strlen(argv[i]) + 1;
+		}
+		char *command = malloc(length);
+		char *end = command;
+		for(int i = 2; i < argc; i++){
+			end = stpcpy(end, argv[i]);
+			*end++ = ' ';
+		}
+		status = send_request(server, command, length - 1);
+		free(command);
+	}
+	else{
+		char *line = NULL;
+		size_t capacity = 0;
+		ssize_t length;
+		while(status >= 0 && (length = getline(&line, &capacity, stdin)) > 0){
+			if(line[length - 1] == '\n'){
+				--length;
+			}
+			status = send_request(server, line, length);
+			//The server ends the session after exit
+			if(length == 4 && memcmp(line, "exit", 4) == 0){
+				break;
+			}
+		}
+		free(line);
+	}
+	close(server);
+	if(status < 0){
+		fprintf(stderr, "%s: server closed the connection\n", argv[0]);
+		return 2;
+	}
+	return status;
+}
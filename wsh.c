@@ -3,143 +3,846 @@
 //Global Variables (specified in wsh.h)
 //By default, we start with nothing in the varible list, they will later be added
 //by the local command when we need to
-ShellVariables *variables = NULL;
+ShellVariables variables = { NULL, 0, 0, NULL, 0 };
 //By default, the history list max size is 5, but this can be changed in the history functon
-History history_list = { .command_count = 0, .maximum_size = HISTORY_MAXIMUM };
+History history_list = { .commands = NULL, .command_count = 0, .maximum_size = HISTORY_MAXIMUM, .file_fd = -1 };
 //By default, we will exit with 0, otherwise it should return 255 or -1 by Test 11
 int exit_value = 0;
+//By default, the last command succeeded ($? is 0 before anything has run)
+int last_status = 0;
+//By default, the export table is empty and is loaded from environ when first needed
+ExportTable export_table = { .loaded = 0 };
+//By default, the command path cache is empty and is filled in as commands are run
+PathCache path_cache = { .hits = 0, .misses = 0 };
+//By default, external commands are launched with posix_spawn (see wsh.h)
+int launch_mode = LAUNCH_DEFAULT;
+//By default, the zygote pool isnt started, the zygote launch backend starts it
+ZygotePool zygote_pool = { .owner = 0, .control_fd = -1 };
+//By default, the command arena has no blocks, they are allocated by the first command
+Arena command_arena = { NULL, NULL };
+//By default, the script arena is empty, it holds the compiled form of a script
+Arena script_arena = { NULL, NULL };
+//By default, the append cache is off, batch runs turn it on
+AppendCache append_cache = { .enabled = 0, .clock = 0 };
+//By default, the output buffer is empty
+OutputBuffer output_buffer = { .used = 0 };
+//By default, commands are only timed when they start with time (WSH_PROFILE turns on profiling)
+int profile_enabled = 0;
+CommandTiming command_timing;
+ProfileEntry *profile_entries = NULL;
+//By default, no command substitution is running and no capture file has been made
+SubstitutionState substitution = { .depth = 0 };
+//By default, no directory has been read, ls and globs fill the snapshot cache
+SnapshotCache snapshot_cache = { .clock = 0 };
+//By default, the line editor is off, interactive shells at a terminal turn it on
+LineEditor line_editor = { .enabled = 0 };
+//By default, the completion index is empty and is built by the first Tab
+CompletionIndex completion_index = { .path = NULL };
+//By default, there are no background jobs, they are added by commands ending in &
+Job job_table[JOBS_MAXIMUM];
+//By default, no job has been numbered, each new job gets the next serial
+unsigned long job_serial = 0;
+//By default, there is no job control, an interactive shell at a terminal turns it on
+int job_control = 0;
+//By default, commands are launched into the shell's own process group
+pid_t launch_process_group = -1;
 
 //Process Command will take in the string of command arguments and process them into
 //tokens which the program can read. Then, it will use the tokens to call the methods
-//of the requested commands
-void process_command(char *command){
+//of the requested commands. The line is a (pointer, length) view that is never
+//written to, and everything built for the command lives in the command arena
+void process_command(const char *line, size_t length){
+	//Commands are timed when the shell is profiling or the line starts with the word
+	//time, so timeout or timex are left alone
+	int timing = profile_enabled || (length >= 4 && memcmp(line, "time", 4) == 0 && (length == 4 || line[4] == ' ' || line[4] == '\t'));
+	double started = timing ? monotonic_seconds() : 0;
+	//A line typed or replayed once is compiled straight into the command arena
+	CompiledCommand *compiled = compile_command(line, length, &command_arena);
+	if(compiled == NULL){
+		return;
+	}
+	compiled -> transient = 1;
+	execute_compiled_command(compiled, timing ? monotonic_seconds() - started : 0);
+}
+
+//Execute Compiled Command will run a command that has already been parsed
+//Only its dynamic words (the ones holding a $) are expanded again, the rest are
+//used as they were compiled. parse_seconds is the time spent compiling it, if any
+void execute_compiled_command(CompiledCommand *compiled, double parse_seconds){
+	//A replayed history command gets its own timing, so keep the outer one
+	CommandTiming outer_timing = command_timing;
+	memset(&command_timing, 0, sizeof(CommandTiming));
+	command_timing.active = profile_enabled || compiled -> timed;
+	double started = command_timing.active ? monotonic_seconds() - parse_seconds : 0;
+	struct rusage self_start;
+	if(command_timing.active){
+		getrusage(RUSAGE_SELF, &self_start);
+	}
+	command_timing.parse = parse_seconds;
+	if(compiled -> syntax_error){
+		fprintf(stderr, "wsh: syntax error near '|'\n");
+		last_status = 2;
+		command_timing = outer_timing;
+		return;
+	}
+
+	//Expand the words of every stage
+	double expand_started = command_timing.active ? monotonic_seconds() : 0;
+	Command *stages = arena_alloc(&command_arena, compiled -> stage_count * sizeof(Command));
+	int stage_count = compiled -> stage_count;
+	for(int i = 0; i < stage_count; i++){
+		expand_compiled_stage(&compiled -> stages[i], &stages[i], compiled -> transient);
+		//A stage whose words all expanded to nothing has no command to run
+		if(stages[i].args[0] == NULL && stage_count > 1){
+			fprintf(stderr, "wsh: syntax error near '|'\n");
+			last_status = 2;
+			command_timing = outer_timing;
+			return;
+		}
+	}
+	if(command_timing.active){
+		command_timing.substitute = monotonic_seconds() - expand_started;
+	}
+	char **args = stages[0].args;
+	//A bare time has nothing to run but still reports
+	if(args[0] == NULL){
+		if(compiled -> timed){
+			add_to_history(compiled -> text, compiled -> length);
+			report_command_timing("time", started, &self_start, 1);
+		}
+		command_timing = outer_timing;
+		return;
+	}
+
+	//Every command except those registered not to (history itself) goes into
+	//the history list. The history list takes the original line, from before the substitution
+	const Builtin *builtin = stage_builtin(&stages[0]);
+	//Commands run for a $(...) substitution are part of the line that holds it
+	if(substitution.depth == 0 && (stage_count > 1 || builtin == NULL || builtin -> add_to_history)){
+		add_to_history(compiled -> text, compiled -> length);
+	}
+	for(int i = 0; i < stage_count; i++){
+		if(stages[i].dispatch == DISPATCH_BUILTIN && lookup_builtin(stages[i].args[0]) == NULL){
+			fprintf(stderr, "builtin: %s: not a shell builtin\n", stages[i].args[0]);
+			last_status = 1;
+			command_timing = outer_timing;
+			return;
+		}
+	}
+
+	//Pipelines launch all of their stages at once
+	//Background commands are launched the same way but are not waited on,
+	//a Built-In one runs in a forked copy of the shell
+	Redirection *redirection = &stages[0].redirection;
+	if(stage_count > 1 || compiled -> background){
+		execute_pipeline(stages, stage_count, compiled -> background ? arena_strndup(&command_arena, compiled -> text, compiled -> length) : NULL);
+	}
+	//Built-In commands run inside the shell, so if we need to utilize
+	//redirection functionality it has to be applied to the shell's own stdin,
+	//stdout and stderr, and they are put back once the command finishes.
+	//External commands get their redirections applied only in the launched child
+	else if(builtin != NULL){
+		int fds[3];
+		int saved[3];
+		if(open_redirection_files(redirection, fds) != 0){
+			last_status = 1;
+		}
+		else{
+			redirect_shell_fds(fds, saved);
+			close_redirection_files(fds);
+			execute_builtin(args);
+			restore_shell_fds(saved);
+		}
+	}
+	//If none of the Built-In Commands matched
+	//We will call execute command to process it
+	else{
+		execute_shell_command(args, redirection, stages[0].environment);
+	}
+
+	if(command_timing.active){
+		report_command_timing(args[0], started, &self_start, compiled -> timed);
+	}
+	command_timing = outer_timing;
+}
+
+//Expand Compiled Stage will turn a compiled stage into the arguments and
+//redirections it runs with. A dynamic word is expanded and split on whitespace, so a
+//variable or a $(...) can still hold several arguments, and a glob pattern becomes
+//the sorted names that match it. Static words are copied, since
+//some Built-In commands tokenize their arguments in place, unless the stage
+//is transient and will never run again
+void expand_compiled_stage(CompiledStage *compiled, Command *stage, int transient){
+	int capacity = compiled -> word_count + 1;
+	char **args = arena_alloc(&command_arena, capacity * sizeof(char *));
+	int i = 0;
+	for(int w = 0; w < compiled -> word_count; w++){
+		Word *word = &compiled -> words[w];
+		if(!word -> dynamic){
+			//A pattern that matches nothing is passed on as it is
+			if(word -> glob == NULL || expand_glob(word -> glob, &command_arena, &args, &i, &capacity) == 0){
+				append_glob_match(&command_arena, &args, &i, &capacity, transient ? word -> text : arena_strndup(&command_arena, word -> text, word -> length));
+			}
+			continue;
+		}
+		char *value = substitute_command_variables(word -> text, word -> length);
+		char *save = NULL;
+		for(char *token = strtok_r(value, WORD_SEPARATORS, &save); token != NULL; token = strtok_r(NULL, WORD_SEPARATORS, &save)){
+			//A value can hold a pattern of its own, it is compiled and matched here
+			GlobPattern *pattern = compile_glob(token, &command_arena);
+			if(pattern == NULL || expand_glob(pattern, &command_arena, &args, &i, &capacity) == 0){
+				append_glob_match(&command_arena, &args, &i, &capacity, token);
+			}
+		}
+	}
+	args[i] = NULL;  // Null-terminate the args array
+	//A leading command or builtin picks the implementation a name runs with
+	stage -> dispatch = DISPATCH_ANY;
+	if(i > 1 && (strcmp(args[0], "command") == 0 || strcmp(args[0], "builtin") == 0)){
+		stage -> dispatch = args[0][0] == 'c' ? DISPATCH_EXTERNAL : DISPATCH_BUILTIN;
+		++args;
+		--i;
+	}
+	stage -> args = args;
+	stage -> arg_count = i;
+	//The command's own enviroment is the shell's with its assignments laid over it
+	stage -> environment = NULL;
+	if(compiled -> assignment_count > 0){
+		char **assignments = arena_alloc(&command_arena, compiled -> assignment_count * sizeof(char *));
+		for(int a = 0; a < compiled -> assignment_count; a++){
+			assignments[a] = expand_word(&compiled -> assignments[a], transient);
+		}
+		stage -> environment = overlay_environment(assignments, compiled -> assignment_count);
+	}
+	stage -> redirection.input_file = expand_word(&compiled -> input_file, transient);
+	stage -> redirection.output_file = expand_word(&compiled -> output_file, transient);
+	stage -> redirection.error_file = expand_word(&compiled -> error_file, transient);
+	stage -> redirection.append = compiled -> append;
+}
+
+//Used to expand a single word, such as a redirection target, without splitting it
+//Will return NULL if the word isnt there
+char *expand_word(Word *word, int transient){
+	if(word -> text == NULL){
+		return NULL;
+	}
+	if(word -> dynamic){
+		return substitute_command_variables(word -> text, word -> length);
+	}
+	return transient ? word -> text : arena_strndup(&command_arena, word -> text, word -> length);
+}
+
+
+// Methods for Script Compilation
+
+
+//Compile Command will parse a command line once into its pipeline stages
+//The line is trimmed the way the shell always has and copied into the arena, so
+//the compiled command doesnt depend on the line staying around.
+//Will return NULL for a blank line or a comment
+CompiledCommand *compile_command(const char *line, size_t length, Arena *arena){
 	//Strip new line from the end of command
-	size_t len = strlen(command);
-	if(command[len - 1] == '\n' && len > 0){
-		command[len - 1] = '\0';
+	if(length > 0 && line[length - 1] == '\n'){
+		--length;
 	}
 
 	//Remove new lines from the end of the command
 	//and remove leading whitespace at start
-	while(*command == ' '){
-		command++;
+	while(length > 0 && *line == ' '){
+		line++;
+		length--;
 	}
 	
-	//Create a copy of the command path to add to history.
-	//This needs to be done BEFORE the command is tokenized.
-	//I ran into issues with Test 3 if I didnt do this...
-	char *command_to_add = strdup(command);
-	
+	//Disregard all New 
+	if(length == 0){
+		return NULL;
+	}
 	//Disregard all Comments
-	if(*command == '#'){
-		free(command_to_add);
-		return;
+	if(*line == '#'){
+		return NULL;
 	}
-	//Disregard all New 
-	if(*command == '\0'){
-		free(command_to_add);
-		return;
+
+	CompiledCommand *compiled = arena_alloc(arena, sizeof(CompiledCommand));
+	memset(compiled, 0, sizeof(CompiledCommand));
+	compiled -> text = arena_strndup(arena, line, length);
+	compiled -> length = length;
+	//The words point into a second copy that gets tokenized
+	char *command = arena_strndup(arena, line, length);
+
+	//A trailing '&' means the command runs in the background
+	char *end = command + length;
+	while(end > command && end[-1] == ' '){
+		--end;
 	}
-	
-	//Process the command so it can read it
-	substitute_command_variables(command);
-
-	char *args[ARGS_MAXIMUM];
-	// Initialize variables for input, output, and error files
-	char *input_file = NULL;
-	char *output_file = NULL;
-	char *error_file = NULL;
-	int append = 0;
+	if(end > command && end[-1] == '&'){
+		end[-1] = '\0';
+		compiled -> background = 1;
+	}
+
+	//Split the command into the stages of a pipeline
+	//Each '|' ends one stage and starts the next, unless it is inside a $(...)
+	int stage_capacity = 0;
+	char *stage_text = command;
+	while(stage_text != NULL){
+		char *bar = find_unsubstituted(stage_text, '|');
+		if(bar != NULL){
+			*bar = '\0';
+		}
+		if(compiled -> stage_count == stage_capacity){
+			int capacity = stage_capacity ? stage_capacity * 2 : 4;
+			compiled -> stages = arena_grow(arena, compiled -> stages, stage_capacity * sizeof(CompiledStage), capacity * sizeof(CompiledStage));
+			stage_capacity = capacity;
+		}
+		CompiledStage *stage = &compiled -> stages[compiled -> stage_count];
+		compile_stage(stage_text, stage, arena);
+		//A leading time only asks for the command to be timed
+		if(compiled -> stage_count == 0 && stage -> word_count > 0 && strcmp(stage -> words[0].text, "time") == 0){
+			stage -> words++;
+			stage -> word_count--;
+			compiled -> timed = 1;
+		}
+		//A stage made up only of redirections has no command to run
+		if(stage -> word_count == 0 && (bar != NULL || compiled -> stage_count > 0)){
+			compiled -> syntax_error = 1;
+		}
+		++compiled -> stage_count;
+		stage_text = bar != NULL ? bar + 1 : NULL;
+	}
+	return compiled;
+}
+
+//Compile Stage will tokenize one stage of a command line
+//It will pull out the redirections and store the remaining tokens as the words.
+//The words array grows inside the arena, so there is no limit on arguments
+void compile_stage(char *text, CompiledStage *stage, Arena *arena){
+	int capacity = 8;
+	Word *words = arena_alloc(arena, capacity * sizeof(Word));
 	int i = 0;
+	memset(stage, 0, sizeof(CompiledStage));
 
 	// Tokenize command
-	char *token = strtok(command, " ");
-	while (token != NULL && i < ARGS_MAXIMUM - 1) {
+	char *cursor = text;
+	char *token = next_command_word(&cursor);
+	while (token != NULL) {
     		if (token[0] == '>') {
        		 // '>' indicates to append
        			 if (token[1] == '>') {
-            			output_file = token + 2;
-            			append = 1;
+            			stage -> output_file = make_word(token + 2);
+            			stage -> append = 1;
         		} 
         		else {
-            			output_file = token + 1;
-            			append = 0;
+            			stage -> output_file = make_word(token + 1);
+            			stage -> append = 0;
         		}	
     		}
     		// Check for error redirection
     		else if (token[0] == '2' && token[1] == '>') {
-        		error_file = token + 2;  // Get the file name for stderr redirection
+        		stage -> error_file = make_word(token + 2);  // Get the file name for stderr redirection
     		}
     		// Handle input redirection
     		else if (token[0] == '<') {
-       			input_file = token + 1;
+       			stage -> input_file = make_word(token + 1);
     		} 
     		else {
-        		args[i++] = token;  // Store command arguments
+        		if (i == capacity) {
+            			words = arena_grow(arena, words, capacity * sizeof(Word), capacity * 2 * sizeof(Word));
+            			capacity *= 2;
+        		}
+        		words[i++] = make_word(token);  // Store command arguments
+        		//A pattern is compiled here once and matched each time the stage runs
+        		if (!words[i - 1].dynamic) {
+            			words[i - 1].glob = compile_glob(token, arena);
+        		}
     		}
-    		token = strtok(NULL, " ");
+    		token = next_command_word(&cursor);
 	}	
-	args[i] = NULL;  // Null-terminate the args array
-	
-	free(token);
-	
-	//Call the requested command if we need to utilize
-	//redirection functionality
-	if(output_file != NULL || input_file != NULL || error_file != NULL){
-		execute_redirection(input_file, output_file, error_file, append);
+	//NAME=value words in front of a command only go into its enviroment
+	//A line of nothing but assignments is left as it is
+	int assignments = 0;
+	while(assignments < i - 1 && is_assignment_word(words[assignments].text, words[assignments].length)){
+		words[assignments++].glob = NULL;
+	}
+	stage -> assignments = words;
+	stage -> assignment_count = assignments;
+	stage -> words = words + assignments;
+	stage -> word_count = i - assignments;
+}
+
+//Used to split the next word off a command line, like strtok_r on spaces
+//A $(...) substitution stays in one word, spaces and all. Returns NULL at the end
+char *next_command_word(char **cursor){
+	char *text = *cursor;
+	while(*text == ' '){
+		++text;
+	}
+	if(*text == '\0'){
+		*cursor = text;
+		return NULL;
+	}
+	char *word = text;
+	int depth = 0;
+	for(; *text != '\0' && (*text != ' ' || depth > 0); ++text){
+		if(*text == '$' && text[1] == '('){
+			++depth;
+			++text;
+		}
+		else if(*text == '(' && depth > 0){
+			++depth;
+		}
+		else if(*text == ')' && depth > 0){
+			--depth;
+		}
+	}
+	if(*text != '\0'){
+		*text++ = '\0';
+	}
+	*cursor = text;
+	return word;
+}
+
+//Used to find the next c in text that isnt inside a $(...) substitution
+//Will return NULL if there isnt one
+char *find_unsubstituted(char *text, char c){
+	int depth = 0;
+	for(; *text != '\0'; ++text){
+		if(*text == c && depth == 0){
+			return text;
+		}
+		if(*text == '$' && text[1] == '('){
+			++depth;
+			++text;
+		}
+		else if(*text == '(' && depth > 0){
+			++depth;
+		}
+		else if(*text == ')' && depth > 0){
+			--depth;
+		}
+	}
+	return NULL;
+}
+
+//Used to make a word out of a token
+//A word holding a $ is dynamic and gets expanded every time it runs
+Word make_word(char *text){
+	Word word;
+	word.text = text;
+	word.length = strlen(text);
+	word.dynamic = memchr(text, '$', word.length) != NULL;
+	word.glob = NULL;
+	return word;
+}
+
+//This method will get a compile state ready to read statements from the reader
+//The compiled script is kept in the script arena
+void init_compile_state(CompileState *state, BatchReader *reader, int interactive){
+	memset(state, 0, sizeof(CompileState));
+	state -> reader = reader;
+	state -> arena = &script_arena;
+	state -> interactive = interactive;
+}
+
+//Compile Script will parse a whole script once into a list of statements
+//Will return NULL with state -> error set if the script has a syntax error
+ScriptNode *compile_script(CompileState *state){
+	ScriptNode *script = compile_statements(state, NULL);
+	return state -> error ? NULL : script;
+}
+
+//Compile Statements will parse statements until one of the terminators (like fi
+//or done) starts a line, or the input ends. The terminator that ended the block and
+//the rest of its line are left in the state
+ScriptNode *compile_statements(CompileState *state, const char *const terminators[]){
+	ScriptNode *first = NULL;
+	ScriptNode **tail = &first;
+	int first_line = 1;
+	const char *line;
+	size_t length;
+	while(!state -> error){
+		//Blocks typed at the prompt continue on the next line
+		if(state -> interactive ? !read_interactive_line(state -> reader, "> ", &line, &length) : !next_batch_line(state -> reader, &line, &length)){
+			break;
+		}
+		++state -> line;
+		trim_script_line(&line, &length);
+		if(length == 0 || *line == '#'){
+			continue;
+		}
+		//then and do can sit on a line of their own at the start of a block
+		if(first_line && ((length == 4 && memcmp(line, "then", 4) == 0) || (length == 2 && memcmp(line, "do", 2) == 0))){
+			first_line = 0;
+			continue;
+		}
+		first_line = 0;
+		for(int t = 0; terminators != NULL && terminators[t] != NULL; t++){
+			if(script_keyword(line, length, terminators[t])){
+				size_t keyword_length = strlen(terminators[t]);
+				state -> terminator = terminators[t];
+				state -> terminator_rest = line + keyword_length;
+				state -> terminator_rest_length = length - keyword_length;
+				return first;
+			}
+		}
+		ScriptNode *node = compile_statement(state, line, length);
+		if(node != NULL){
+			*tail = node;
+			tail = &node -> next;
+		}
+	}
+	//The last terminator is the one that closes the block
+	if(terminators != NULL && !state -> error){
+		int last = 0;
+		while(terminators[last + 1] != NULL){
+			++last;
+		}
+		fprintf(stderr, "wsh: line %d: syntax error: expected '%s'\n", state -> line, terminators[last]);
+		state -> error = 1;
+	}
+	state -> terminator = NULL;
+	return first;
+}
+
+//Compile Statement will parse the statement starting on the given line
+//if, for and while read the rest of their block from the state's reader.
+//Will return NULL for a blank line, a comment or a syntax error
+ScriptNode *compile_statement(CompileState *state, const char *line, size_t length){
+	static const char *const if_terminators[] = { "elif", "else", "fi", NULL };
+	static const char *const loop_terminators[] = { "done", NULL };
+	trim_script_line(&line, &length);
+	if(length == 0 || *line == '#'){
+		return NULL;
+	}
+	//A block keyword outside of its block is a mistake in the script
+	static const char *const stray[] = { "then", "do", "elif", "else", "fi", "done", NULL };
+	for(int k = 0; stray[k] != NULL; k++){
+		if(script_keyword(line, length, stray[k])){
+			fprintf(stderr, "wsh: line %d: syntax error near unexpected '%s'\n", state -> line, stray[k]);
+			state -> error = 1;
+			return NULL;
+		}
+	}
+	ScriptNode *node = arena_alloc(state -> arena, sizeof(ScriptNode));
+	memset(node, 0, sizeof(ScriptNode));
+	node -> line = state -> line;
+	if(script_keyword(line, length, "if")){
+		node -> type = NODE_IF;
+		node -> command = compile_condition(state, line + 2, length - 2, "then");
+		node -> body = compile_statements(state, if_terminators);
+		compile_else(state, node);
+	}
+	else if(script_keyword(line, length, "while")){
+		node -> type = NODE_WHILE;
+		node -> command = compile_condition(state, line + 5, length - 5, "do");
+		node -> body = compile_statements(state, loop_terminators);
+	}
+	else if(script_keyword(line, length, "for")){
+		node -> type = NODE_FOR;
+		if(compile_for_header(state, node, line + 3, length - 3) == 0){
+			node -> body = compile_statements(state, loop_terminators);
+		}
 	}
-	
-	//Now, were ready to call a command
-	//Based on what the leading argument is, call the matching mathod
-	//to execute the desired
-	if(strcmp(args[0], "exit") == 0){
-		add_to_history(command_to_add);
-		//jump to exit command
-		free(command_to_add);
-		execute_exit(args);
-	} 
-	else if(strcmp(args[0], "cd") == 0){
-		add_to_history(command_to_add);
-		free(command_to_add);
-		//jump to cd command
-		execute_cd(args);
-	} 
-	else if(strcmp(args[0], "export") == 0){
-		add_to_history(command_to_add);
-		free(command_to_add);
-		//jump to export command
-		execute_export(args[1]);
-	} 
-	else if(strcmp(args[0], "local") == 0){
-		add_to_history(command_to_add);
-		free(command_to_add);
-		//jump to history command
-		execute_local(args[1]);
-	} 
-	else if(strcmp(args[0], "vars") == 0){
-		add_to_history(command_to_add);
-		free(command_to_add);
-		//jump to vars command
-		execute_vars();
-	} 
-	else if(strcmp(args[0], "history") == 0){
-		free(command_to_add);
-		//jump to history command
-		execute_history(args);
-	} 
-	else if(strcmp(args[0], "ls") == 0){
-		add_to_history(command_to_add);
-		free(command_to_add);
-		//jump to ls command
-		execute_ls();
-	} 
-	//If none of the Built-In Commands matched
-	//We will call execute command to process it
 	else{
-		add_to_history(command_to_add);
-		free(command_to_add);
-		execute_shell_command(args);
+		node -> type = NODE_COMMAND;
+		node -> command = compile_command(line, length, state -> arena);
+	}
+	return state -> error ? NULL : node;
+}
+
+//Compile Else will parse what follows the body of an if, based on the terminator that ended it
+//An elif becomes an if of its own in the else branch
+void compile_else(CompileState *state, ScriptNode *node){
+	static const char *const if_terminators[] = { "elif", "else", "fi", NULL };
+	static const char *const else_terminators[] = { "fi", NULL };
+	if(state -> error){
+		return;
+	}
+	if(state -> terminator == if_terminators[1]){
+		node -> otherwise = compile_statements(state, else_terminators);
+	}
+	else if(state -> terminator == if_terminators[0]){
+		ScriptNode *branch = arena_alloc(state -> arena, sizeof(ScriptNode));
+		memset(branch, 0, sizeof(ScriptNode));
+		branch -> type = NODE_IF;
+		branch -> line = state -> line;
+		branch -> command = compile_condition(state, state -> terminator_rest, state -> terminator_rest_length, "then");
+		branch -> body = compile_statements(state, if_terminators);
+		node -> otherwise = branch;
+		compile_else(state, branch);
+	}
+}
+
+//Compile Condition will parse the command of an if, elif or while
+//A trailing "; then" or "; do" is allowed, like in other shells
+CompiledCommand *compile_condition(CompileState *state, const char *text, size_t length, const char *keyword){
+	size_t keyword_length = strlen(keyword);
+	trim_script_line(&text, &length);
+	if(length > keyword_length && memcmp(text + length - keyword_length, keyword, keyword_length) == 0){
+		size_t cut = length - keyword_length;
+		while(cut > 0 && text[cut - 1] == ' '){
+			--cut;
+		}
+		if(cut > 0 && text[cut - 1] == ';'){
+			length = cut - 1;
+		}
+	}
+	CompiledCommand *condition = compile_command(text, length, state -> arena);
+	if(condition == NULL){
+		fprintf(stderr, "wsh: line %d: syntax error: missing condition\n", state -> line);
+		state -> error = 1;
+	}
+	return condition;
+}
+
+//Compile For Header will parse "NAME in words" (with an optional "; do") of a for loop
+//Returns 0 if the header is valid
+int compile_for_header(CompileState *state, ScriptNode *node, const char *text, size_t length){
+	char *header = arena_strndup(state -> arena, text, length);
+	char *cursor = header;
+	char *name = next_command_word(&cursor);
+	char *in = next_command_word(&cursor);
+	if(name == NULL || (*name >= '0' && *name <= '9') || variable_name_length(name, name + strlen(name)) != strlen(name) ||
+		in == NULL || strcmp(in, "in") != 0){
+		fprintf(stderr, "wsh: line %d: syntax error: expected 'for NAME in words'\n", state -> line);
+		state -> error = 1;
+		return -1;
+	}
+	node -> variable = name;
+	int capacity = 8;
+	node -> words = arena_alloc(state -> arena, capacity * sizeof(Word));
+	for(char *token = next_command_word(&cursor); token != NULL; token = next_command_word(&cursor)){
+		//The words can end with "; do" or "do;" style separators
+		size_t token_length = strlen(token);
+		int ends_header = token_length > 0 && token[token_length - 1] == ';';
+		if(ends_header){
+			token[--token_length] = '\0';
+		}
+		if(strcmp(token, "do") == 0 && (ends_header || next_command_word(&cursor) == NULL)){
+			break;
+		}
+		if(token_length > 0){
+			if(node -> word_count == capacity){
+				node -> words = arena_grow(state -> arena, node -> words, capacity * sizeof(Word), capacity * 2 * sizeof(Word));
+				capacity *= 2;
+			}
+			node -> words[node -> word_count] = make_word(token);
+			if(!node -> words[node -> word_count].dynamic){
+				node -> words[node -> word_count].glob = compile_glob(token, state -> arena);
+			}
+			++node -> word_count;
+		}
+		if(ends_header){
+			char *rest = next_command_word(&cursor);
+			if(rest != NULL && strcmp(rest, "do") != 0){
+				fprintf(stderr, "wsh: line %d: syntax error near '%s'\n", state -> line, rest);
+				state -> error = 1;
+				return -1;
+			}
+			break;
+		}
+	}
+	return 0;
+}
+
+//Used to check if a script line starts with the given keyword as a whole word
+int script_keyword(const char *line, size_t length, const char *keyword){
+	size_t keyword_length = strlen(keyword);
+	return length >= keyword_length && memcmp(line, keyword, keyword_length) == 0 &&
+		(length == keyword_length || line[keyword_length] == ' ' || line[keyword_length] == ';');
+}
+
+//Used to trim the new line and the spaces and tabs around a script line
+//Scripts are free to indent the bodies of their blocks
+void trim_script_line(const char **line, size_t *length){
+	while(*length > 0 && (**line == ' ' || **line == '\t')){
+		++*line;
+		--*length;
+	}
+	while(*length > 0 && ((*line)[*length - 1] == '\n' || (*line)[*length - 1] == ' ' || (*line)[*length - 1] == '\t')){
+		--*length;
+	}
+}
+
+//Used to check if a line starts an if, for or while block
+int is_script_block(const char *line, size_t length){
+	trim_script_line(&line, &length);
+	return script_keyword(line, length, "if") || script_keyword(line, length, "for") || script_keyword(line, length, "while");
+}
+
+
+// Methods for Script Execution
+
+
+//Execute Script will run a list of compiled statements
+//Nothing is parsed here, every command runs from its compiled form
+void execute_script(ScriptNode *node){
+	for(; node != NULL; node = node -> next){
+		switch(node -> type){
+			case NODE_COMMAND:
+				notify_finished_jobs(1);
+				execute_compiled_command(node -> command, 0);
+				arena_reset(&command_arena);
+				break;
+			case NODE_IF:
+				if(execute_condition(node -> command)){
+					execute_script(node -> body);
+				}
+				else{
+					execute_script(node -> otherwise);
+				}
+				break;
+			case NODE_WHILE:
+				while(execute_condition(node -> command)){
+					execute_script(node -> body);
+				}
+				break;
+			case NODE_FOR:
+				execute_for(node);
+				break;
+		}
+	}
+}
+
+//Used to run the condition of an if or while
+//Returns 1 if the command succeeded
+int execute_condition(CompiledCommand *condition){
+	notify_finished_jobs(1);
+	execute_compiled_command(condition, 0);
+	arena_reset(&command_arena);
+	return last_status == 0;
+}
+
+//This method will run a for loop
+//The words are expanded once when the loop starts, into an arena of the loop's own
+//since the command arena is reset after every command of the body
+void execute_for(ScriptNode *node){
+	Arena loop_arena = { NULL, NULL };
+	int capacity = node -> word_count + 1;
+	char **values = arena_alloc(&loop_arena, capacity * sizeof(char *));
+	int count = 0;
+	for(int w = 0; w < node -> word_count; w++){
+		Word *word = &node -> words[w];
+		if(word -> glob != NULL && expand_glob(word -> glob, &loop_arena, &values, &count, &capacity) > 0){
+			continue;
+		}
+		char *value = word -> dynamic ? substitute_command_variables(word -> text, word -> length) : word -> text;
+		char *save = NULL;
+		for(char *token = strtok_r(arena_strndup(&loop_arena, value, strlen(value)), WORD_SEPARATORS, &save); token != NULL; token = strtok_r(NULL, WORD_SEPARATORS, &save)){
+			GlobPattern *pattern = word -> dynamic ? compile_glob(token, &loop_arena) : NULL;
+			if(pattern == NULL || expand_glob(pattern, &loop_arena, &values, &count, &capacity) == 0){
+				append_glob_match(&loop_arena, &values, &count, &capacity, token);
+			}
+		}
+	}
+	arena_reset(&command_arena);
+	for(int i = 0; i < count; i++){
+		set_variable(&variables, node -> variable, values[i]);
+		execute_script(node -> body);
+	}
+	arena_free(&loop_arena);
+}
+
+//This method will print a compiled script (wsh --dump-ast)
+//Words that are expanded when they run are shown as (expand ...)
+void dump_script(ScriptNode *node, int depth){
+	for(; node != NULL; node = node -> next){
+		out_printf("%*s", depth * 2, "");
+		switch(node -> type){
+			case NODE_COMMAND:
+				dump_command(node -> command, node -> line);
+				out_printf("\n");
+				break;
+			case NODE_IF:
+				out_printf("(if ");
+				dump_command(node -> command, node -> line);
+				out_printf("\n%*s(then\n", depth * 2 + 2, "");
+				dump_script(node -> body, depth + 2);
+				out_printf("%*s)", depth * 2 + 2, "");
+				if(node -> otherwise != NULL){
+					out_printf("\n%*s(else\n", depth * 2 + 2, "");
+					dump_script(node -> otherwise, depth + 2);
+					out_printf("%*s)", depth * 2 + 2, "");
+				}
+				out_printf(")\n");
+				break;
+			case NODE_WHILE:
+				out_printf("(while ");
+				dump_command(node -> command, node -> line);
+				out_printf("\n");
+				dump_script(node -> body, depth + 1);
+				out_printf("%*s)\n", depth * 2, "");
+				break;
+			case NODE_FOR:
+				out_printf("(for %d %s", node -> line, node -> variable);
+				for(int w = 0; w < node -> word_count; w++){
+					dump_word(node -> words[w].dynamic ? "expand" : node -> words[w].glob != NULL ? "glob" : "word", &node -> words[w]);
+				}
+				out_printf("\n");
+				dump_script(node -> body, depth + 1);
+				out_printf("%*s)\n", depth * 2, "");
+				break;
+		}
+	}
+}
+
+//Used to print one compiled command for dump_script
+void dump_command(CompiledCommand *compiled, int line){
+	out_printf("(command %d \"%.*s\"", line, (int)compiled -> length, compiled -> text);
+	if(compiled -> timed){
+		out_printf(" time");
+	}
+	if(compiled -> background){
+		out_printf(" background");
+	}
+	if(compiled -> syntax_error){
+		out_printf(" syntax-error");
+	}
+	for(int i = 0; i < compiled -> stage_count; i++){
+		CompiledStage *stage = &compiled -> stages[i];
+		out_printf(" (stage");
+		for(int a = 0; a < stage -> assignment_count; a++){
+			dump_word("assign", &stage -> assignments[a]);
+		}
+		for(int w = 0; w < stage -> word_count; w++){
+			dump_word(stage -> words[w].dynamic ? "expand" : stage -> words[w].glob != NULL ? "glob" : "word", &stage -> words[w]);
+		}
+		dump_word("input", &stage -> input_file);
+		dump_word(stage -> append ? "append" : "output", &stage -> output_file);
+		dump_word("error", &stage -> error_file);
+		out_printf(")");
+	}
+	out_printf(")");
+}
+
+//Used to print one word for dump_script, if it is there
+void dump_word(const char *kind, Word *word){
+	if(word -> text != NULL){
+		out_printf(" (%s%s \"%s\")", kind, word -> dynamic && strcmp(kind, "expand") != 0 ? " expand" : "", word -> text);
+	}
+}
+
+//Execute Builtin will call the method of a Built-In command
+//The leading argument is looked up in the builtin registry, its arity is
+//checked and the matching method is called to execute the desired
+void execute_builtin(char *args[]){
+	const Builtin *builtin = lookup_builtin(args[0]);
+	if(builtin == NULL){
+		return;
 	}
+	int count = 0;
+	while(args[count + 1] != NULL){
+		++count;
+	}
+	if(count < builtin -> min_args || (builtin -> max_args >= 0 && count > builtin -> max_args)){
+		fprintf(stderr, "%s: %s\n", builtin -> name, builtin -> arity_error);
+		last_status = 1;
+		return;
+	}
+	//Built-In commands succeed unless they say otherwise: a failing one sets 1 (or its
+	//own status, like test), and wait and fg pass on their job's status
+	last_status = 0;
+	builtin -> handler(args);
+	//Whatever the command printed goes out in one go now that it is finished
+	out_flush();
 }
 
 
@@ -150,126 +853,102 @@ void process_command(char *command){
 //Upon recieving the exit command and no arguments,
 //this method will gracefully close the shell with the exit(0) command
 void execute_exit(char *args[]){
-	if(args[1] != NULL){
-		fprintf(stderr, "exit: Too many Arguments\n");
-		return;
-	}
-  	free(variables);
-  	for (int i = 0; i < history_list.command_count; i++) {
-    		if (history_list.commands[i] != NULL) {
-        		//Free each command slot
-        		free(history_list.commands[i]); 
-        	//Avoid dangling pointers
-        	history_list.commands[i] = NULL; 
-    		}
-	}
+	(void)args;
+	clear_path_cache();
+  	free_variables(&variables);
+	free_export_table();
+	clear_append_cache();
+	clear_directory_snapshots();
+	free_zygote_pool();
+	free_completion_index();
+	free_line_editor();
+	free_history();
+	out_flush();
+	print_profile();
 	exit(0);
 }
 
 //This method handles the cd command
-//This method will always take 1 argument
+//This method will always take 1 argument (checked by the builtin registry)
 //It will change the currently displayed directory in the shell
 void execute_cd(char *args[]){
-	if(args[2] != NULL){
-		fprintf(stderr, "cd: Wrong number of arguments\n");
-		return;
-	}
-	if(args[1] == NULL){
-		fprintf(stderr, "cd: Wrong number of arguments\n");
-		return;
-	}
 	if(chdir(args[1]) != 0){
 		perror("cd");
+		last_status = 1;
 	}
 }
 
 //This method will handle the export command
-//It will either create or assign variable VAR as an enviroment variable
-void execute_export(char *command){
+//It will either create or assign variable VAR as an enviroment variable.
+//export VAR on its own exports the shell variable VAR with its current value
+void execute_export(char *args[]){
 	//Tokenize the input name and value from the command
-	char *name = strtok(command, "=");
-	char *value = strtok(NULL, " ");
+	int bare = args[1] != NULL && strchr(args[1], '=') == NULL;
+	char *name = args[1] != NULL ? strtok(args[1], "=") : NULL;
+	char *value = name == NULL ? NULL : bare ? retrieve_shell_variable(name) : strtok(NULL, " ");
 	
 	//If a valid name and value is given, create the new enviroment variable
 	if(value && name){
-		setenv(name, value, 1);	
+		if(set_environment_variable(name, value) != 0){
+			perror("export");
+			last_status = 1;
+			return;
+		}
+		//A new PATH means any command we already resolved could now live
+		//somewhere else, so the cached paths are no longer trustworthy
+		if(strcmp(name, "PATH") == 0){
+			clear_path_cache();
+		}
 	} 
 	//If a valid name and value is not given, print out an error to the shell
 	else{
 		fprintf(stderr, "export: Invalid format, expected VAR=value\n");
+		last_status = 1;
 	}
 }
 
 //This method will handle the local command
 //It will either create or assign variable VAR as a shell variable
-void execute_local(char *command){
+void execute_local(char *args[]){
 	//Tokenize the input into name and value
-	char *name = strtok(command, "=");
-	char *value = strtok(NULL, " ");
+	char *name = args[1] != NULL ? strtok(args[1], "=") : NULL;
+	char *value = name != NULL ? strtok(NULL, " ") : NULL;
 	
 	//If a valid name and value is given, create the new shell variable
 	//This will utilize a seperate helper method to do so
 	if(value && name){
-		ShellVariables *vars = variables;
-		//Cycle through the shell variables and find the
-		//next empty node in the list
-		while(vars != NULL){
-			if(strcmp(vars -> name, name) == 0){
-				char *temp_val = strdup(value);
-				free(vars -> value);
-				vars -> value = temp_val;
-				free(temp_val);
-				return;
-			}
-			//set the previous to point to the new variable
-			vars = vars -> next;
-		}
-		
-		//Set up the new variables
-		ShellVariables *variable_new = malloc(sizeof(ShellVariables));
-		char *temp_value = strdup(value);
-		char *temp_name = strdup(name);
-		//It needs to have its name, value and the next node set to NULL
-		variable_new -> next = NULL;
-		variable_new -> value = strdup(value);
-		variable_new -> name = strdup(name);
-		//Be sure to free strdup variables once done :)
-		free(temp_value);
-		free(temp_name);
-		
-		//If the variable list doesnt exist yet, create it
-		if(variables == NULL){
-			variables = variable_new;
-		} 
-		//If the variable list does exist, we add the new node into 
-		//the correct spot
-		else{
-			ShellVariables *temporary = variables;
-			while(temporary -> next != NULL){
-				temporary = temporary->next;
-			}	
-			temporary -> next = variable_new;
-		}	
+		set_variable(&variables, name, value);
 	} 
 	
 	//no value is given, print out error and return
 	else{
 		fprintf(stderr, "local: Invalid format, expected VAR=value\n");
+		last_status = 1;
+	}
+}
+
+//This method will handle the unset command
+//Each name given stops being a shell variable and stops being exported
+void execute_unset(char *args[]){
+	for(int i = 1; args[i] != NULL; i++){
+		unset_variable(&variables, args[i]);
+		unset_environment_variable(args[i]);
+		if(strcmp(args[i], "PATH") == 0){
+			clear_path_cache();
+		}
 	}
 }
 
 //This method will handle the vars command
 //As a partner to the env utility program, this method will print
 //the local shell variables and their values in insertion order
-void execute_vars(){
-	ShellVariables *vars = variables;
-	//Cycle through the list of shell variables
+void execute_vars(char *args[]){
+	(void)args;
+	//Cycle through the shell variables in insertion order
 	//and print them out to the shell
-	while(vars != NULL){
+	for(int i = 0; i < variables.count; i++){
 		//Note - we print in the format "Name=Value"
-		printf("%s=%s\n", vars -> name, vars -> value);
-		//Move on to the next variable
-		vars = vars -> next;
+		out_printf("%s=%s\n", variables.entries[i].name, variables.entries[i].value);
 	}	
 }
 
@@ -282,26 +961,22 @@ void execute_history(char *args[]){
 	//If there are no arguments, we just want to print out the history list
 	if(args[1] == NULL){
 		//Cycle through the history list and print out the commands
-		for(int j = 0; j <= history_list.command_count - 1; j++){
-			printf("%d) %s\n", j + 1, history_list.commands[j]);
+		for(int j = 1; j <= history_list.command_count; j++){
+			const HistoryEntry *entry = retrieve_from_history(j);
+			out_printf("%d) %.*s\n", j, (int)entry -> length, entry -> text);
 		}	
 	} 
 	//Function 2 - Set a New History List Size
 	//If we have the set argument, we will set a new history size
 	else if(strcmp(args[1], "set") == 0){
-		int new_size = atoi(args[2]);
-		//If the new size if less than the size of the previous,
-		//we need to evict the contents of the history list above the new size
-		if(new_size < history_list.command_count){
-			for(int k = new_size; k <= history_list.command_count - 1; k++){
-				free(history_list.commands[k]);
-			}
-			//Once we're done, we need to adjust the amount of commands
-			//in history to the new total size
-			history_list.command_count = new_size;
-		}
-		//Now, we need to set the history list's max size to that of the new size
-		history_list.maximum_size = new_size;
+		if(args[2] == NULL || atoi(args[2]) < 0){
+			fprintf(stderr, "history: Invalid size\n");
+			last_status = 1;
+			return;
+		}
+		if(resize_history(atoi(args[2])) != 0){
+			last_status = 1;
+		}
 	} 
 	//Function 3 - Execute a Command from the History List
 	//If we made it this far, we want to execute a command from history
@@ -309,365 +984,5440 @@ void execute_history(char *args[]){
 		int index = atoi(args[1]);
 		//Use the helper method to retrieve the command from the correct
 		//index in the history list
-		const char *retrieved_command = retrieve_from_history(index);
+		const HistoryEntry *retrieved_command = retrieve_from_history(index);
 		//If the command was never set and doesnt exit, print error and do nothing
 		if(retrieved_command == NULL){
 			fprintf(stderr, "history: No such command in history\n");
+			last_status = 1;
 		}
 		//If the command exists, we call it like we had from the shell
 		if(retrieved_command != NULL){
-			char *command_temp = strdup(retrieved_command);
-			printf("Executing: %s\n", retrieved_command);
+			out_printf("Executing: %.*s\n", (int)retrieved_command -> length, retrieved_command -> text);
 			//Run the requested command specified in history
-			process_command(command_temp);	
-			free(command_temp);
+			//The entry can be evicted when the replayed command is added to the
+			//history list, so process_command is handed a copy from the arena
+			process_command(arena_strndup(&command_arena, retrieved_command -> text, retrieved_command -> length), retrieved_command -> length);	
 		} 
 	}
 }
 
 //This method will handle the ls command
 //This method will print out a list of the current directory content when requested
-void execute_ls(){
-	DIR *dir;
-	struct dirent *entry;
-	int file_count = 0;
-	char *file_list[100];
-	
-	//Prepair the current directory
-	dir = opendir(".");
-	if(dir == NULL){
+//The entries come from the directory's snapshot, read in large getdents64 batches and
+//sorted once, so running ls again over an unchanged directory doesnt read it again
+void execute_ls(char *args[]){
+	(void)args;
+	//The listing comes from the same snapshot globs use, already sorted
+	DirectorySnapshot *snapshot = retrieve_directory_snapshot(".");
+	if(snapshot == NULL){
 		perror("ls");
+		last_status = 1;
 		return;
 	}
-	//Read in directory contents into file list
-	while((entry = readdir(dir)) != NULL){
-		//Ignore hidden files (files beginning with '.')
-		if(entry -> d_name[0] == '.') {
+	//Print the directory contents to the shell, leaving out hidden files
+	for(size_t k = 0; k < snapshot -> listing.count; k++){
+		const char *name = snapshot -> listing.names + snapshot -> listing.offsets[k];
+		if(name[0] == '.'){
 			continue;
 		}
-		file_list[file_count] = strdup(entry -> d_name);
-		++file_count;
-	}
-	//close out directory once were done
-	closedir(dir);
-	//Sort and print the directory contents to the shell
-	qsort(file_list, file_count, sizeof(char *), basic_comparison);
-	for(int k = 0; k <= file_count - 1; k++){
-		printf("%s\n", file_list[k]);
-		//Once we're done, we need to free the list to prevent leaks
-		free(file_list[k]);
+		out_write(name, strlen(name));
+		out_write("\n", 1);
 	}
 }
 
-
-// Methods for NON Built-In Commands
-
-
-//This method handles the highest level of executing a non built-in shell command.
-//It will take in the specified arguments and use the arguments to call a shell command. 
-void execute_shell_command(char *args[]){
-	//is the command valid?
-	if(access(args[0], X_OK) == 0){
-		execute_fork_and_execv(args[0], args);
-		return;
+//This method will handle the hash command
+//With no arguments it prints the cached command paths and the hit/miss counters,
+//"hash -r" clears the cache and "hash NAME..." looks up the commands ahead of time
+void execute_hash(char *args[]){
+	//Function 1 - Print the Command Path Cache
+	if(args[1] == NULL){
+		for(int i = 0; i < PATH_CACHE_BUCKETS; i++){
+			for(PathCacheEntry *entry = path_cache.buckets[i]; entry != NULL; entry = entry -> next){
+				out_printf("%d\t%s\n", entry -> hits, entry -> path);
+			}
+		}
+		out_printf("hits=%ld misses=%ld\n", path_cache.hits, path_cache.misses);
 	}
-	//Search for the command in the directory
-	//If found, run it!
-	char *full_path = retrieve_command_path(args[0]);
-	if(full_path != NULL){
-		execute_fork_and_execv(full_path, args);
-	} 
-	//If here, we were unable to locate the command
-	//Send an error message and do nothing
+	//Function 2 - Clear the Command Path Cache
+	else if(strcmp(args[1], "-r") == 0){
+		clear_path_cache();
+	}
+	//Function 3 - Pre-Warm the Command Path Cache
 	else{
-		exit_value = -1;
+		for(int i = 1; args[i] != NULL; i++){
+			if(retrieve_command_path(args[i]) == NULL){
+				fprintf(stderr, "hash: %s: not found\n", args[i]);
+				last_status = 1;
+			}
+		}
 	}
 }
 
-//When a non built-in command is found in the directory,
-//we will create a copy of the process with fork and we will run the 
-//requested command with execv
-void execute_fork_and_execv(const char *path, char *args[]){
-	pid_t pid = fork();
-	//Did fork work?
-	if(pid < 0){
+//This method will handle the jobs command
+//It prints every background job with its id, state and command
+void execute_jobs(char *args[]){
+	(void)args;
+	static const char *states[] = { "Running", "Stopped", "Done" };
+	block_sigchld(1);
+	for(int i = 0; i < JOBS_MAXIMUM; i++){
+		if(job_table[i].command != NULL){
+			out_printf("[%d]  %-8s %s\n", i + 1, states[job_table[i].state], job_table[i].command);
+		}
+	}
+	block_sigchld(0);
+	//Jobs reported as Done have now been seen by the user
+	notify_finished_jobs(0);
+}
+
+//This method will handle the wait command
+//With no arguments it waits for every background job, otherwise it waits
+//for the job with the given id
+void execute_wait(char *args[]){
+	if(args[1] == NULL){
+		for(int i = 0; i < JOBS_MAXIMUM; i++){
+			if(job_table[i].command != NULL){
+				wait_for_job(i);
+			}
+		}
+		return;
+	}
+	int index = retrieve_job_index(args[1]);
+	if(index < 0){
+		fprintf(stderr, "wait: No such job\n");
+		last_status = 1;
+		return;
+	}
+	wait_for_job(index);
+}
+
+//This method will handle the fg command
+//It continues the given job (or the most recent one) and waits for it in the foreground
+void execute_fg(char *args[]){
+	int index = retrieve_job_index(args[1]);
+	if(index < 0){
+		fprintf(stderr, "fg: No such job\n");
+		last_status = 1;
+		return;
+	}
+	out_printf("%s\n", job_table[index].command);
+	out_flush();
+	//With job control the job gets the terminal while it runs, so Ctrl-C and Ctrl-Z
+	//reach it and not the shell. The shell's terminal settings are put back after
+	Job *job = &job_table[index];
+	struct termios modes;
+	int terminal = job_control && job -> process_group > 0 && tcgetattr(STDIN_FILENO, &modes) == 0;
+	if(terminal){
+		hand_terminal(job -> process_group);
+	}
+	continue_job(index);
+	wait_for_job(index);
+	if(terminal){
+		hand_terminal(getpgrp());
+		tcsetattr(STDIN_FILENO, TCSADRAIN, &modes);
+	}
+}
+
+//This method will handle the bg command
+//It continues the given job (or the most recent one) in the background
+void execute_bg(char *args[]){
+	int index = retrieve_job_index(args[1]);
+	if(index < 0){
+		fprintf(stderr, "bg: No such job\n");
+		last_status = 1;
+		return;
+	}
+	continue_job(index);
+	out_printf("[%d] %s &\n", index + 1, job_table[index].command);
+}
+
+
+// FAST BUILT IN COMMANDS
+//These behave like their /bin versions but run inside the shell, so the
+//commands scripts use the most dont cost a PATH walk, a fork and an exec.
+//Options they dont understand are handed to the /bin version instead
+
+
+//This method will handle the echo command
+//Like /bin/echo it takes -n (no new line), -e (backslash escapes) and -E (no escapes)
+void execute_echo(char *args[]){
+	int newline = 1;
+	int escapes = 0;
+	int i = 1;
+	//Options have to come first, and a word with any other letter is printed as is
+	for(; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++){
+		if(strspn(args[i] + 1, "neE") != strlen(args[i] + 1)){
+			break;
+		}
+		for(char *option = args[i] + 1; *option != '\0'; option++){
+			if(*option == 'n'){
+				newline = 0;
+			}
+			else{
+				escapes = *option == 'e';
+			}
+		}
+	}
+	for(int first = i; args[i] != NULL; i++){
+		if(i > first){
+			out_write(" ", 1);
+		}
+		if(!escapes){
+			out_write(args[i], strlen(args[i]));
+		}
+		//\c stops all output, including the new line
+		else if(write_escaped(args[i], 0) != 0){
+			return;
+		}
+	}
+	if(newline){
+		out_write("\n", 1);
+	}
+}
+
+//This method will handle the true command
+void execute_true(char *args[]){
+	(void)args;
+	last_status = 0;
+}
+
+//This method will handle the false command
+void execute_false(char *args[]){
+	(void)args;
+	last_status = 1;
+}
+
+//This method will handle the cat command
+//Each file (or stdin for - or no files) is copied to stdout by the kernel when it can,
+//with copy_file_range between files and sendfile into pipes and sockets
+void execute_cat(char *args[]){
+	for(int i = 1; args[i] != NULL; i++){
+		if(args[i][0] == '-' && args[i][1] != '\0'){
+			run_external_builtin(args);
+			return;
+		}
+	}
+	//Anything already printed by the shell has to come out first
+	out_flush();
+	char *stdin_only[] = { "-", NULL };
+	char **files = args[1] != NULL ? args + 1 : stdin_only;
+	for(int i = 0; files[i] != NULL; i++){
+		int from_stdin = strcmp(files[i], "-") == 0;
+		int fd = from_stdin ? STDIN_FILENO : open(files[i], O_RDONLY | O_CLOEXEC);
+		if(fd == -1){
+			fprintf(stderr, "cat: %s: %s\n", files[i], strerror(errno));
+			last_status = 1;
+			continue;
+		}
+		if(copy_fd(fd, STDOUT_FILENO) != 0){
+			//The reader is gone. /bin/cat would be killed by SIGPIPE without a word,
+			//so stop quietly with the status that gives
+			if(errno == EPIPE){
+				last_status = 128 + SIGPIPE;
+				if(!from_stdin){
+					close(fd);
+				}
+				return;
+			}
+			fprintf(stderr, "cat: %s: %s\n", from_stdin ? "-" : files[i], strerror(errno));
+			last_status = 1;
+		}
+		if(!from_stdin){
+			close(fd);
+		}
+	}
+}
+
+//This method will copy everything left in one fd into another
+//It tries copy_file_range, then sendfile, then plain reads and writes, moving on
+//whenever the kernel says a method doesnt work for these two fds.
+//Returns 0 once the input is used up
+int copy_fd(int in, int out){
+	ssize_t copied;
+	//copy_file_range needs two regular files, sendfile needs an input it can map
+	while((copied = copy_file_range(in, NULL, out, NULL, BATCH_READ_SIZE * 16, 0)) > 0){
+	}
+	if(copied == 0){
+		return 0;
+	}
+	while((copied = sendfile(out, in, NULL, BATCH_READ_SIZE * 16)) > 0){
+	}
+	if(copied == 0){
+		return 0;
+	}
+	char buffer[BATCH_READ_SIZE];
+	while((copied = read(in, buffer, sizeof(buffer))) != 0){
+		if(copied < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			return -1;
+		}
+		if(write_all(out, buffer, copied) != 0){
+			return -1;
+		}
+	}
+	return 0;
+}
+
+//This method will handle the printf command
+//The format is reused until all of the arguments are used up, like /bin/printf.
+//Conversions are %s, %b, %c, %d, %i, %u, %o, %x, %X, %e, %E, %f, %g, %G and %%
+void execute_printf(char *args[]){
+	if(args[1] == NULL){
+		fprintf(stderr, "printf: missing operand\n");
+		last_status = 1;
+		return;
+	}
+	const char *format = args[1];
+	//Star widths and the less common conversions are left to /bin/printf
+	for(const char *f = strchr(format, '%'); f != NULL; f = strchr(f + 1, '%')){
+		const char *conversion = f + 1 + strspn(f + 1, "-+ #0123456789.");
+		if(*conversion == '\0' || strchr("sbcdiuoxXeEfFgG%", *conversion) == NULL){
+			run_external_builtin(args);
+			return;
+		}
+		f = conversion;
+	}
+	char **next = args + 2;
+	do{
+		int used = 0;
+		if(write_format(format, &next, &used) != 0){
+			return;
+		}
+		//A format with no conversions is printed only once
+		if(!used){
+			break;
+		}
+	}while(*next != NULL);
+}
+
+//This method will print the format once, taking arguments from next as it goes
+//used is set if any argument was asked for. Returns -1 if the output was cut short by \c
+int write_format(const char *format, char ***next, int *used){
+	for(const char *f = format; *f != '\0'; f++){
+		if(*f == '\\' && f[1] != '\0'){
+			int stop = 0;
+			f += write_escape(f, 1, &stop) - 1;
+			if(stop){
+				return -1;
+			}
+			continue;
+		}
+		if(*f != '%'){
+			const char *plain = f;
+			while(f[1] != '\0' && f[1] != '%' && f[1] != '\\'){
+				++f;
+			}
+			out_write(plain, f - plain + 1);
+			continue;
+		}
+		//Copy out the flags, width and precision of the conversion
+		size_t length = strspn(f + 1, "-+ #0123456789.");
+		char conversion = f[length + 1];
+		if(conversion == '%'){
+			out_write("%", 1);
+			f += length + 1;
+			continue;
+		}
+		char spec[64];
+		if(length + 5 > sizeof(spec)){
+			fprintf(stderr, "printf: %s: invalid conversion specification\n", f);
+			last_status = 1;
+			return -1;
+		}
+		memcpy(spec, f, length + 1);
+		*used = 1;
+		const char *argument = **next != NULL ? *(*next)++ : NULL;
+		switch(conversion){
+			case 's':
+				spec[length + 1] = 's';
+				spec[length + 2] = '\0';
+				out_printf(spec, argument != NULL ? argument : "");
+				break;
+			case 'b':
+				if(argument != NULL && write_escaped(argument, 0) != 0){
+					return -1;
+				}
+				break;
+			case 'c':
+				if(argument != NULL && *argument != '\0'){
+					out_write(argument, 1);
+				}
+				break;
+			case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+				spec[length + 1] = 'l';
+				spec[length + 2] = 'l';
+				spec[length + 3] = conversion;
+				spec[length + 4] = '\0';
+				out_printf(spec, parse_printf_number(argument));
+				break;
+			default:
+				spec[length + 1] = conversion;
+				spec[length + 2] = '\0';
+				out_printf(spec, parse_printf_double(argument));
+				break;
+		}
+		f += length + 1;
+	}
+	return 0;
+}
+
+//Used to read a printf integer argument, a leading quote gives the character's value
+long long parse_printf_number(const char *argument){
+	if(argument == NULL || *argument == '\0'){
+		return 0;
+	}
+	if(*argument == '\'' || *argument == '"'){
+		return (unsigned char)argument[1];
+	}
+	char *end;
+	errno = 0;
+	long long value = strtoll(argument, &end, 0);
+	if(*end != '\0' || errno != 0){
+		fprintf(stderr, "printf: %s: expected a numeric value\n", argument);
+		last_status = 1;
+	}
+	return value;
+}
+
+//Used to read a printf floating point argument
+double parse_printf_double(const char *argument){
+	if(argument == NULL || *argument == '\0'){
+		return 0;
+	}
+	char *end;
+	double value = strtod(argument, &end);
+	if(*end != '\0'){
+		fprintf(stderr, "printf: %s: expected a numeric value\n", argument);
+		last_status = 1;
+	}
+	return value;
+}
+
+//This method will print text with its backslash escapes turned into characters
+//Returns -1 if a \c asked for the output to stop
+int write_escaped(const char *text, int printf_octal){
+	for(const char *t = text; *t != '\0'; t++){
+		if(*t != '\\' || t[1] == '\0'){
+			const char *plain = t;
+			while(t[1] != '\0' && t[1] != '\\'){
+				++t;
+			}
+			out_write(plain, t - plain + 1);
+			continue;
+		}
+		int stop = 0;
+		t += write_escape(t, printf_octal, &stop) - 1;
+		if(stop){
+			return -1;
+		}
+	}
+	return 0;
+}
+
+//This method will print the character for the backslash escape at the start of text
+//Octal escapes are written \0NNN for echo -e and %b, and \NNN in a printf format.
+//stop is set for \c. Returns how many characters of text the escape took up
+size_t write_escape(const char *text, int printf_octal, int *stop){
+	const char *t = text + 1;
+	int value = -1;
+	switch(*t){
+		case 'a': value = '\a'; break;
+		case 'b': value = '\b'; break;
+		case 'e': value = 27; break;
+		case 'f': value = '\f'; break;
+		case 'n': value = '\n'; break;
+		case 'r': value = '\r'; break;
+		case 't': value = '\t'; break;
+		case 'v': value = '\v'; break;
+		case '\\': value = '\\'; break;
+		case '"': value = printf_octal ? '"' : -1; break;
+		case 'c':
+			*stop = 1;
+			return 2;
+		case 'x':
+			for(int k = 0; k < 2 && isxdigit((unsigned char)t[1]); k++){
+				++t;
+				value = (value < 0 ? 0 : value) * 16 + (isdigit((unsigned char)*t) ? *t - '0' : tolower((unsigned char)*t) - 'a' + 10);
+			}
+			break;
+		default:
+			if(*t >= '0' && *t <= '7' && (*t == '0' || printf_octal)){
+				//\0NNN takes up to three more digits, \NNN up to three in all
+				int digits = *t == '0' && !printf_octal ? 3 : 2;
+				value = *t - '0';
+				for(int k = 0; k < digits && t[1] >= '0' && t[1] <= '7'; k++){
+					value = value * 8 + (*++t - '0');
+				}
+			}
+			break;
+	}
+	//Unknown escapes are printed as they were written
+	if(value < 0){
+		out_write(text, 2);
+		return 2;
+	}
+	char byte = (char)value;
+	out_write(&byte, 1);
+	return t - text + 1;
+}
+
+//This method will handle the test and [ commands
+//The expression is evaluated like /bin/test: exit status 0 if it is true, 1 if it
+//is false and 2 if it isnt a valid expression
+void execute_test(char *args[]){
+	int count = 0;
+	while(args[count + 1] != NULL){
+		++count;
+	}
+	char **operands = args + 1;
+	if(strcmp(args[0], "[") == 0){
+		if(count == 0 || strcmp(operands[count - 1], "]") != 0){
+			fprintf(stderr, "[: missing ']'\n");
+			last_status = 2;
+			return;
+		}
+		--count;
+	}
+	TestParser parser = { operands, count, 0, 0 };
+	int result = count == 0 ? 0 : test_or(&parser);
+	if(!parser.error && parser.position < count){
+		fprintf(stderr, "%s: %s: unexpected argument\n", args[0], operands[parser.position]);
+		parser.error = 1;
+	}
+	last_status = parser.error ? 2 : !result;
+}
+
+//Used to evaluate expressions joined with -o
+int test_or(TestParser *parser){
+	int result = test_and(parser);
+	while(!parser -> error && test_peek(parser, 0, "-o")){
+		++parser -> position;
+		result = test_and(parser) || result;
+	}
+	return result;
+}
+
+//Used to evaluate expressions joined with -a
+int test_and(TestParser *parser){
+	int result = test_not(parser);
+	while(!parser -> error && test_peek(parser, 0, "-a")){
+		++parser -> position;
+		result = test_not(parser) && result;
+	}
+	return result;
+}
+
+//Used to evaluate a ! expression
+//A ! followed by a binary operator is just a string, like in "test ! = x"
+int test_not(TestParser *parser){
+	if(test_peek(parser, 0, "!") && !(parser -> position + 2 < parser -> count && is_test_binary(parser -> operands[parser -> position + 1]))){
+		++parser -> position;
+		return !test_not(parser);
+	}
+	return test_primary(parser);
+}
+
+//Used to evaluate a single test: ( expression ), a unary test, a binary test or a string
+int test_primary(TestParser *parser){
+	int remaining = parser -> count - parser -> position;
+	char **operands = parser -> operands + parser -> position;
+	if(remaining <= 0){
+		fprintf(stderr, "test: argument expected\n");
+		parser -> error = 1;
+		return 0;
+	}
+	//A binary operator wins over everything else when there are three words left
+	if(remaining >= 3 && is_test_binary(operands[1])){
+		parser -> position += 3;
+		return test_binary(parser, operands[0], operands[1], operands[2]);
+	}
+	if(strcmp(operands[0], "(") == 0 && remaining >= 2){
+		++parser -> position;
+		int result = test_or(parser);
+		if(!test_peek(parser, 0, ")")){
+			fprintf(stderr, "test: ')' expected\n");
+			parser -> error = 1;
+			return 0;
+		}
+		++parser -> position;
+		return result;
+	}
+	if(remaining >= 2 && operands[0][0] == '-' && operands[0][1] != '\0' && operands[0][2] == '\0' &&
+		strchr("bcdefghknprsStuwxzLOG", operands[0][1]) != NULL){
+		parser -> position += 2;
+		return test_unary(operands[0][1], operands[1]);
+	}
+	++parser -> position;
+	return operands[0][0] != '\0';
+}
+
+//Used to evaluate a unary test, like -f file or -z string
+int test_unary(char op, const char *operand){
+	struct stat info;
+	if(op == 'z'){
+		return operand[0] == '\0';
+	}
+	if(op == 'n'){
+		return operand[0] != '\0';
+	}
+	if(op == 't'){
+		return isatty(atoi(operand));
+	}
+	if(op == 'r' || op == 'w' || op == 'x'){
+		return access(operand, op == 'r' ? R_OK : op == 'w' ? W_OK : X_OK) == 0;
+	}
+	if(op == 'h' || op == 'L'){
+		return lstat(operand, &info) == 0 && S_ISLNK(info.st_mode);
+	}
+	if(stat(operand, &info) != 0){
+		return 0;
+	}
+	switch(op){
+		case 'b': return S_ISBLK(info.st_mode);
+		case 'c': return S_ISCHR(info.st_mode);
+		case 'd': return S_ISDIR(info.st_mode);
+		case 'f': return S_ISREG(info.st_mode);
+		case 'p': return S_ISFIFO(info.st_mode);
+		case 'S': return S_ISSOCK(info.st_mode);
+		case 's': return info.st_size > 0;
+		case 'g': return (info.st_mode & S_ISGID) != 0;
+		case 'u': return (info.st_mode & S_ISUID) != 0;
+		case 'k': return (info.st_mode & S_ISVTX) != 0;
+		case 'O': return info.st_uid == geteuid();
+		case 'G': return info.st_gid == getegid();
+		default: return 1;
+	}
+}
+
+//Used to evaluate a binary test, like a = b, 1 -lt 2 or file -nt other
+int test_binary(TestParser *parser, const char *left, const char *op, const char *right){
+	if(strcmp(op, "=") == 0 || strcmp(op, "==") == 0){
+		return strcmp(left, right) == 0;
+	}
+	if(strcmp(op, "!=") == 0){
+		return strcmp(left, right) != 0;
+	}
+	if(strcmp(op, "<") == 0){
+		return strcmp(left, right) < 0;
+	}
+	if(strcmp(op, ">") == 0){
+		return strcmp(left, right) > 0;
+	}
+	if(strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0){
+		struct stat left_info, right_info;
+		int left_exists = stat(left, &left_info) == 0;
+		int right_exists = stat(right, &right_info) == 0;
+		if(strcmp(op, "-ef") == 0){
+			return left_exists && right_exists && left_info.st_dev == right_info.st_dev && left_info.st_ino == right_info.st_ino;
+		}
+		if(!left_exists || !right_exists){
+			return strcmp(op, "-nt") == 0 ? left_exists : right_exists;
+		}
+		double left_time = left_info.st_mtim.tv_sec + left_info.st_mtim.tv_nsec / 1e9;
+		double right_time = right_info.st_mtim.tv_sec + right_info.st_mtim.tv_nsec / 1e9;
+		return strcmp(op, "-nt") == 0 ? left_time > right_time : left_time < right_time;
+	}
+	//The rest compare integers
+	long long a, b;
+	if(parse_test_integer(left, &a) != 0 || parse_test_integer(right, &b) != 0){
+		fprintf(stderr, "test: %s: integer expression expected\n", parse_test_integer(left, &a) != 0 ? left : right);
+		parser -> error = 1;
+		return 0;
+	}
+	switch(op[1]){
+		case 'e': return a == b;
+		case 'n': return a != b;
+		case 'l': return op[2] == 't' ? a < b : a <= b;
+		default: return op[2] == 't' ? a > b : a >= b;
+	}
+}
+
+//Used to read an integer operand of test, which can have spaces around it
+//Returns 0 if the whole operand is an integer
+int parse_test_integer(const char *text, long long *value){
+	char *end;
+	errno = 0;
+	*value = strtoll(text, &end, 10);
+	while(*end == ' ' || *end == '\t'){
+		++end;
+	}
+	return end == text || *end != '\0' || errno != 0 ? -1 : 0;
+}
+
+//Used to check if a word is one of tests binary operators
+int is_test_binary(const char *word){
+	static const char *const binary[] = { "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef", NULL };
+	for(int i = 0; binary[i] != NULL; i++){
+		if(strcmp(word, binary[i]) == 0){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+//Used to check if the word offset places ahead of the parser is the given one
+int test_peek(TestParser *parser, int offset, const char *word){
+	int position = parser -> position + offset;
+	return position < parser -> count && strcmp(parser -> operands[position], word) == 0;
+}
+
+//This method will run the /bin version of a Built-In command
+//Used for the options the in-process versions dont handle. The shell's stdin, stdout
+//and stderr are already redirected for the command, so the child just inherits them
+void run_external_builtin(char *args[]){
+	Redirection redirection = { NULL, NULL, NULL, 0 };
+	execute_shell_command(args, &redirection, NULL);
+}
+
+
+// Methods for NON Built-In Commands
+
+
+//This method handles the highest level of executing a non built-in shell command.
+//It will take in the specified arguments and use the arguments to call a shell command. 
+void execute_shell_command(char *args[], Redirection *redirection, char **envp){
+	//is the command valid?
+	if(access(args[0], X_OK) == 0){
+		int status = execute_fork_and_execv(args[0], args, redirection, envp);
+		last_status = status < 0 ? 1 : status;
+		return;
+	}
+	//Search for the command in the directory
+	//If found, run it!
+	double started = command_timing.active ? monotonic_seconds() : 0;
+	char *full_path = retrieve_command_path(args[0]);
+	if(command_timing.active){
+		command_timing.resolve += monotonic_seconds() - started;
+	}
+	if(full_path != NULL){
+		//If the cached binary has disappeared since we found it, execv
+		//fails with ENOENT and the child exits with 127, so drop the stale entry
+		int status = execute_fork_and_execv(full_path, args, redirection, envp);
+		if(status == 127){
+			forget_cached_path(args[0]);
+		}
+		last_status = status < 0 ? 1 : status;
+	} 
+	//If here, we were unable to locate the command
+	//Send an error message and do nothing
+	else{
+		exit_value = -1;
+		last_status = 127;
+	}
+}
+
+//When a non built-in command is found in the directory, we launch it
+//with the requested redirections and wait for it to finish.
+//Returns the exit status of the child
+int execute_fork_and_execv(const char *path, char *args[], Redirection *redirection, char **envp){
+	int status = 0;
+	int fds[3];
+	pid_t pid;
+	if(open_redirection_files(redirection, fds) != 0){
+		return -1;
+	}
+	double started = command_timing.active ? monotonic_seconds() : 0;
+	int error = launch_command(path, args, fds, &pid, envp);
+	if(command_timing.active){
+		command_timing.spawn += monotonic_seconds() - started;
+	}
+	close_redirection_files(fds);
+	if(error != 0){
+		return error == ENOENT ? 127 : 1;
+	}
+	//the parent process will now wait until the child process finishes the
+	//requested command. Once finished, the parent process will resume.
+	wait_for_child(pid, &status, 0);
+	return exit_code(status);
+}
+
+//Used to turn a wait status into the exit code a shell reports
+//A command killed by a signal reports 128 plus the signal number
+int exit_code(int status){
+	if(WIFSIGNALED(status)){
+		return 128 + WTERMSIG(status);
+	}
+	return WEXITSTATUS(status);
+}
+
+//This method will start a command with fds[0], fds[1] and fds[2] (when not -1) as
+//its stdin, stdout and stderr, without waiting for it. By default the child is
+//created with posix_spawn, which never copies the shell's address space,
+//otherwise we create a copy of the process with fork and run the command with execve.
+//envp is the command's enviroment, NULL gives it the shell's exported variables.
+//Returns 0 once the child is started, or an errno value if it could not be
+int launch_command(const char *path, char *args[], int fds[3], pid_t *pid, char **envp){
+	//Anything the shell printed so far has to come out before the child's output
+	out_flush();
+	if(envp == NULL){
+		envp = retrieve_environment();
+	}
+	if(envp == NULL){
+		perror("Command Execution failed");
+		return ENOMEM;
+	}
+	//With no helper ready, the command is spawned like usual
+	if(launch_mode == LAUNCH_ZYGOTE && execute_zygote(path, args, fds, pid, envp) == 0){
+		return 0;
+	}
+	if(launch_mode != LAUNCH_FORK){
+		int error = execute_spawn(path, args, fds, pid, envp);
+		//Did posix_spawn work? It reports exec failures directly
+		if(error != 0){
+			errno = error;
+			perror("Command Execution failed");
+		}
+		return error;
+	}
+	*pid = fork();
+	//Did fork work?
+	if(*pid < 0){
+		int error = errno;
 		perror("Fork Failed");
+		return error;
 	} 
 	//when fork is valid, the child process is created successfully
-	//we will then call execv to run the new command with its path and arguments
-	else if(pid == 0){
-		execv(path, args);
-		//Did execv work?
+	//we will then call execve to run the new command with its path and arguments
+	if(*pid == 0){
+		if(launch_process_group >= 0){
+			setpgid(0, launch_process_group);
+		}
+		for(int i = 0; i < 3; i++){
+			if(fds[i] != -1){
+				dup2(fds[i], i);
+			}
+		}
+		execve(path, args, envp);
+		//Did execve work?
 		perror("Command Execution failed");
-		exit(1);
+		exit(errno == ENOENT ? 127 : 1);
 	} 
-	//the parent process will now wait until the child process finishes the
-	//requested command. Once finished, the parent process will resume.
-	else{
-		//Now, in the parent process, we need to wait for the child
-		//process to conclude before the parent resumes
-		wait(NULL);
+	return 0;
+}
+
+//This method will launch a command with posix_spawn
+//The opened redirection files are handed to the child as dup2 file actions,
+//so nothing has to run in the child before the exec. Returns 0 or an errno value
+int execute_spawn(const char *path, char *args[], int fds[3], pid_t *pid, char **envp){
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	for(int i = 0; i < 3; i++){
+		if(fds[i] != -1){
+			posix_spawn_file_actions_adddup2(&actions, fds[i], i);
+		}
+	}
+	//A background job under job control is launched into its own process group
+	posix_spawnattr_t attributes;
+	posix_spawnattr_init(&attributes);
+	if(launch_process_group >= 0){
+		posix_spawnattr_setpgroup(&attributes, launch_process_group);
+		posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP);
+	}
+	int error = posix_spawn(pid, path, &actions, &attributes, args, envp);
+	posix_spawnattr_destroy(&attributes);
+	posix_spawn_file_actions_destroy(&actions);
+	return error;
+}
+
+//This method will run a pipeline of commands
+//All external stages are spawned at once, each connected to the next by a pipe,
+//and then waited on as a group. The last Built-In stage runs inside the shell with
+//its output going straight into the pipe, so no copy of the shell is forked for it.
+//If job_text is given, the pipeline becomes a background job instead of being waited on
+void execute_pipeline(Command *stages, int count, const char *job_text){
+	int (*pipes)[2] = arena_alloc(&command_arena, count * sizeof(*pipes));
+	pid_t *pids = arena_alloc(&command_arena, count * sizeof(pid_t));
+	int (*fds)[3] = arena_alloc(&command_arena, count * sizeof(*fds));
+	int *failed = arena_alloc(&command_arena, count * sizeof(int));
+
+	//Create a pipe between every pair of neighbouring stages
+	//Larger pipe buffers mean fewer context switches between the stages
+	for(int i = 0; i < count - 1; i++){
+		if(pipe2(pipes[i], O_CLOEXEC) != 0){
+			perror("pipe");
+			for(int j = 0; j < i; j++){
+				close(pipes[j][0]);
+				close(pipes[j][1]);
+			}
+			return;
+		}
+		fcntl(pipes[i][1], F_SETPIPE_SZ, PIPE_BUFFER_SIZE);
+	}
+
+	//Work out the stdin, stdout and stderr of every stage
+	//Redirections given on a stage take priority over the pipes
+	for(int i = 0; i < count; i++){
+		pids[i] = -1;
+		failed[i] = open_redirection_files(&stages[i].redirection, fds[i]) != 0;
+		if(failed[i]){
+			continue;
+		}
+		if(fds[i][0] == -1 && i > 0){
+			fds[i][0] = fcntl(pipes[i - 1][0], F_DUPFD_CLOEXEC, 0);
+		}
+		if(fds[i][1] == -1 && i < count - 1){
+			fds[i][1] = fcntl(pipes[i][1], F_DUPFD_CLOEXEC, 0);
+		}
+	}
+	//The stages hold their own copies of the pipe ends now
+	for(int i = 0; i < count - 1; i++){
+		close(pipes[i][0]);
+		close(pipes[i][1]);
+	}
+
+	//Only one Built-In stage can run inside the shell, and it has to be the last one.
+	//An earlier one would fill its pipe (or wait for input) while the stages after
+	//it, which arent running yet, are the ones it depends on
+	int inline_stage = -1;
+	for(int i = 0; job_text == NULL && i < count; i++){
+		if(!failed[i] && stage_builtin(&stages[i]) != NULL){
+			inline_stage = i;
+		}
+	}
+
+	//Under job control a background job gets a process group of its own, led by its
+	//first process, so signals from the terminal only reach the foreground
+	if(job_text != NULL && job_control){
+		launch_process_group = 0;
+	}
+
+	//Spawn all the external stages first, so there is a reader on the other end
+	//of the pipe by the time a Built-In stage starts writing into it
+	for(int i = 0; i < count; i++){
+		char **args = stages[i].args;
+		if(failed[i]){
+			continue;
+		}
+		//Every other Built-In stage gets a process of its own. So does every
+		//Built-In stage of a background job, which the shell must not wait for
+		if(stage_builtin(&stages[i]) != NULL){
+			if(i != inline_stage && fork_builtin(args, fds[i], &pids[i]) != 0){
+				pids[i] = -1;
+			}
+			if(pids[i] > 0){
+				join_launch_group(pids[i]);
+				close_redirection_files(fds[i]);
+			}
+			continue;
+		}
+		double started = command_timing.active ? monotonic_seconds() : 0;
+		char *path = access(args[0], X_OK) == 0 ? args[0] : retrieve_command_path(args[0]);
+		if(command_timing.active){
+			command_timing.resolve += monotonic_seconds() - started;
+		}
+		if(path == NULL){
+			exit_value = -1;
+			if(i == count - 1){
+				last_status = 127;
+			}
+		}
+		else{
+			started = command_timing.active ? monotonic_seconds() : 0;
+			if(launch_command(path, args, fds[i], &pids[i], stages[i].environment) != 0){
+				pids[i] = -1;
+				if(i == count - 1){
+					last_status = 127;
+				}
+			}
+			else{
+				join_launch_group(pids[i]);
+			}
+			if(command_timing.active){
+				command_timing.spawn += monotonic_seconds() - started;
+			}
+		}
+		close_redirection_files(fds[i]);
+	}
+	pid_t process_group = launch_process_group > 0 ? launch_process_group : 0;
+	launch_process_group = -1;
+
+	//Now run the Built-In stages with their output pointed into the pipe
+	//If the reading stage is gone, the write fails with EPIPE instead of the
+	//SIGPIPE killing the whole shell
+	void (*previous_handler)(int) = signal(SIGPIPE, SIG_IGN);
+	for(int i = 0; i < count; i++){
+		if(failed[i] || pids[i] > 0 || stage_builtin(&stages[i]) == NULL){
+			continue;
+		}
+		int saved[3];
+		redirect_shell_fds(fds[i], saved);
+		close_redirection_files(fds[i]);
+		execute_builtin(stages[i].args);
+		restore_shell_fds(saved);
+	}
+	signal(SIGPIPE, previous_handler);
+
+	//Background pipelines are handed to the job table, which reaps them later
+	if(job_text != NULL){
+		add_job(pids, count, job_text, process_group);
+		last_status = 0;
+		return;
+	}
+
+	//Finally, wait for every stage to finish
+	//The pipeline's status is the status of its last stage
+	for(int i = 0; i < count; i++){
+		if(pids[i] > 0){
+			int status;
+			if(wait_for_child(pids[i], &status, 0) > 0 && i == count - 1){
+				last_status = exit_code(status);
+			}
+		}
+	}
+	if(failed[count - 1]){
+		last_status = 1;
+	}
+}
+
+//This method will run a Built-In command in a forked copy of the shell
+//The child gets fds[0], fds[1] and fds[2] (when not -1) as its stdin, stdout and stderr.
+//Returns 0 once the child is started
+int fork_builtin(char *args[], int fds[3], pid_t *pid){
+	out_flush();
+	*pid = fork();
+	if(*pid < 0){
+		perror("Fork Failed");
+		return -1;
+	}
+	if(*pid == 0){
+		if(launch_process_group >= 0){
+			setpgid(0, launch_process_group);
+		}
+		signal(SIGPIPE, SIG_DFL);
+		history_list.file_fd = -1;
+		for(int i = 0; i < 3; i++){
+			if(fds[i] != -1){
+				dup2(fds[i], i);
+			}
+		}
+		execute_builtin(args);
+		out_flush();
+		_exit(last_status);
+	}
+	return 0;
+}
+
+//Used to find the Built-In command a pipeline stage runs
+//Will return NULL if the stage runs an external command, including one forced with command
+const Builtin *stage_builtin(Command *stage){
+	if(stage -> dispatch == DISPATCH_EXTERNAL){
+		return NULL;
+	}
+	return lookup_builtin(stage -> args[0]);
+}
+
+//This method will temporarily point the shell's own stdin, stdout and stderr at
+//the given fds (when not -1). The originals are kept in saved for restore_shell_fds
+void redirect_shell_fds(int fds[3], int saved[3]){
+	out_flush();
+	for(int i = 0; i < 3; i++){
+		saved[i] = -1;
+		if(fds[i] != -1){
+			saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 10);
+			dup2(fds[i], i);
+		}
+	}
+}
+
+//This method will put back the stdin, stdout and stderr saved by redirect_shell_fds
+void restore_shell_fds(int saved[3]){
+	out_flush();
+	for(int i = 0; i < 3; i++){
+		if(saved[i] != -1){
+			dup2(saved[i], i);
+			close(saved[i]);
+			saved[i] = -1;
+		}
+	}
+}
+
+//This method will handle retrieving the command path
+//so execv can call the new command. Paths we already found are
+//served from the command path cache instead of searching PATH again
+char* retrieve_command_path(const char *command){
+	PathCacheEntry *cached = lookup_cached_path(command);
+	if(cached != NULL){
+		++path_cache.hits;
+		++cached -> hits;
+		return cached -> path;
+	}
+	++path_cache.misses;
+	//Get the value of the path searching variable
+	const char *path_env = lookup_environment("PATH", 4);
+	if(path_env == NULL){
+		return NULL;	
+	}
+	//Now, make a copy of the PATH variable and we will now
+	//split the PATH variable into its individual directories
+	char *path_copy = strdup(path_env);
+	if(path_copy == NULL){
+		perror("wsh");
+		return NULL;
+	}
+	char *dir = strtok(path_copy, ":");
+	size_t command_length = strlen(command);
+	
+	//Finally, we need to search the directories for our command
+	while(dir != NULL){
+		size_t size = strlen(dir) + command_length + 2;
+		char *full_path = arena_alloc(&command_arena, size);
+		snprintf(full_path, size, "%s/%s", dir, command);
+		//If a matching path is found, we return it!
+		if(access(full_path, X_OK) == 0){
+			free(path_copy);
+			return add_cached_path(command, full_path);	
+		}
+		//If not found yet, we split the token and continue
+		dir = strtok(NULL, ":");
+	}
+	//The command couldnt be located, free the path and return
+	free(path_copy);
+	return NULL;	
+}
+
+//This method will open the files named by a command's redirections
+//Redirections will allow the file handles of commands be duplicated, opened, closed,
+//made to refer to different files, and change destination files for command reads and writes (Bash Reference Manual)
+//fds[0], fds[1] and fds[2] receive the new stdin, stdout and stderr (or -1 if unchanged).
+//The files are opened close-on-exec so only the dup2'd copies reach the child
+int open_redirection_files(Redirection *redirection, int fds[3]) {
+    fds[0] = fds[1] = fds[2] = -1;
+
+    // Handle input redirection (stdin)
+    if (redirection->input_file != NULL) {
+        fds[0] = open(redirection->input_file, O_RDONLY | O_CLOEXEC);
+        if (fds[0] == -1) {
+            perror("Error opening input file");
+            return -1;
+        }
+    }
+
+    // Handle output redirection (stdout)
+    if (redirection->output_file != NULL) {
+        // Open file for writing, either truncating or appending
+        // Appends in a batch run come from the append cache, which keeps the fd open
+        if (!redirection->append) {
+            fds[1] = open(redirection->output_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        } else if (append_cache.enabled) {
+            fds[1] = retrieve_append_fd(redirection->output_file);
+        } else {
+            fds[1] = open(redirection->output_file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        }
+        if (fds[1] == -1) {
+            perror("Error opening output file");
+            close_redirection_files(fds);
+            return -1;
+        }
+    }
+
+    // Handle error redirection (stderr)
+    if (redirection->error_file != NULL) {
+        fds[2] = open(redirection->error_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fds[2] == -1) {
+            perror("Error opening error output file");
+            close_redirection_files(fds);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//This method will close any files opened by open_redirection_files
+//Files owned by the append cache stay open for the next command
+void close_redirection_files(int fds[3]) {
+    for (int i = 0; i < 3; i++) {
+        if (fds[i] != -1) {
+            if (!release_append_fd(fds[i])) {
+                close(fds[i]);
+            }
+            fds[i] = -1;
+        }
+    }
+}
+
+
+// Methods for the Zygote Pool
+
+
+//This method will start the zygote and ask it for a full pool of helpers
+//Returns 0 if it started, otherwise commands keep being spawned by the shell itself
+int start_zygote_pool(){
+	int pair[2];
+	if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) != 0){
+		perror("zygote");
+		zygote_pool.failed = 1;
+		return -1;
+	}
+	pid_t pid = fork();
+	if(pid < 0){
+		perror("zygote");
+		close(pair[0]);
+		close(pair[1]);
+		zygote_pool.failed = 1;
+		return -1;
+	}
+	if(pid == 0){
+		close(pair[0]);
+		run_zygote(pair[1]);
+	}
+	close(pair[1]);
+	zygote_pool.zygote = pid;
+	zygote_pool.owner = getpid();
+	zygote_pool.control_fd = pair[0];
+	zygote_pool.count = zygote_pool.requested = zygote_pool.missing = 0;
+	request_zygote_helpers(ZYGOTE_POOL_SIZE);
+	return 0;
+}
+
+//This method is the zygote's loop
+//For every helper the shell asks for, it clones one with CLONE_PARENT (so the shell
+//can wait on it like any other child) and sends back its pid along with the shell's
+//end of a new socket pair. It ends once the shell closes the control socket
+void run_zygote(int control_fd){
+	//Nothing of the shell's is kept open, helpers start from a clean slate
+	int null_fd = open("/dev/null", O_RDWR);
+	for(int i = 0; i < 3; i++){
+		dup2(null_fd, i);
+	}
+	close_range(3, control_fd - 1, 0);
+	close_range(control_fd + 1, ~0U, 0);
+	//Ctrl-C at the terminal is meant for the running command, not for waiting helpers.
+	//Each helper joins the shell's process group just before it execs
+	setpgid(0, 0);
+	int reset[] = { SIGCHLD, SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU, SIGPIPE };
+	for(size_t i = 0; i < sizeof(reset) / sizeof(reset[0]); i++){
+		signal(reset[i], SIG_DFL);
+	}
+	sigset_t none;
+	sigemptyset(&none);
+	sigprocmask(SIG_SETMASK, &none, NULL);
+	unsigned char wanted;
+	while(recv(control_fd, &wanted, 1, 0) == 1){
+		for(int n = 0; n < wanted; n++){
+			int pair[2];
+			pid_t helper = -1;
+			if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) == 0){
+				helper = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, NULL, NULL, NULL, NULL);
+				if(helper == 0){
+					close(control_fd);
+					close(pair[0]);
+					run_zygote_helper(pair[1]);
+				}
+				close(pair[1]);
+			}
+			//A helper that couldnt be made is still answered, with a pid of -1
+			union {
+				struct cmsghdr header;
+				char space[CMSG_SPACE(sizeof(int))];
+			} control;
+			struct iovec part = { &helper, sizeof(helper) };
+			struct msghdr message = { .msg_iov = &part, .msg_iovlen = 1 };
+			if(helper > 0){
+				message.msg_control = control.space;
+				message.msg_controllen = sizeof(control.space);
+				struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+				cmsg -> cmsg_level = SOL_SOCKET;
+				cmsg -> cmsg_type = SCM_RIGHTS;
+				cmsg -> cmsg_len = CMSG_LEN(sizeof(int));
+				memcpy(CMSG_DATA(cmsg), &pair[0], sizeof(int));
+			}
+			sendmsg(control_fd, &message, MSG_NOSIGNAL);
+			if(helper > 0){
+				close(pair[0]);
+			}
+		}
+	}
+	_exit(0);
+}
+
+//This method is a helper's whole life
+//It waits for one command, puts the fds it was sent in place and execs it, so the
+//fork was paid for before the command came. If the shell goes away first, it just exits
+void run_zygote_helper(int fd){
+	char *buffer = malloc(ZYGOTE_MESSAGE_MAXIMUM);
+	int passed[4];
+	union {
+		struct cmsghdr header;
+		char space[CMSG_SPACE(sizeof(passed))];
+	} control;
+	struct iovec part = { buffer, ZYGOTE_MESSAGE_MAXIMUM };
+	struct msghdr message = { .msg_iov = &part, .msg_iovlen = 1, .msg_control = control.space, .msg_controllen = sizeof(control.space) };
+	ssize_t bytes;
+	while((bytes = recvmsg(fd, &message, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR){
+	}
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+	if(bytes < (ssize_t)sizeof(ZygoteRequest) || cmsg == NULL || cmsg -> cmsg_type != SCM_RIGHTS || cmsg -> cmsg_len != CMSG_LEN(sizeof(passed))){
+		_exit(0);
+	}
+	memcpy(passed, CMSG_DATA(cmsg), sizeof(passed));
+	ZygoteRequest request;
+	memcpy(&request, buffer, sizeof(request));
+	//The strings are used where they are, only the arrays pointing at them are made
+	char **args = malloc((request.argc + request.envc + 2) * sizeof(char *));
+	char **envp = args + request.argc + 1;
+	char *cursor = buffer + sizeof(request);
+	const char *path = cursor;
+	cursor += strlen(cursor) + 1;
+	for(uint32_t i = 0; i < request.argc; i++){
+		args[i] = cursor;
+		cursor += strlen(cursor) + 1;
+	}
+	args[request.argc] = NULL;
+	for(uint32_t i = 0; i < request.envc; i++){
+		envp[i] = cursor;
+		cursor += strlen(cursor) + 1;
+	}
+	envp[request.envc] = NULL;
+	setpgid(0, request.process_group);
+	if(fchdir(passed[3]) != 0){
+		perror("Command Execution failed");
+		_exit(1);
+	}
+	//The received fds are close-on-exec, only their copies on 0, 1 and 2 reach the command
+	for(int i = 0; i < 3; i++){
+		dup2(passed[i], i);
+	}
+	execve(path, args, envp);
+	//Did execve work?
+	perror("Command Execution failed");
+	_exit(errno == ENOENT ? 127 : 1);
+}
+
+//This method will hand a command to a helper from the zygote pool
+//The helper is sent the path, arguments and enviroment with fds[0], fds[1] and
+//fds[2] (the shell's own where they are -1) and the working directory, and only has
+//to exec. Returns 0 once the helper has the command, or -1 if there was no helper
+//ready (or the command is too big for one) and it has to be launched another way
+int execute_zygote(const char *path, char *args[], int fds[3], pid_t *pid, char **envp){
+	if(zygote_pool.owner == 0 && !zygote_pool.failed){
+		start_zygote_pool();
+	}
+	//A copy of the shell made by fork cant wait on the shell's helpers
+	if(zygote_pool.owner != getpid()){
+		return -1;
+	}
+	collect_zygote_helpers(0);
+	ZygoteRequest request = { 0, 0, launch_process_group >= 0 ? launch_process_group : getpgrp() };
+	size_t size = strlen(path) + 1;
+	for(; args[request.argc] != NULL; request.argc++){
+		size += strlen(args[request.argc]) + 1;
+	}
+	for(; envp[request.envc] != NULL; request.envc++){
+		size += strlen(envp[request.envc]) + 1;
+	}
+	if(zygote_pool.count == 0 || size > ZYGOTE_MESSAGE_MAXIMUM - sizeof(request)){
+		++zygote_pool.misses;
+		return -1;
+	}
+	int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if(cwd == -1){
+		++zygote_pool.misses;
+		return -1;
+	}
+	char *body = arena_alloc(&command_arena, size);
+	char *end = stpcpy(body, path) + 1;
+	for(uint32_t i = 0; i < request.argc; i++){
+		end = stpcpy(end, args[i]) + 1;
+	}
+	for(uint32_t i = 0; i < request.envc; i++){
+		end = stpcpy(end, envp[i]) + 1;
+	}
+	int passed[4] = { fds[0] != -1 ? fds[0] : STDIN_FILENO, fds[1] != -1 ? fds[1] : STDOUT_FILENO, fds[2] != -1 ? fds[2] : STDERR_FILENO, cwd };
+	union {
+		struct cmsghdr header;
+		char space[CMSG_SPACE(sizeof(passed))];
+	} control;
+	struct iovec parts[2] = { { &request, sizeof(request) }, { body, size } };
+	struct msghdr message = { .msg_iov = parts, .msg_iovlen = 2, .msg_control = control.space, .msg_controllen = sizeof(control.space) };
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+	cmsg -> cmsg_level = SOL_SOCKET;
+	cmsg -> cmsg_type = SCM_RIGHTS;
+	cmsg -> cmsg_len = CMSG_LEN(sizeof(passed));
+	memcpy(CMSG_DATA(cmsg), passed, sizeof(passed));
+
+	ZygoteHelper helper = zygote_pool.helpers[--zygote_pool.count];
+	ssize_t sent = sendmsg(helper.fd, &message, MSG_NOSIGNAL);
+	close(helper.fd);
+	close(cwd);
+	//The zygote makes the next helper while the command runs
+	request_zygote_helpers(1);
+	if(sent < 0){
+		//The helper is gone, so it is reaped and the command goes another way
+		kill(helper.pid, SIGKILL);
+		waitpid(helper.pid, NULL, 0);
+		++zygote_pool.misses;
+		return -1;
+	}
+	++zygote_pool.hits;
+	*pid = helper.pid;
+	return 0;
+}
+
+//This method will take in the helpers the zygote has sent since the last look
+//Without block it never waits, helpers that arent ready yet are picked up next time.
+//Helpers that couldnt be asked for before are asked for again first
+void collect_zygote_helpers(int block){
+	if(zygote_pool.missing > 0){
+		request_zygote_helpers(0);
+	}
+	while(zygote_pool.requested > 0){
+		pid_t pid;
+		union {
+			struct cmsghdr header;
+			char space[CMSG_SPACE(sizeof(int))];
+		} control;
+		struct iovec part = { &pid, sizeof(pid) };
+		struct msghdr message = { .msg_iov = &part, .msg_iovlen = 1, .msg_control = control.space, .msg_controllen = sizeof(control.space) };
+		ssize_t bytes = recvmsg(zygote_pool.control_fd, &message, (block ? 0 : MSG_DONTWAIT) | MSG_CMSG_CLOEXEC);
+		if(bytes < 0 && errno == EINTR){
+			continue;
+		}
+		if(bytes < 0 && errno == EAGAIN){
+			return;
+		}
+		//The zygote is gone, nothing more is coming
+		if(bytes <= 0){
+			zygote_pool.requested = 0;
+			return;
+		}
+		--zygote_pool.requested;
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+		//The zygote couldnt make this one, it is asked for again on the next launch
+		if(pid <= 0 || cmsg == NULL || cmsg -> cmsg_type != SCM_RIGHTS){
+			++zygote_pool.missing;
+			continue;
+		}
+		ZygoteHelper *helper = &zygote_pool.helpers[zygote_pool.count++];
+		helper -> pid = pid;
+		memcpy(&helper -> fd, CMSG_DATA(cmsg), sizeof(int));
+	}
+}
+
+//This method will ask the zygote for more helpers, without waiting for them
+//They are added to the ones still missing, and only what was actually sent counts as
+//requested. If the control socket is full, the rest are asked for on a later call
+void request_zygote_helpers(int count){
+	//The pool never holds (or waits for) more than ZYGOTE_POOL_SIZE helpers
+	zygote_pool.missing += count;
+	int room = ZYGOTE_POOL_SIZE - zygote_pool.count - zygote_pool.requested;
+	if(zygote_pool.missing > room){
+		zygote_pool.missing = room;
+	}
+	if(zygote_pool.missing <= 0){
+		return;
+	}
+	unsigned char wanted = zygote_pool.missing;
+	if(send(zygote_pool.control_fd, &wanted, 1, MSG_NOSIGNAL | MSG_DONTWAIT) == 1){
+		zygote_pool.requested += wanted;
+		zygote_pool.missing -= wanted;
+	}
+}
+
+//This method will stop the zygote and the helpers still waiting in the pool
+//Closing their sockets is enough to end them, then they are reaped
+void free_zygote_pool(){
+	if(zygote_pool.owner == 0 || zygote_pool.owner != getpid()){
+		return;
+	}
+	collect_zygote_helpers(1);
+	close(zygote_pool.control_fd);
+	waitpid(zygote_pool.zygote, NULL, 0);
+	for(int i = 0; i < zygote_pool.count; i++){
+		close(zygote_pool.helpers[i].fd);
+		waitpid(zygote_pool.helpers[i].pid, NULL, 0);
+	}
+	memset(&zygote_pool, 0, sizeof(ZygotePool));
+	zygote_pool.control_fd = -1;
+}
+
+
+// Methods for the Append Cache
+
+
+//This method will hand out an fd appending to path, opening it only if needed
+//A cached fd is only reused while path still names the same file (device and inode),
+//so a log that was renamed away or unlinked is opened again like the shell always did.
+//Every fd handed out has to be given back with release_append_fd. Entries still in use
+//(by an earlier stage of the same pipeline) are never evicted, if they all are the
+//file is opened outside the cache. Will return -1 if the file cant be opened
+int retrieve_append_fd(const char *path){
+	struct stat info;
+	int exists = stat(path, &info) == 0;
+	AppendCacheEntry *oldest = NULL;
+	for(int i = 0; i < APPEND_CACHE_SIZE; i++){
+		AppendCacheEntry *entry = &append_cache.entries[i];
+		if(entry -> path != NULL && strcmp(entry -> path, path) == 0){
+			if(exists && entry -> device == info.st_dev && entry -> inode == info.st_ino){
+				entry -> last_used = ++append_cache.clock;
+				++entry -> users;
+				return entry -> fd;
+			}
+			//The name points at another file now, or at nothing
+			if(entry -> users == 0){
+				forget_append_fd(entry);
+			}
+		}
+		if(entry -> users == 0 && (oldest == NULL || entry -> path == NULL || (oldest -> path != NULL && entry -> last_used < oldest -> last_used))){
+			oldest = entry;
+		}
+	}
+	int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if(fd == -1 || oldest == NULL || fstat(fd, &info) != 0){
+		return fd;
+	}
+	//The least recently used entry makes room for the new file
+	forget_append_fd(oldest);
+	oldest -> path = strdup(path);
+	oldest -> device = info.st_dev;
+	oldest -> inode = info.st_ino;
+	oldest -> fd = fd;
+	oldest -> users = 1;
+	oldest -> last_used = ++append_cache.clock;
+	return fd;
+}
+
+//Used to give back an fd handed out by retrieve_append_fd
+//Returns 1 if it belongs to the append cache, so it isnt closed after the command
+int release_append_fd(int fd){
+	if(!append_cache.enabled){
+		return 0;
+	}
+	for(int i = 0; i < APPEND_CACHE_SIZE; i++){
+		AppendCacheEntry *entry = &append_cache.entries[i];
+		if(entry -> path != NULL && entry -> fd == fd){
+			if(entry -> users > 0){
+				--entry -> users;
+			}
+			return 1;
+		}
+	}
+	return 0;
+}
+
+//This method will close a cached fd and empty its entry
+void forget_append_fd(AppendCacheEntry *entry){
+	if(entry -> path == NULL){
+		return;
+	}
+	close(entry -> fd);
+	free(entry -> path);
+	entry -> path = NULL;
+	entry -> fd = -1;
+	entry -> users = 0;
+}
+
+//This method will close every cached fd
+void clear_append_cache(){
+	for(int i = 0; i < APPEND_CACHE_SIZE; i++){
+		forget_append_fd(&append_cache.entries[i]);
+	}
+}
+
+
+// Methods for the Directory Snapshot Cache
+
+
+//This method will hand out the snapshot of a directory, reading it only if needed
+//A snapshot is reused while path is still the same directory (device and inode) and
+//its modification time hasnt moved. Timestamps only tick every few milliseconds, so
+//a directory changed within a second of being read is read again the next time.
+//Will return NULL if the directory cant be read
+DirectorySnapshot *retrieve_directory_snapshot(const char *path){
+	struct stat info;
+	if(stat(path, &info) != 0){
+		return NULL;
+	}
+	DirectorySnapshot *oldest = &snapshot_cache.entries[0];
+	for(int i = 0; i < SNAPSHOT_CACHE_SIZE; i++){
+		DirectorySnapshot *snapshot = &snapshot_cache.entries[i];
+		if(snapshot -> valid && snapshot -> device == info.st_dev && snapshot -> inode == info.st_ino){
+			if(snapshot -> trusted && snapshot -> modified.tv_sec == info.st_mtim.tv_sec && snapshot -> modified.tv_nsec == info.st_mtim.tv_nsec){
+				snapshot -> last_used = ++snapshot_cache.clock;
+				return snapshot;
+			}
+			forget_directory_snapshot(snapshot);
+		}
+		if(!snapshot -> valid || (oldest -> valid && snapshot -> last_used < oldest -> last_used)){
+			oldest = snapshot;
+		}
+	}
+	struct timespec started;
+	clock_gettime(CLOCK_REALTIME, &started);
+	DirectoryListing listing;
+	if(read_directory_listing(path, &listing) != 0){
+		return NULL;
+	}
+	//Sorted once here, so neither ls nor a glob has to sort the names again
+	qsort_r(listing.offsets, listing.count, sizeof(size_t), basic_comparison, listing.names);
+	//The least recently used snapshot makes room for the new one
+	forget_directory_snapshot(oldest);
+	oldest -> listing = listing;
+	oldest -> device = info.st_dev;
+	oldest -> inode = info.st_ino;
+	oldest -> modified = info.st_mtim;
+	oldest -> trusted = info.st_mtim.tv_sec < started.tv_sec - 1;
+	oldest -> valid = 1;
+	oldest -> last_used = ++snapshot_cache.clock;
+	return oldest;
+}
+
+//This method will free a snapshot and empty its entry
+void forget_directory_snapshot(DirectorySnapshot *snapshot){
+	if(!snapshot -> valid){
+		return;
+	}
+	free_directory_listing(&snapshot -> listing);
+	snapshot -> valid = 0;
+}
+
+//This method will free every snapshot
+void clear_directory_snapshots(){
+	for(int i = 0; i < SNAPSHOT_CACHE_SIZE; i++){
+		forget_directory_snapshot(&snapshot_cache.entries[i]);
+	}
+}
+
+
+// Methods for the Command Path Cache
+
+
+//Used to hash names for the command path cache and the variable store (FNV-1a hash)
+unsigned int hash_string(const char *name){
+	unsigned int hash = 2166136261u;
+	while(*name){
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+//Used to hash a name that isnt NUL terminated, gives the same hash as hash_string
+unsigned int hash_bytes(const char *name, size_t length){
+	unsigned int hash = 2166136261u;
+	for(size_t i = 0; i < length; i++){
+		hash ^= (unsigned char)name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+//Used to pick the bucket a command name lives in
+unsigned int hash_command_name(const char *name){
+	return hash_string(name) % PATH_CACHE_BUCKETS;
+}
+
+//This method will look for a command in the cache
+//It returns the matching entry, or NULL if we havent resolved it yet
+PathCacheEntry *lookup_cached_path(const char *name){
+	PathCacheEntry *entry = path_cache.buckets[hash_command_name(name)];
+	while(entry != NULL){
+		if(strcmp(entry -> name, name) == 0){
+			return entry;
+		}
+		entry = entry -> next;
+	}
+	return NULL;
+}
+
+//This method will remember where a command was found on PATH
+//It returns the cached copy of the path so callers never see a temporary buffer
+//Will return NULL if there is no memory for the entry
+char *add_cached_path(const char *name, const char *path){
+	unsigned int bucket = hash_command_name(name);
+	PathCacheEntry *entry = malloc(sizeof(PathCacheEntry));
+	if(entry == NULL){
+		perror("wsh");
+		return NULL;
+	}
+	entry -> name = strdup(name);
+	entry -> path = strdup(path);
+	if(entry -> name == NULL || entry -> path == NULL){
+		perror("wsh");
+		free(entry -> name);
+		free(entry -> path);
+		free(entry);
+		return NULL;
+	}
+	entry -> hits = 0;
+	//New entries go on the front of the bucket
+	entry -> next = path_cache.buckets[bucket];
+	path_cache.buckets[bucket] = entry;
+	return entry -> path;
+}
+
+//This method will drop a single command from the cache
+//Used when a cached path turns out to no longer exist
+void forget_cached_path(const char *name){
+	PathCacheEntry **link = &path_cache.buckets[hash_command_name(name)];
+	while(*link != NULL){
+		PathCacheEntry *entry = *link;
+		if(strcmp(entry -> name, name) == 0){
+			*link = entry -> next;
+			free(entry -> name);
+			free(entry -> path);
+			free(entry);
+			return;
+		}
+		link = &entry -> next;
+	}
+}
+
+//This method will empty the whole cache
+//Used by "hash -r", when PATH changes and when the shell exits
+void clear_path_cache(){
+	for(int i = 0; i < PATH_CACHE_BUCKETS; i++){
+		PathCacheEntry *entry = path_cache.buckets[i];
+		while(entry != NULL){
+			PathCacheEntry *next = entry -> next;
+			free(entry -> name);
+			free(entry -> path);
+			free(entry);
+			entry = next;
+		}
+		path_cache.buckets[i] = NULL;
+	}
+}
+
+
+// Methods for Job Control
+
+
+//This method is the SIGCHLD handler
+//Whenever a child changes state we collect any background jobs that finished,
+//so the shell never has to poll for them
+void handle_sigchld(int signal_number){
+	(void)signal_number;
+	int saved_errno = errno;
+	reap_jobs();
+	errno = saved_errno;
+}
+
+//This method will collect the state changes of background job processes
+//It only waits on pids that belong to the job table, so foreground commands
+//are still waited on by whoever launched them. Safe to call from the signal handler
+void reap_jobs(){
+	for(int i = 0; i < JOBS_MAXIMUM; i++){
+		Job *job = &job_table[i];
+		if(job -> command == NULL || job -> state == JOB_DONE){
+			continue;
+		}
+		for(int k = 0; k < job -> pid_count; k++){
+			int status;
+			if(job -> pids[k] <= 0){
+				continue;
+			}
+			pid_t pid = waitpid(job -> pids[k], &status, WNOHANG | WUNTRACED | WCONTINUED);
+			if(pid <= 0){
+				continue;
+			}
+			if(WIFSTOPPED(status)){
+				job -> state = JOB_STOPPED;
+			}
+			else if(WIFCONTINUED(status)){
+				job -> state = JOB_RUNNING;
+			}
+			else{
+				//The process is gone for good
+				job -> pids[k] = 0;
+				job -> status = status;
+				if(--job -> remaining == 0){
+					job -> state = JOB_DONE;
+				}
+			}
+		}
+	}
+}
+
+//This method will block or unblock SIGCHLD
+//The job table must not be changed by the handler while the shell is working on it
+void block_sigchld(int block){
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	sigprocmask(block ? SIG_BLOCK : SIG_UNBLOCK, &set, NULL);
+}
+
+//This method will install the SIGCHLD handler
+//SA_RESTART keeps reads and foreground waits from failing with EINTR
+void setup_job_control(){
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = handle_sigchld;
+	sigemptyset(&action.sa_mask);
+	action.sa_flags = SA_RESTART;
+	sigaction(SIGCHLD, &action, NULL);
+}
+
+//This method will add a launched pipeline to the job table
+//process_group is the job's own process group, or 0 if it runs in the shell's.
+//Returns the new job's index, or -1 if the table is full
+int add_job(pid_t *pids, int count, const char *command, pid_t process_group){
+	block_sigchld(1);
+	int index = -1;
+	for(int i = 0; i < JOBS_MAXIMUM; i++){
+		if(job_table[i].command == NULL){
+			index = i;
+			break;
+		}
+	}
+	if(index < 0){
+		block_sigchld(0);
+		fprintf(stderr, "wsh: Too many background jobs, waiting for the command\n");
+		for(int k = 0; k < count; k++){
+			if(pids[k] > 0){
+				waitpid(pids[k], NULL, 0);
+			}
+		}
+		return -1;
+	}
+	Job *job = &job_table[index];
+	job -> pids = malloc(count * sizeof(pid_t));
+	job -> pid_count = count;
+	job -> remaining = 0;
+	job -> status = 0;
+	job -> state = JOB_RUNNING;
+	for(int k = 0; k < count; k++){
+		job -> pids[k] = pids[k];
+		if(pids[k] > 0){
+			++job -> remaining;
+		}
+	}
+	if(job -> remaining == 0){
+		job -> state = JOB_DONE;
+	}
+	job -> command = strdup(command);
+	job -> serial = ++job_serial;
+	job -> process_group = process_group;
+	//Some of the processes may have finished before they were in the table
+	reap_jobs();
+	block_sigchld(0);
+	out_printf("[%d] %d\n", index + 1, (int)pids[count - 1]);
+	return index;
+}
+
+//This method will wait in the foreground for every process of a job
+//Once finished, the job is removed from the table
+void wait_for_job(int index){
+	Job *job = &job_table[index];
+	block_sigchld(1);
+	for(int k = 0; k < job -> pid_count; k++){
+		int status;
+		while(job -> pids[k] > 0){
+			if(wait_for_child(job -> pids[k], &status, WUNTRACED) < 0){
+				job -> pids[k] = 0;
+				break;
+			}
+			//A stopped job stays in the table until it is continued
+			if(WIFSTOPPED(status)){
+				job -> state = JOB_STOPPED;
+				block_sigchld(0);
+				fprintf(stderr, "[%d]  Stopped  %s\n", index + 1, job -> command);
+				return;
+			}
+			job -> pids[k] = 0;
+			job -> status = status;
+		}
+	}
+	last_status = exit_code(job -> status);
+	free(job -> command);
+	free(job -> pids);
+	job -> command = NULL;
+	block_sigchld(0);
+}
+
+//This method will put a just launched process into the process group being built
+//Both the child and the shell set it, so it is in place whichever runs first.
+//The first process of a new group becomes its leader
+void join_launch_group(pid_t pid){
+	if(launch_process_group < 0){
+		return;
+	}
+	setpgid(pid, launch_process_group > 0 ? launch_process_group : pid);
+	if(launch_process_group == 0){
+		launch_process_group = pid;
+	}
+}
+
+//This method will turn job control on for an interactive shell at a terminal
+//Background jobs then get process groups of their own, and fg hands them the terminal
+void enable_job_control(){
+	job_control = isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == getpgrp();
+}
+
+//This method will make a process group the foreground of the shell's terminal
+//SIGTTOU is held back, since the shell may be in the background when it takes the terminal back
+void hand_terminal(pid_t process_group){
+	sigset_t set;
+	sigset_t saved;
+	sigemptyset(&set);
+	sigaddset(&set, SIGTTOU);
+	sigprocmask(SIG_BLOCK, &set, &saved);
+	tcsetpgrp(STDIN_FILENO, process_group);
+	sigprocmask(SIG_SETMASK, &saved, NULL);
+}
+
+//This method will send SIGCONT to every process of a stopped job
+//A job with its own process group is continued as a group
+void continue_job(int index){
+	Job *job = &job_table[index];
+	job -> state = JOB_RUNNING;
+	if(job -> process_group > 0 && kill(-job -> process_group, SIGCONT) == 0){
+		return;
+	}
+	for(int k = 0; k < job -> pid_count; k++){
+		if(job -> pids[k] > 0){
+			kill(job -> pids[k], SIGCONT);
+		}
+	}
+	job -> state = JOB_RUNNING;
+}
+
+//This method will turn a job id argument into a job table index
+//With no argument it picks the most recent job. Returns -1 if there is no such job
+int retrieve_job_index(const char *id){
+	if(id == NULL){
+		for(int i = JOBS_MAXIMUM - 1; i >= 0; i--){
+			if(job_table[i].command != NULL){
+				return i;
+			}
+		}
+		return -1;
+	}
+	if(*id == '%'){
+		++id;
+	}
+	int index = atoi(id) - 1;
+	if(index < 0 || index >= JOBS_MAXIMUM || job_table[index].command == NULL){
+		return -1;
+	}
+	return index;
+}
+
+//This method will tell the user about finished background jobs
+//It is called before each command, and frees the finished jobs from the table
+void notify_finished_jobs(int print){
+	block_sigchld(1);
+	for(int i = 0; i < JOBS_MAXIMUM; i++){
+		if(job_table[i].command != NULL && job_table[i].state == JOB_DONE){
+			if(print){
+				out_printf("[%d]  Done     %s\n", i + 1, job_table[i].command);
+			}
+			free(job_table[i].command);
+			free(job_table[i].pids);
+			job_table[i].command = NULL;
+		}
+	}
+	block_sigchld(0);
+}
+
+
+// Methods for the Batch Reader
+
+
+//This method will open a batch file for reading line by line
+//Regular files are memory-mapped so every line can be handed out as a view
+//into the mapping, anything else (pipes, terminals) is streamed in large blocks
+int open_batch_reader(BatchReader *reader, const char *path){
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd == -1){
+		return -1;
+	}
+	start_batch_reader(reader, fd);
+	return 0;
+}
+
+//This method will set up a reader on an already open file
+void start_batch_reader(BatchReader *reader, int fd){
+	memset(reader, 0, sizeof(BatchReader));
+	reader -> fd = fd;
+	struct stat file_stat;
+	if(fstat(fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode) && file_stat.st_size > 0){
+		char *mapped = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(mapped != MAP_FAILED){
+			madvise(mapped, file_stat.st_size, MADV_SEQUENTIAL);
+			reader -> mapped = mapped;
+			reader -> mapped_size = file_stat.st_size;
+		}
+	}
+}
+
+//This method will hand out the next line of the batch file, without its new line
+//The line is a view into the mapping or the read buffer and stays valid until
+//the next call. Returns 0 once there are no more lines
+int next_batch_line(BatchReader *reader, const char **line, size_t *length){
+	//Mapped files - find the end of the line with memchr and hand out a view
+	if(reader -> mapped != NULL){
+		if(reader -> position >= reader -> mapped_size){
+			return 0;
+		}
+		const char *start = reader -> mapped + reader -> position;
+		size_t remaining = reader -> mapped_size - reader -> position;
+		const char *newline = memchr(start, '\n', remaining);
+		*line = start;
+		*length = newline != NULL ? (size_t)(newline - start) : remaining;
+		reader -> position += *length + (newline != NULL);
+		return 1;
+	}
+	//Streamed input - read large blocks until the buffer holds a whole line
+	//The part after a line being handed out is kept for the next call
+	while(1){
+		const char *start = reader -> buffer + reader -> position;
+		size_t remaining = reader -> buffer_size - reader -> position;
+		const char *newline = memchr(start, '\n', remaining);
+		if(newline != NULL || (reader -> eof && remaining > 0)){
+			*line = start;
+			*length = newline != NULL ? (size_t)(newline - start) : remaining;
+			reader -> position += *length + (newline != NULL);
+			return 1;
+		}
+		if(reader -> eof){
+			return 0;
+		}
+		//Move the unfinished line to the front and make room for another block
+		memmove(reader -> buffer, start, remaining);
+		reader -> buffer_size = remaining;
+		reader -> position = 0;
+		if(reader -> buffer_capacity - reader -> buffer_size < BATCH_READ_SIZE){
+			reader -> buffer_capacity = reader -> buffer_size + BATCH_READ_SIZE;
+			reader -> buffer = realloc(reader -> buffer, reader -> buffer_capacity);
+		}
+		ssize_t bytes = read(reader -> fd, reader -> buffer + reader -> buffer_size, reader -> buffer_capacity - reader -> buffer_size);
+		if(bytes < 0 && errno == EINTR){
+			continue;
+		}
+		if(bytes <= 0){
+			reader -> eof = 1;
+		}
+		else{
+			reader -> buffer_size += bytes;
+		}
+	}
+}
+
+//This method will release the mapping or buffer and close the file
+void close_batch_reader(BatchReader *reader){
+	if(reader -> mapped != NULL){
+		munmap(reader -> mapped, reader -> mapped_size);
+	}
+	free(reader -> buffer);
+	if(reader -> fd != STDIN_FILENO){
+		close(reader -> fd);
+	}
+	memset(reader, 0, sizeof(BatchReader));
+}
+
+
+// Methods for Parallel Batch Mode
+
+
+//This method will run a batch file with up to N lines executing at once
+//Independent lines each run in a forked copy of the shell under the Supervisor,
+//which captures their stdout and stderr, and the captured output is written out in
+//script order. Lines that change shell state act as barriers: every earlier line
+//finishes first and then the barrier runs in the shell itself, so later lines see
+//its effect. With a timeout, any line still running after that many seconds is killed
+void execute_parallel_batch(BatchReader *reader, int workers, double timeout){
+	const char *line;
+	size_t length;
+	//Lines that finished early wait here until everything before them is written
+	int window_size = workers * 4;
+	Supervisor supervisor;
+	if(init_supervisor(&supervisor, window_size, timeout) != 0){
+		perror("wsh: supervisor");
+		exit_value = -1;
+		return;
+	}
+	int head = 0;
+	int pending = 0;
+
+	while(next_batch_line(reader, &line, &length)){
+		arena_reset(&command_arena);
+		//Trim the line the same way process_command does
+		while(length > 0 && *line == ' '){
+			line++;
+			length--;
+		}
+		if(length == 0 || *line == '#'){
+			continue;
+		}
+		//A barrier waits for every earlier line, then runs in the shell itself
+		//An if, for or while block is a barrier too, it is compiled and run as a whole
+		int block = is_script_block(line, length);
+		if(block || is_barrier_command(line, length)){
+			while(pending > 0){
+				wait_for_supervised_child(&supervisor, head);
+				emit_supervised_child(&supervisor, head);
+				head = (head + 1) % window_size;
+				--pending;
+			}
+			notify_finished_jobs(1);
+			if(block){
+				CompileState state;
+				init_compile_state(&state, reader, 0);
+				ScriptNode *script = compile_statement(&state, line, length);
+				if(!state.error){
+					execute_script(script);
+				}
+				arena_reset(&script_arena);
+			}
+			else{
+				process_command(line, length);
+			}
+			out_flush();
+			continue;
+		}
+		//Make room for the new line by waiting for any worker to finish,
+		//and write out the oldest lines as soon as they are done
+		while(supervisor.running >= workers || pending >= window_size){
+			if(run_supervisor(&supervisor) < 0){
+				wait_for_supervised_child(&supervisor, head);
+			}
+			while(pending > 0 && supervisor.children[head].done){
+				emit_supervised_child(&supervisor, head);
+				head = (head + 1) % window_size;
+				--pending;
+			}
+		}
+		//Lines run by workers still go into the history list in script order
+		add_to_history(line, length);
+		if(supervise_command(&supervisor, (head + pending) % window_size, line, length) == 0){
+			++pending;
+		}
+	}
+	//Write out whatever is left once it finishes
+	while(pending > 0){
+		wait_for_supervised_child(&supervisor, head);
+		emit_supervised_child(&supervisor, head);
+		head = (head + 1) % window_size;
+		--pending;
+	}
+	free_supervisor(&supervisor);
+}
+
+//This method will decide if a line changes shell state
+//Built-In commands registered as changing state (cd, local, export, history...),
+//as well as background commands, have to run in the shell itself and in order
+int is_barrier_command(const char *line, size_t length){
+	if(memchr(line, '&', length) != NULL){
+		return 1;
+	}
+	while(length > 0 && (*line == ' ' || *line == '\t')){
+		++line;
+		--length;
+	}
+	const char *space = memchr(line, ' ', length);
+	char *name = arena_strndup(&command_arena, line, space != NULL ? (size_t)(space - line) : length);
+	//command always runs the /bin version, builtin runs the Built-In command after it
+	//and time runs whatever follows it
+	if(strcmp(name, "command") == 0){
+		return 0;
+	}
+	if((strcmp(name, "builtin") == 0 || strcmp(name, "time") == 0) && space != NULL){
+		return is_barrier_command(space + 1, length - (space + 1 - line));
+	}
+	const Builtin *builtin = lookup_builtin(name);
+	return builtin != NULL && builtin -> changes_state;
+}
+
+//This method will collect a worker once it exits
+void finish_batch_job(BatchJob *job, int block){
+	if(job -> finished){
+		return;
+	}
+	int status;
+	if(waitpid(job -> pid, &status, block ? 0 : WNOHANG) <= 0){
+		return;
+	}
+	job -> finished = 1;
+	job -> status = status;
+	if(job -> pidfd >= 0){
+		close(job -> pidfd);
+		job -> pidfd = -1;
+	}
+}
+
+//This method will write the first size bytes of a capture file into target
+//Returns 0 once all of it is written
+int send_capture(int target, int source, off_t size){
+	off_t offset = 0;
+	while(offset < size){
+		if(sendfile(target, source, &offset, size - offset) <= 0){
+			break;
+		}
+	}
+	//sendfile refuses targets opened with O_APPEND (wsh -j N script >> log),
+	//so whatever is left is copied with pread and write instead
+	char buffer[BATCH_READ_SIZE];
+	while(offset < size){
+		ssize_t bytes = pread(source, buffer, sizeof(buffer), offset);
+		if(bytes <= 0 || write_all(target, buffer, bytes) != 0){
+			return -1;
+		}
+		offset += bytes;
+	}
+	return 0;
+}
+
+
+// Methods for the Supervisor
+
+
+//This method will set up a Supervisor with room for capacity children
+//Returns 0, or -1 if the epoll instance could not be created
+int init_supervisor(Supervisor *supervisor, int capacity, double timeout){
+	supervisor -> epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if(supervisor -> epoll_fd < 0){
+		return -1;
+	}
+	supervisor -> children = calloc(capacity, sizeof(SupervisedChild));
+	supervisor -> capacity = capacity;
+	supervisor -> running = 0;
+	supervisor -> timeout = timeout;
+	for(int i = 0; i < capacity; i++){
+		SupervisedChild *child = &supervisor -> children[i];
+		child -> pidfd = child -> timer_fd = -1;
+		child -> pipes[0] = child -> pipes[1] = -1;
+		child -> output[0].spill_fd = child -> output[1].spill_fd = -1;
+		child -> done = 1;
+	}
+	//A running child holds up to four fds (pidfd, two pipes and a timer), so the
+	//soft limit on open files is raised far enough for a full table of them
+	struct rlimit limit;
+	rlim_t needed = (rlim_t)capacity * 4 + 64;
+	if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < needed){
+		limit.rlim_cur = limit.rlim_max < needed ? limit.rlim_max : needed;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+	return 0;
+}
+
+//This method will start a line on a worker in the given slot
+//The worker is a forked copy of the shell whose stdout and stderr are pipes the
+//Supervisor drains. Returns 0 once the worker is running
+int supervise_command(Supervisor *supervisor, int slot, const char *line, size_t length){
+	SupervisedChild *child = &supervisor -> children[slot];
+	int out_pipe[2];
+	int err_pipe[2];
+	if(pipe2(out_pipe, O_CLOEXEC) != 0){
+		perror("pipe");
+		return -1;
+	}
+	if(pipe2(err_pipe, O_CLOEXEC) != 0){
+		perror("pipe");
+		close(out_pipe[0]);
+		close(out_pipe[1]);
+		return -1;
+	}
+	out_flush();
+	child -> pid = fork();
+	if(child -> pid < 0){
+		perror("Fork Failed");
+		close(out_pipe[0]);
+		close(out_pipe[1]);
+		close(err_pipe[0]);
+		close(err_pipe[1]);
+		return -1;
+	}
+	if(child -> pid == 0){
+		//A time limit has to reach everything the line starts, so it gets its own group
+		if(supervisor -> timeout > 0){
+			setpgid(0, 0);
+		}
+		//The shell itself records the line in the history file
+		history_list.file_fd = -1;
+		dup2(out_pipe[1], STDOUT_FILENO);
+		dup2(err_pipe[1], STDERR_FILENO);
+		process_command(line, length);
+		out_flush();
+		//Let the shell know if the command could not be found
+		_exit(exit_value != 0 ? 255 : 0);
+	}
+	if(supervisor -> timeout > 0){
+		setpgid(child -> pid, child -> pid);
+	}
+	close(out_pipe[1]);
+	close(err_pipe[1]);
+	child -> pipes[0] = out_pipe[0];
+	child -> pipes[1] = err_pipe[0];
+	child -> command = strndup(line, length);
+	child -> status = 0;
+	child -> exited = 0;
+	child -> timed_out = 0;
+	child -> done = 0;
+	++supervisor -> running;
+	//The read ends never block, each event drains one chunk of whatever arrived
+	for(int i = 0; i < 2; i++){
+		fcntl(child -> pipes[i], F_SETFL, O_NONBLOCK);
+		watch_supervised_fd(supervisor, child -> pipes[i], slot, SUPERVISE_STDOUT + i);
+	}
+	//Without pidfds the child is reaped once it closes both pipes instead
+	child -> pidfd = syscall(SYS_pidfd_open, child -> pid, 0);
+	if(child -> pidfd >= 0){
+		watch_supervised_fd(supervisor, child -> pidfd, slot, SUPERVISE_EXIT);
+	}
+	if(supervisor -> timeout > 0){
+		child -> timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+		if(child -> timer_fd >= 0){
+			struct itimerspec expiry;
+			memset(&expiry, 0, sizeof(expiry));
+			expiry.it_value.tv_sec = (time_t)supervisor -> timeout;
+			expiry.it_value.tv_nsec = (long)((supervisor -> timeout - expiry.it_value.tv_sec) * 1e9);
+			timerfd_settime(child -> timer_fd, 0, &expiry, NULL);
+			watch_supervised_fd(supervisor, child -> timer_fd, slot, SUPERVISE_TIMER);
+		}
+	}
+	return 0;
+}
+
+//Used to add one of a child's fds to the epoll set
+//The slot and kind of event ride along in the entry's data
+int watch_supervised_fd(Supervisor *supervisor, int fd, int slot, int kind){
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.u64 = (uint64_t)slot << 2 | kind;
+	return epoll_ctl(supervisor -> epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+//Used to take one of a child's fds out of the epoll set and close it
+//Workers forked later hold copies of it, so closing alone wouldnt remove it
+void unwatch_supervised_fd(Supervisor *supervisor, int *fd){
+	if(*fd < 0){
+		return;
+	}
+	epoll_ctl(supervisor -> epoll_fd, EPOLL_CTL_DEL, *fd, NULL);
+	close(*fd);
+	*fd = -1;
+}
+
+//This method will wait for events on any child and handle them
+//Pipes give up one chunk per event, so a noisy child cant starve the others.
+//Returns the number of events handled, or -1 if epoll failed
+int run_supervisor(Supervisor *supervisor){
+	struct epoll_event events[SUPERVISOR_EVENTS];
+	int count;
+	while((count = epoll_wait(supervisor -> epoll_fd, events, SUPERVISOR_EVENTS, -1)) < 0){
+		if(errno != EINTR){
+			perror("epoll_wait");
+			return -1;
+		}
+	}
+	for(int i = 0; i < count; i++){
+		SupervisedChild *child = &supervisor -> children[events[i].data.u64 >> 2];
+		int kind = events[i].data.u64 & 3;
+		if(kind == SUPERVISE_EXIT){
+			reap_supervised_child(supervisor, child);
+		}
+		else if(kind == SUPERVISE_TIMER){
+			expire_supervised_child(supervisor, child);
+		}
+		else{
+			drain_supervised_output(supervisor, child, kind - SUPERVISE_STDOUT);
+		}
+	}
+	return count;
+}
+
+//This method will read the next chunk a child wrote to stdout (0) or stderr (1)
+//The pipe is closed once the child and everything it started have let go of it
+void drain_supervised_output(Supervisor *supervisor, SupervisedChild *child, int stream){
+	if(child -> pipes[stream] < 0){
+		return;
+	}
+	char buffer[BATCH_READ_SIZE];
+	ssize_t bytes = read(child -> pipes[stream], buffer, sizeof(buffer));
+	if(bytes < 0 && (errno == EAGAIN || errno == EINTR)){
+		return;
+	}
+	if(bytes > 0){
+		append_capture(&child -> output[stream], buffer, bytes);
+		return;
+	}
+	unwatch_supervised_fd(supervisor, &child -> pipes[stream]);
+	settle_supervised_child(supervisor, child);
+}
+
+//This method will collect a child once its pidfd reports that it exited
+void reap_supervised_child(Supervisor *supervisor, SupervisedChild *child){
+	if(child -> exited){
+		return;
+	}
+	waitpid(child -> pid, &child -> status, 0);
+	child -> exited = 1;
+	unwatch_supervised_fd(supervisor, &child -> pidfd);
+	settle_supervised_child(supervisor, child);
+}
+
+//This method will kill a child that ran past the time limit
+//The whole process group goes, so nothing the line started keeps its pipes open
+void expire_supervised_child(Supervisor *supervisor, SupervisedChild *child){
+	if(child -> done || child -> timer_fd < 0){
+		return;
+	}
+	unwatch_supervised_fd(supervisor, &child -> timer_fd);
+	child -> timed_out = 1;
+	kill(-child -> pid, SIGKILL);
+}
+
+//This method will kill a child straight away and collect it
+void stop_supervised_child(Supervisor *supervisor, SupervisedChild *child){
+	if(child -> done){
+		return;
+	}
+	kill(supervisor -> timeout > 0 ? -child -> pid : child -> pid, SIGKILL);
+	unwatch_supervised_fd(supervisor, &child -> pipes[0]);
+	unwatch_supervised_fd(supervisor, &child -> pipes[1]);
+	if(!child -> exited){
+		waitpid(child -> pid, &child -> status, 0);
+		child -> exited = 1;
+	}
+	unwatch_supervised_fd(supervisor, &child -> pidfd);
+	settle_supervised_child(supervisor, child);
+}
+
+//This method will mark a child done once it has exited and both pipes are drained
+//A child without a pidfd is collected here, as soon as both its pipes are closed
+void settle_supervised_child(Supervisor *supervisor, SupervisedChild *child){
+	if(child -> done || child -> pipes[0] >= 0 || child -> pipes[1] >= 0){
+		return;
+	}
+	if(!child -> exited){
+		if(child -> pidfd >= 0){
+			return;
+		}
+		waitpid(child -> pid, &child -> status, 0);
+		child -> exited = 1;
+	}
+	unwatch_supervised_fd(supervisor, &child -> timer_fd);
+	child -> done = 1;
+	--supervisor -> running;
+}
+
+//This method will wait until the child in slot is done
+//If epoll stops working, the child is killed and whatever it printed so far is kept
+void wait_for_supervised_child(Supervisor *supervisor, int slot){
+	SupervisedChild *child = &supervisor -> children[slot];
+	while(!child -> done){
+		if(run_supervisor(supervisor) < 0){
+			stop_supervised_child(supervisor, child);
+		}
+	}
+}
+
+//This method will write out a done child's captured stdout and stderr, then free its slot
+void emit_supervised_child(Supervisor *supervisor, int slot){
+	SupervisedChild *child = &supervisor -> children[slot];
+	emit_capture(&child -> output[0], STDOUT_FILENO);
+	emit_capture(&child -> output[1], STDERR_FILENO);
+	if(child -> timed_out){
+		fprintf(stderr, "wsh: timed out after %gs: %s\n", supervisor -> timeout, child -> command);
+	}
+	else if(WIFEXITED(child -> status) && WEXITSTATUS(child -> status) == 255){
+		exit_value = -1;
+	}
+	release_supervised_child(supervisor, slot);
+}
+
+//This method will free a child's slot, killing the child if it is still running
+void release_supervised_child(Supervisor *supervisor, int slot){
+	SupervisedChild *child = &supervisor -> children[slot];
+	if(child -> command == NULL){
+		return;
+	}
+	stop_supervised_child(supervisor, child);
+	free_capture(&child -> output[0]);
+	free_capture(&child -> output[1]);
+	free(child -> command);
+	child -> command = NULL;
+}
+
+//This method will free the Supervisor, killing any child that is still running
+void free_supervisor(Supervisor *supervisor){
+	for(int i = 0; i < supervisor -> capacity; i++){
+		release_supervised_child(supervisor, i);
+	}
+	free(supervisor -> children);
+	close(supervisor -> epoll_fd);
+}
+
+//This method will add a chunk of output to a capture buffer
+//Once the buffer would pass CAPTURE_BUFFER_MAXIMUM, it moves into a memory file.
+//Returns -1 if the chunk could not be kept
+int append_capture(CaptureBuffer *buffer, const char *data, size_t length){
+	if(buffer -> spill_fd < 0 && buffer -> used + length > CAPTURE_BUFFER_MAXIMUM){
+		int spill_fd = memfd_create("wsh-capture", MFD_CLOEXEC);
+		if(spill_fd < 0 || write_all(spill_fd, buffer -> data, buffer -> used) != 0){
+			perror("memfd_create");
+			if(spill_fd >= 0){
+				close(spill_fd);
+			}
+			return -1;
+		}
+		free(buffer -> data);
+		buffer -> data = NULL;
+		buffer -> used = 0;
+		buffer -> capacity = 0;
+		buffer -> spill_fd = spill_fd;
+	}
+	if(buffer -> spill_fd >= 0){
+		return write_all(buffer -> spill_fd, data, length);
+	}
+	if(buffer -> used + length > buffer -> capacity){
+		size_t capacity = buffer -> capacity > 0 ? buffer -> capacity : 4096;
+		while(capacity < buffer -> used + length){
+			capacity *= 2;
+		}
+		buffer -> data = realloc(buffer -> data, capacity);
+		buffer -> capacity = capacity;
+	}
+	memcpy(buffer -> data + buffer -> used, data, length);
+	buffer -> used += length;
+	return 0;
+}
+
+//This method will write everything in a capture buffer into target
+void emit_capture(CaptureBuffer *buffer, int target){
+	if(buffer -> spill_fd >= 0){
+		send_capture(target, buffer -> spill_fd, lseek(buffer -> spill_fd, 0, SEEK_END));
+	}
+	else if(buffer -> used > 0){
+		write_all(target, buffer -> data, buffer -> used);
+	}
+}
+
+//This method will free a capture buffer and its memory file
+void free_capture(CaptureBuffer *buffer){
+	free(buffer -> data);
+	if(buffer -> spill_fd >= 0){
+		close(buffer -> spill_fd);
+	}
+	memset(buffer, 0, sizeof(CaptureBuffer));
+	buffer -> spill_fd = -1;
+}
+
+
+// Methods for Server Mode (wsh --serve)
+
+
+//Set by SIGINT and SIGTERM to stop the server
+volatile sig_atomic_t serve_stopping = 0;
+
+//Used to ask the server to stop once its current poll returns
+void handle_serve_signal(int signal_number){
+	(void)signal_number;
+	serve_stopping = 1;
+}
+
+//This method will run the shell as a server on a Unix socket
+//The shell's caches, variables and history stay warm between requests. Requests that
+//change shell state run in the server itself, the rest run in forked workers so
+//many clients are served at once. Nothing in the loop blocks on one client: sockets
+//are nonblocking with responses sent as they have room, and wait or fg is answered
+//once its jobs are done. Returns once SIGINT or SIGTERM is received
+int execute_serve(const char *path){
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(address.sun_path)){
+		fprintf(stderr, "wsh: %s: socket path too long\n", path);
+		return -1;
+	}
+	strcpy(address.sun_path, path);
+	int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	//A socket left behind by an earlier server is replaced
+	struct stat info;
+	if(lstat(path, &info) == 0 && S_ISSOCK(info.st_mode)){
+		unlink(path);
+	}
+	if(listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listen_fd, SOMAXCONN) != 0){
+		perror("wsh: serve");
+		return -1;
+	}
+	//Requests never read the server's own stdin
+	int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = handle_serve_signal;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	//A client that hangs up early shouldnt take the server with it
+	signal(SIGPIPE, SIG_IGN);
+
+	ServeClient *clients = calloc(SERVE_CLIENTS_MAXIMUM, sizeof(ServeClient));
+	if(clients == NULL){
+		perror("wsh: serve");
+		close(null_fd);
+		close(listen_fd);
+		unlink(path);
+		return -1;
+	}
+	struct pollfd fds[SERVE_CLIENTS_MAXIMUM + 1];
+	int owners[SERVE_CLIENTS_MAXIMUM + 1];
+	for(int i = 0; i < SERVE_CLIENTS_MAXIMUM; i++){
+		clients[i].fd = -1;
+	}
+	//SIGCHLD is only let through while polling, so a background job finishing
+	//after its waiters were checked still wakes the loop up
+	sigset_t poll_mask;
+	sigprocmask(SIG_SETMASK, NULL, &poll_mask);
+	sigdelset(&poll_mask, SIGCHLD);
+	while(!serve_stopping){
+		block_sigchld(1);
+		answer_serve_waits(clients);
+		//Clients sending a response are watched for room in their socket, busy ones for
+		//their worker and idle ones for their next request. Waiting ones need nothing
+		int count = 0;
+		fds[count].fd = listen_fd;
+		fds[count++].events = POLLIN;
+		for(int i = 0; i < SERVE_CLIENTS_MAXIMUM; i++){
+			if(clients[i].fd == -1 || (clients[i].waiting && !clients[i].response.active)){
+				continue;
+			}
+			fds[count].fd = clients[i].response.active || !clients[i].busy ? clients[i].fd : clients[i].job.pidfd;
+			fds[count].events = clients[i].response.active ? POLLOUT : POLLIN;
+			owners[count++] = i;
+		}
+		int ready = ppoll(fds, count, NULL, &poll_mask);
+		block_sigchld(0);
+		if(ready < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			perror("wsh: serve");
+			break;
+		}
+		if(fds[0].revents & POLLIN){
+			accept_serve_client(listen_fd, clients);
+		}
+		for(int k = 1; k < count; k++){
+			if(fds[k].revents == 0){
+				continue;
+			}
+			ServeClient *client = &clients[owners[k]];
+			if(client -> response.active){
+				if(flush_serve_response(client) != 0 || (!client -> response.active && client -> closing)){
+					close_serve_client(client);
+					continue;
+				}
+			}
+			else if(client -> busy){
+				finish_batch_job(&client -> job, 1);
+				client -> busy = 0;
+				if(queue_serve_response(client, exit_code(client -> job.status), client -> job.out_fd, client -> job.err_fd) != 0){
+					continue;
+				}
+			}
+			else if(read_serve_client(client) != 0){
+				close_serve_client(client);
+				continue;
+			}
+			serve_next_request(client, null_fd);
+		}
+	}
+	for(int i = 0; i < SERVE_CLIENTS_MAXIMUM; i++){
+		if(clients[i].fd != -1){
+			if(clients[i].busy){
+				finish_batch_job(&clients[i].job, 1);
+				close(clients[i].job.out_fd);
+				close(clients[i].job.err_fd);
+			}
+			close_serve_client(&clients[i]);
+		}
+	}
+	free(clients);
+	close(null_fd);
+	close(listen_fd);
+	unlink(path);
+	return 0;
+}
+
+//This method will accept a new client into a free slot
+//If every slot is taken, the connection is closed straight away
+void accept_serve_client(int listen_fd, ServeClient *clients){
+	int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if(fd < 0){
+		return;
+	}
+	for(int i = 0; i < SERVE_CLIENTS_MAXIMUM; i++){
+		if(clients[i].fd == -1){
+			memset(&clients[i], 0, sizeof(ServeClient));
+			clients[i].fd = fd;
+			return;
+		}
+	}
+	close(fd);
+}
+
+//This method will read whatever a client has sent so far into its buffer
+//Returns -1 once the client hangs up, or sends a request that is too large or cant be held
+int read_serve_client(ServeClient *client){
+	if(client -> capacity - client -> used < BATCH_READ_SIZE){
+		char *buffer = realloc(client -> buffer, client -> used + BATCH_READ_SIZE);
+		if(buffer == NULL){
+			return -1;
+		}
+		client -> buffer = buffer;
+		client -> capacity = client -> used + BATCH_READ_SIZE;
+	}
+	ssize_t bytes = recv(client -> fd, client -> buffer + client -> used, client -> capacity - client -> used, 0);
+	if(bytes < 0 && (errno == EAGAIN || errno == EINTR)){
+		return 0;
+	}
+	if(bytes <= 0){
+		return -1;
+	}
+	client -> used += bytes;
+	if(client -> used >= 4){
+		uint32_t length;
+		memcpy(&length, client -> buffer, 4);
+		if(ntohl(length) > SERVE_REQUEST_MAXIMUM){
+			return -1;
+		}
+	}
+	return 0;
+}
+
+//This method will start the client's requests that have arrived, one at a time
+//Requests that change shell state run in the server and are answered straight away.
+//Anything else is started on a worker, answered when it exits. The next request
+//only starts once the response to the last one has been sent
+void serve_next_request(ServeClient *client, int null_fd){
+	uint32_t length;
+	while(client -> fd != -1 && !client -> busy && !client -> waiting && !client -> response.active && client -> used >= 4){
+		memcpy(&length, client -> buffer, 4);
+		length = ntohl(length);
+		if(client -> used < 4 + (size_t)length){
+			return;
+		}
+		serve_request(client, length, null_fd);
+	}
+}
+
+//This method will run the request at the front of the client's buffer
+void serve_request(ServeClient *client, uint32_t length, int null_fd){
+	arena_reset(&command_arena);
+	//The request is copied out, so the buffer can take the next one
+	char *command = arena_strndup(&command_arena, client -> buffer + 4, length);
+	client -> used -= 4 + length;
+	memmove(client -> buffer, client -> buffer + 4 + length, client -> used);
+
+	const char *line = command;
+	size_t line_length = length;
+	trim_script_line(&line, &line_length);
+	//exit ends the client's session, not the server
+	if(line_length == 4 && memcmp(line, "exit", 4) == 0){
+		client -> closing = 1;
+		if(queue_serve_response(client, 0, -1, -1) == 0 && !client -> response.active){
+			close_serve_client(client);
+		}
+		return;
+	}
+	if(park_serve_wait(client, line, line_length)){
+		return;
+	}
+	//Scripts go to a worker like any other command, unless they change shell state
+	int script = memchr(line, '\n', line_length) != NULL || is_script_block(line, line_length);
+	if(script ? script_changes_state(line, line_length) : is_barrier_command(line, line_length)){
+		int out_fd = memfd_create("wsh-stdout", MFD_CLOEXEC);
+		int err_fd = memfd_create("wsh-stderr", MFD_CLOEXEC);
+		int request_fds[3] = { null_fd, out_fd, err_fd };
+		int saved[3];
+		redirect_shell_fds(request_fds, saved);
+		if(script){
+			execute_serve_script(line, line_length);
+		}
+		else{
+			process_command(line, line_length);
+		}
+		restore_shell_fds(saved);
+		queue_serve_response(client, last_status, out_fd, err_fd);
+		return;
+	}
+	//Resolve the command here first, so this and every later worker finds it cached
+	if(!script){
+		const char *space = memchr(line, ' ', line_length);
+		char *name = arena_strndup(&command_arena, line, space != NULL ? (size_t)(space - line) : line_length);
+		if(strchr(name, '/') == NULL && strchr(name, '$') == NULL && lookup_builtin(name) == NULL){
+			retrieve_command_path(name);
+		}
+		add_to_history(line, line_length);
+	}
+	if(start_serve_job(line, line_length, script, &client -> job, null_fd) != 0){
+		queue_serve_response(client, 1, -1, -1);
+	}
+	else if(client -> job.finished){
+		queue_serve_response(client, exit_code(client -> job.status), client -> job.out_fd, client -> job.err_fd);
+	}
+	else{
+		client -> busy = 1;
+	}
+}
+
+//This method will hold back a wait or fg request until its jobs are done
+//Only a plain wait or fg on a job still running (or stopped, for fg) is held, anything else (a job that doesnt
+//exist, or is already done) runs in the server like before, as it wont block.
+//Returns 1 if the request was held
+int park_serve_wait(ServeClient *client, const char *line, size_t length){
+	int fg = length >= 2 && memcmp(line, "fg", 2) == 0 && (length == 2 || line[2] == ' ');
+	int wait = length >= 4 && memcmp(line, "wait", 4) == 0 && (length == 4 || line[4] == ' ');
+	if(!fg && !wait){
+		return 0;
+	}
+	const char *id = line + (fg ? 2 : 4);
+	size_t id_length = length - (fg ? 2 : 4);
+	trim_script_line(&id, &id_length);
+	for(size_t i = 0; i < id_length; i++){
+		if(strchr(" \t|&;<>$", id[i]) != NULL){
+			return 0;
+		}
+	}
+	int index = -1;
+	if(fg || id_length > 0){
+		index = retrieve_job_index(id_length > 0 ? arena_strndup(&command_arena, id, id_length) : NULL);
+		if(index < 0 || job_table[index].state == JOB_DONE || (wait && job_table[index].state != JOB_RUNNING)){
+			return 0;
+		}
+	}
+	else{
+		int running = 0;
+		for(int i = 0; i < JOBS_MAXIMUM; i++){
+			running |= job_table[i].command != NULL && job_table[i].state == JOB_RUNNING;
+		}
+		if(!running){
+			return 0;
+		}
+	}
+	add_to_history(line, length);
+	client -> job.out_fd = -1;
+	client -> job.err_fd = -1;
+	//fg prints the job's command like it does in the shell, then waits for it
+	if(fg){
+		client -> job.out_fd = memfd_create("wsh-stdout", MFD_CLOEXEC);
+		if(client -> job.out_fd >= 0){
+			write_all(client -> job.out_fd, job_table[index].command, strlen(job_table[index].command));
+			write_all(client -> job.out_fd, "\n", 1);
+		}
+		continue_job(index);
+	}
+	client -> waiting = 1;
+	client -> wait_job = index;
+	client -> wait_serial = index >= 0 ? job_table[index].serial : 0;
+	return 1;
+}
+
+//This method will answer the held wait and fg requests whose jobs are done, and then
+//free the finished jobs from the table. SIGCHLD has to be blocked by the caller
+//so no job finishes between the two
+void answer_serve_waits(ServeClient *clients){
+	int running = 0;
+	for(int i = 0; i < JOBS_MAXIMUM; i++){
+		running |= job_table[i].command != NULL && job_table[i].state == JOB_RUNNING;
+	}
+	for(int i = 0; i < SERVE_CLIENTS_MAXIMUM; i++){
+		ServeClient *client = &clients[i];
+		if(client -> fd == -1 || !client -> waiting){
+			continue;
+		}
+		int status = 0;
+		if(client -> wait_job < 0){
+			if(running){
+				continue;
+			}
+		}
+		else{
+			//A job freed (or replaced) by something else is done as well,
+			//and one that was stopped is reported like the shell's own wait does
+			Job *job = &job_table[client -> wait_job];
+			int same = job -> command != NULL && job -> serial == client -> wait_serial;
+			if(same && job -> state == JOB_RUNNING){
+				continue;
+			}
+			status = same && job -> state == JOB_DONE ? exit_code(job -> status) : 0;
+		}
+		client -> waiting = 0;
+		if(queue_serve_response(client, status, client -> job.out_fd, client -> job.err_fd) != 0){
+			continue;
+		}
+	}
+	for(int i = 0; i < JOBS_MAXIMUM; i++){
+		if(job_table[i].command != NULL && job_table[i].state == JOB_DONE){
+			free(job_table[i].command);
+			free(job_table[i].pids);
+			job_table[i].command = NULL;
+		}
+	}
+}
+
+//Used to tell if a script request changes shell state, so it has to run in the server
+//Any line that would be a barrier in parallel batch mode counts, including one behind
+//if, elif or while. A for loop sets its variable in the shell, so it counts too
+int script_changes_state(const char *text, size_t length){
+	const char *end = text + length;
+	while(text < end){
+		const char *newline = memchr(text, '\n', end - text);
+		const char *line = text;
+		size_t line_length = (newline != NULL ? newline : end) - text;
+		text = newline != NULL ? newline + 1 : end;
+		trim_script_line(&line, &line_length);
+		if(script_keyword(line, line_length, "for")){
+			return 1;
+		}
+		const char *keywords[] = { "if", "elif", "while" };
+		for(size_t k = 0; k < sizeof(keywords) / sizeof(keywords[0]); k++){
+			size_t keyword_length = strlen(keywords[k]);
+			if(script_keyword(line, line_length, keywords[k])){
+				line += keyword_length;
+				line_length -= keyword_length;
+				trim_script_line(&line, &line_length);
+				break;
+			}
+		}
+		if(line_length > 0 && is_barrier_command(line, line_length)){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+//This method will compile and run a request that holds a whole script
+void execute_serve_script(const char *text, size_t length){
+	BatchReader reader;
+	memset(&reader, 0, sizeof(BatchReader));
+	reader.fd = -1;
+	reader.mapped = (char *)text;
+	reader.mapped_size = length;
+	CompileState state;
+	init_compile_state(&state, &reader, 0);
+	ScriptNode *script = compile_script(&state);
+	if(state.error){
+		last_status = 2;
+	}
+	else{
+		execute_script(script);
+	}
+	arena_reset(&script_arena);
+}
+
+//This method will start a request on a worker
+//The worker is a forked copy of the server, so it starts with everything the server
+//has cached, and its stdout and stderr go into anonymous memory files.
+//With script, the request is compiled and run as a whole script
+int start_serve_job(const char *line, size_t length, int script, BatchJob *job, int null_fd){
+	job -> finished = 0;
+	job -> status = 0;
+	job -> out_fd = memfd_create("wsh-stdout", MFD_CLOEXEC);
+	job -> err_fd = memfd_create("wsh-stderr", MFD_CLOEXEC);
+	if(job -> out_fd < 0 || job -> err_fd < 0){
+		perror("memfd_create");
+		close(job -> out_fd);
+		close(job -> err_fd);
+		return -1;
+	}
+	out_flush();
+	job -> pid = fork();
+	if(job -> pid < 0){
+		perror("Fork Failed");
+		close(job -> out_fd);
+		close(job -> err_fd);
+		return -1;
+	}
+	if(job -> pid == 0){
+		//The server itself records the request in the history file
+		history_list.file_fd = -1;
+		signal(SIGPIPE, SIG_DFL);
+		dup2(null_fd, STDIN_FILENO);
+		dup2(job -> out_fd, STDOUT_FILENO);
+		dup2(job -> err_fd, STDERR_FILENO);
+		if(script){
+			execute_serve_script(line, length);
+		}
+		else{
+			process_command(line, length);
+		}
+		out_flush();
+		_exit(last_status & 0xff);
+	}
+	job -> pidfd = syscall(SYS_pidfd_open, job -> pid, 0);
+	//Without pidfds there is nothing to poll, so the request is finished in place
+	if(job -> pidfd < 0){
+		finish_batch_job(job, 1);
+	}
+	return 0;
+}
+
+//This method will start sending a response to a client
+//The header is followed by the captured stdout and stderr (an fd of -1 sends nothing),
+//and the capture files are closed once they are sent. As much as fits is sent now,
+//the rest when the client's socket has room. Returns -1 (with the client closed) if it is gone
+int queue_serve_response(ServeClient *client, int status, int out_fd, int err_fd){
+	ServeResponse *response = &client -> response;
+	int capture_fds[2] = { out_fd, err_fd };
+	for(int i = 0; i < 2; i++){
+		response -> capture_fds[i] = capture_fds[i];
+		response -> capture_lengths[i] = capture_fds[i] >= 0 ? lseek(capture_fds[i], 0, SEEK_END) : 0;
+		response -> capture_offsets[i] = 0;
+	}
+	response -> header.status = htonl((uint32_t)status);
+	response -> header.out_length = htonl((uint32_t)response -> capture_lengths[0]);
+	response -> header.err_length = htonl((uint32_t)response -> capture_lengths[1]);
+	response -> header_sent = 0;
+	response -> active = 1;
+	if(flush_serve_response(client) != 0){
+		close_serve_client(client);
+		return -1;
+	}
+	return 0;
+}
+
+//This method will send as much of a client's response as its socket takes
+//Returns -1 if the client is gone. Once all of it is sent, the response is no longer active
+int flush_serve_response(ServeClient *client){
+	ServeResponse *response = &client -> response;
+	while(response -> header_sent < sizeof(ServeResponseHeader)){
+		ssize_t bytes = send(client -> fd, (const char *)&response -> header + response -> header_sent, sizeof(ServeResponseHeader) - response -> header_sent, MSG_NOSIGNAL);
+		if(bytes < 0 && (errno == EAGAIN || errno == EINTR)){
+			return 0;
+		}
+		if(bytes <= 0){
+			return -1;
+		}
+		response -> header_sent += bytes;
+	}
+	for(int i = 0; i < 2; i++){
+		while(response -> capture_offsets[i] < response -> capture_lengths[i]){
+			ssize_t bytes = sendfile(client -> fd, response -> capture_fds[i], &response -> capture_offsets[i], response -> capture_lengths[i] - response -> capture_offsets[i]);
+			if(bytes < 0 && (errno == EAGAIN || errno == EINTR)){
+				return 0;
+			}
+			if(bytes <= 0){
+				return -1;
+			}
+		}
+		if(response -> capture_fds[i] >= 0){
+			close(response -> capture_fds[i]);
+			response -> capture_fds[i] = -1;
+		}
+	}
+	response -> active = 0;
+	return 0;
+}
+
+//This method will close a client's connection and free its slot
+//along with a response still waiting to be sent
+void close_serve_client(ServeClient *client){
+	if(client -> busy && client -> job.pidfd >= 0){
+		close(client -> job.pidfd);
+	}
+	for(int i = 0; client -> response.active && i < 2; i++){
+		if(client -> response.capture_fds[i] >= 0){
+			close(client -> response.capture_fds[i]);
+		}
+	}
+	//A held fg already made its capture file
+	if(client -> waiting && client -> job.out_fd >= 0){
+		close(client -> job.out_fd);
+	}
+	close(client -> fd);
+	free(client -> buffer);
+	memset(client, 0, sizeof(ServeClient));
+	client -> fd = -1;
+}
+
+
+// Methods for the Shell Variable Store
+
+
+//This method will find the slot for a name in the store's hash table
+//It returns the slot holding the name, or the empty slot where it would go
+//The name is a (pointer, length) view, so it can point straight into a command line
+int find_variable_slot(ShellVariables *store, const char *name, size_t length, unsigned int hash){
+	int mask = store -> slot_count - 1;
+	int slot = hash & mask;
+	while(store -> slots[slot] != -1){
+		ShellVariable *entry = &store -> entries[store -> slots[slot]];
+		if(entry -> hash == hash && strncmp(entry -> name, name, length) == 0 && entry -> name[length] == '\0'){
+			return slot;
+		}
+		slot = (slot + 1) & mask;
+	}
+	return slot;
+}
+
+//This method will look up the value of a variable in the store
+//Will return NULL if the variable isnt found
+char *lookup_variable(ShellVariables *store, const char *name){
+	return lookup_variable_bytes(store, name, strlen(name));
+}
+
+//This method will look up the value of a variable named by the first length bytes of name
+//Will return NULL if the variable isnt found
+char *lookup_variable_bytes(ShellVariables *store, const char *name, size_t length){
+	if(store -> count == 0){
+		return NULL;
+	}
+	int slot = find_variable_slot(store, name, length, hash_bytes(name, length));
+	if(store -> slots[slot] == -1){
+		return NULL;
+	}
+	return store -> entries[store -> slots[slot]].value;
+}
+
+//This method will create or assign a variable in the store
+//New variables are added to the end of entries, so insertion order is kept
+void set_variable(ShellVariables *store, const char *name, const char *value){
+	//Keep the table at most half full so probe sequences stay short
+	if((store -> count + 1) * 2 > store -> slot_count){
+		grow_variable_slots(store);
+	}
+	unsigned int hash = hash_string(name);
+	int slot = find_variable_slot(store, name, strlen(name), hash);
+	//If the variable already exists, we just replace its value
+	if(store -> slots[slot] != -1){
+		ShellVariable *entry = &store -> entries[store -> slots[slot]];
+		char *temp_value = strdup(value);
+		free(entry -> value);
+		entry -> value = temp_value;
+		return;
+	}
+	if(store -> count == store -> capacity){
+		store -> capacity = store -> capacity ? store -> capacity * 2 : 16;
+		store -> entries = realloc(store -> entries, store -> capacity * sizeof(ShellVariable));
+	}
+	ShellVariable *entry = &store -> entries[store -> count];
+	entry -> name = strdup(name);
+	entry -> value = strdup(value);
+	entry -> hash = hash;
+	store -> slots[slot] = store -> count++;
+}
+
+//This method will double the store's hash table and re-insert every entry
+//The hashes are kept with the entries, so no name is hashed twice
+void grow_variable_slots(ShellVariables *store){
+	int slot_count = store -> slot_count ? store -> slot_count * 2 : 32;
+	free(store -> slots);
+	store -> slots = malloc(slot_count * sizeof(int));
+	store -> slot_count = slot_count;
+	for(int i = 0; i < slot_count; i++){
+		store -> slots[i] = -1;
+	}
+	for(int i = 0; i < store -> count; i++){
+		int slot = store -> entries[i].hash & (slot_count - 1);
+		while(store -> slots[slot] != -1){
+			slot = (slot + 1) & (slot_count - 1);
+		}
+		store -> slots[slot] = i;
+	}
+}
+
+//This method will remove a variable from the store, if it is there
+//The entries after it move down to keep insertion order, so the hash table is filled in again
+void unset_variable(ShellVariables *store, const char *name){
+	if(store -> count == 0){
+		return;
+	}
+	int index = store -> slots[find_variable_slot(store, name, strlen(name), hash_string(name))];
+	if(index == -1){
+		return;
+	}
+	free(store -> entries[index].name);
+	free(store -> entries[index].value);
+	memmove(store -> entries + index, store -> entries + index + 1, (store -> count - index - 1) * sizeof(ShellVariable));
+	--store -> count;
+	for(int i = 0; i < store -> slot_count; i++){
+		store -> slots[i] = -1;
+	}
+	for(int i = 0; i < store -> count; i++){
+		int slot = store -> entries[i].hash & (store -> slot_count - 1);
+		while(store -> slots[slot] != -1){
+			slot = (slot + 1) & (store -> slot_count - 1);
+		}
+		store -> slots[slot] = i;
+	}
+}
+
+//This method will free every variable in the store
+void free_variables(ShellVariables *store){
+	for(int i = 0; i < store -> count; i++){
+		free(store -> entries[i].name);
+		free(store -> entries[i].value);
+	}
+	free(store -> entries);
+	free(store -> slots);
+	store -> entries = NULL;
+	store -> slots = NULL;
+	store -> count = store -> capacity = store -> slot_count = 0;
+}
+
+
+// Methods for Command Timing and Profiling
+
+
+//Used to read the monotonic clock in seconds
+double monotonic_seconds(){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+//Used to turn a timeval from rusage into seconds
+double timeval_seconds(struct timeval value){
+	return value.tv_sec + value.tv_usec / 1e6;
+}
+
+//This method will wait for a child with wait4, so its resource usage isnt thrown away
+//While a command is being timed, the usage is added to the command's totals
+pid_t wait_for_child(pid_t pid, int *status, int options){
+	struct rusage usage;
+	int child_status;
+	pid_t result;
+	while((result = wait4(pid, &child_status, options, &usage)) < 0 && errno == EINTR){
+	}
+	if(result > 0 && !WIFSTOPPED(child_status) && command_timing.active){
+		command_timing.child_user += timeval_seconds(usage.ru_utime);
+		command_timing.child_sys += timeval_seconds(usage.ru_stime);
+		if(usage.ru_maxrss > command_timing.child_maxrss){
+			command_timing.child_maxrss = usage.ru_maxrss;
+		}
+		command_timing.child_nvcsw += usage.ru_nvcsw;
+		command_timing.child_nivcsw += usage.ru_nivcsw;
+	}
+	if(status != NULL){
+		*status = child_status;
+	}
+	return result;
+}
+
+//This method will finish timing a command
+//The shell's own usage since the command started is added to its children's usage.
+//A command run with time is reported on stderr, and with WSH_PROFILE on
+//it is added to the profile of its command name
+void report_command_timing(const char *name, double started, struct rusage *self_start, int timed){
+	struct rusage self_end;
+	getrusage(RUSAGE_SELF, &self_end);
+	double wall = monotonic_seconds() - started;
+	double user = command_timing.child_user + timeval_seconds(self_end.ru_utime) - timeval_seconds(self_start -> ru_utime);
+	double sys = command_timing.child_sys + timeval_seconds(self_end.ru_stime) - timeval_seconds(self_start -> ru_stime);
+	long maxrss = command_timing.child_maxrss;
+	long nvcsw = command_timing.child_nvcsw + self_end.ru_nvcsw - self_start -> ru_nvcsw;
+	long nivcsw = command_timing.child_nivcsw + self_end.ru_nivcsw - self_start -> ru_nivcsw;
+	if(timed){
+		out_flush();
+		fprintf(stderr, "real\t%.3fs\nuser\t%.3fs\nsys\t%.3fs\nmaxrss\t%ld KB\nctxsw\t%ld voluntary, %ld involuntary\n",
+			wall, user, sys, maxrss, nvcsw, nivcsw);
+		fprintf(stderr, "shell\tparse %.1fus, substitute %.1fus, resolve %.1fus, spawn %.1fus\n",
+			command_timing.parse * 1e6, command_timing.substitute * 1e6, command_timing.resolve * 1e6, command_timing.spawn * 1e6);
+	}
+	if(!profile_enabled){
+		return;
+	}
+	ProfileEntry *entry = profile_entries;
+	while(entry != NULL && strcmp(entry -> name, name) != 0){
+		entry = entry -> next;
+	}
+	if(entry == NULL){
+		entry = calloc(1, sizeof(ProfileEntry));
+		entry -> name = strdup(name);
+		entry -> next = profile_entries;
+		profile_entries = entry;
+	}
+	entry -> count++;
+	entry -> wall += wall;
+	entry -> user += user;
+	entry -> sys += sys;
+	if(maxrss > entry -> maxrss){
+		entry -> maxrss = maxrss;
+	}
+	entry -> nvcsw += nvcsw;
+	entry -> nivcsw += nivcsw;
+	entry -> parse += command_timing.parse;
+	entry -> substitute += command_timing.substitute;
+	entry -> resolve += command_timing.resolve;
+	entry -> spawn += command_timing.spawn;
+	//Bucket k holds wall times from 2^k up to 2^(k+1) microseconds
+	int bucket = 0;
+	for(double micros = wall * 1e6; micros >= 2 && bucket < PROFILE_BUCKETS - 1; micros /= 2){
+		++bucket;
+	}
+	entry -> histogram[bucket]++;
+}
+
+//This method will print the profile of every command name on stderr
+//Used when the shell exits with WSH_PROFILE on
+void print_profile(){
+	if(!profile_enabled){
+		return;
+	}
+	for(ProfileEntry *entry = profile_entries; entry != NULL; entry = entry -> next){
+		fprintf(stderr, "wsh profile: %s count=%ld wall=%.6fs user=%.6fs sys=%.6fs maxrss=%ldKB ctxsw=%ld/%ld\n",
+			entry -> name, entry -> count, entry -> wall, entry -> user, entry -> sys, entry -> maxrss, entry -> nvcsw, entry -> nivcsw);
+		fprintf(stderr, "  shell overhead: parse=%.1fus substitute=%.1fus resolve=%.1fus spawn=%.1fus\n",
+			entry -> parse * 1e6, entry -> substitute * 1e6, entry -> resolve * 1e6, entry -> spawn * 1e6);
+		long most = 0;
+		for(int k = 0; k < PROFILE_BUCKETS; k++){
+			if(entry -> histogram[k] > most){
+				most = entry -> histogram[k];
+			}
+		}
+		for(int k = 0; k < PROFILE_BUCKETS; k++){
+			if(entry -> histogram[k] == 0){
+				continue;
+			}
+			int bar = (int)(entry -> histogram[k] * 40 / most);
+			fprintf(stderr, "  %10ldus .. %10ldus %8ld %.*s\n", k == 0 ? 0L : 1L << k, 1L << (k + 1),
+				entry -> histogram[k], bar > 0 ? bar : 1, "########################################");
+		}
+	}
+}
+
+
+// Methods for History Command
+
+
+//This Method will handle adding a new command to the history list
+//If the command is already there, it wont repeat it. If it isnt,
+//it will add it to the list and update its values accordingly.
+//New commands are also appended to the history file when there is one
+void add_to_history(const char *command, size_t length){
+	if(history_list.maximum_size <= 0){
+		return;
+	}
+	//Check if its already in the history list
+	const HistoryEntry *newest = retrieve_from_history(1);
+	if(newest != NULL && newest -> length == length && memcmp(newest -> text, command, length) == 0){
+		return;		
+	}
+	if(history_list.commands == NULL){
+		history_list.commands = calloc(history_list.maximum_size, sizeof(HistoryEntry));
+		if(history_list.commands == NULL){
+			perror("history");
+			return;
+		}
+	}
+	//If the command isnt in the history list, we continue
+	//The new command goes one slot behind the current newest one. If the history
+	//list is full, that slot holds the oldest command, which gets evicted
+	int slot = (history_list.newest + history_list.maximum_size - 1) % history_list.maximum_size;
+	HistoryEntry *entry = &history_list.commands[slot];
+	//The command can be the evicted entry itself (history replaying its oldest
+	//command), so it is copied before the old text is freed
+	char *text = strndup(command, length);
+	if(text == NULL){
+		perror("history");
+		return;
+	}
+	if(history_list.command_count == history_list.maximum_size){
+		if(entry -> owned){
+			free((char *)entry -> text);
+		}
+	}
+	//because the list wasnt full, we update the number of commands in the list
+	else{
+		++history_list.command_count;
+	}
+	//We now insert the new command into the now empty most recent spot
+	entry -> text = text;
+	entry -> length = length;
+	entry -> owned = 1;
+	history_list.newest = slot;
+
+	//Keep the history file up to date, one command per line
+	if(history_list.file_fd != -1){
+		struct iovec parts[2] = { { text, length }, { "\n", 1 } };
+		if(writev(history_list.file_fd, parts, 2) < 0){
+			perror("history");
+		}
+	}
+}
+
+
+//This method will be used when we want to execute a command from memory
+//It will access command and return the specified command, where 1 is the most recent
+const HistoryEntry* retrieve_from_history(int n){
+	if(n <= history_list.command_count && n > 0){
+		return &history_list.commands[(history_list.newest + n - 1) % history_list.maximum_size];
+	}
+        return NULL;	
+}
+
+//This method will set a new history list size
+//The ring is copied out oldest last into a new array of the new size. If the
+//new size is smaller, the oldest commands that dont fit are evicted
+//Returns -1 and leaves the list as it was if the new array cant be allocated
+int resize_history(int new_size){
+	HistoryEntry *commands = new_size > 0 ? calloc(new_size, sizeof(HistoryEntry)) : NULL;
+	if(new_size > 0 && commands == NULL){
+		perror("history");
+		return -1;
+	}
+	int kept = 0;
+	for(int n = 1; n <= history_list.command_count; n++){
+		HistoryEntry *entry = (HistoryEntry *)retrieve_from_history(n);
+		if(n <= new_size){
+			commands[kept++] = *entry;
+		}
+		else if(entry -> owned){
+			free((char *)entry -> text);
+		}
+	}
+	free(history_list.commands);
+	history_list.commands = commands;
+	history_list.newest = 0;
+	//Once we're done, we need to adjust the amount of commands
+	//in history and set the history list's max size to that of the new size
+	history_list.command_count = kept;
+	history_list.maximum_size = new_size;
+	return 0;
+}
+
+//This method will load the history file and keep it open for appending
+//The file is memory-mapped and only its last maximum_size lines are looked at,
+//so startup costs the same no matter how long the file has grown. The loaded
+//entries point straight into the mapping instead of being copied
+void load_history_file(const char *path){
+	int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+	if(fd == -1){
+		perror("history");
+		return;
+	}
+	history_list.file_fd = fd;
+	struct stat file_stat;
+	if(fstat(fd, &file_stat) != 0 || file_stat.st_size == 0 || history_list.maximum_size <= 0){
+		return;
+	}
+	char *mapped = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(mapped == MAP_FAILED){
+		perror("history");
+		return;
+	}
+	history_list.mapped = mapped;
+	history_list.mapped_size = file_stat.st_size;
+	if(history_list.commands == NULL){
+		history_list.commands = calloc(history_list.maximum_size, sizeof(HistoryEntry));
+		if(history_list.commands == NULL){
+			perror("history");
+			return;
+		}
+	}
+	//Walk backwards from the end of the file, newest command first
+	size_t end = file_stat.st_size;
+	if(mapped[end - 1] == '\n'){
+		--end;
+	}
+	while(end > 0 && history_list.command_count < history_list.maximum_size){
+		char *newline = memrchr(mapped, '\n', end);
+		size_t start = newline != NULL ? (size_t)(newline - mapped) + 1 : 0;
+		if(end > start){
+			HistoryEntry *entry = &history_list.commands[history_list.command_count++];
+			entry -> text = mapped + start;
+			entry -> length = end - start;
+			entry -> owned = 0;
+		}
+		end = start > 0 ? start - 1 : 0;
+	}
+	history_list.newest = 0;
+}
+
+//This method will free the history list and close the history file
+void free_history(){
+	for(int n = 1; n <= history_list.command_count; n++){
+		const HistoryEntry *entry = retrieve_from_history(n);
+		if(entry -> owned){
+			free((char *)entry -> text);
+		}
+	}
+	free(history_list.commands);
+	history_list.commands = NULL;
+	history_list.command_count = 0;
+	if(history_list.mapped != NULL){
+		munmap(history_list.mapped, history_list.mapped_size);
+		history_list.mapped = NULL;
+	}
+	if(history_list.file_fd != -1){
+		close(history_list.file_fd);
+		history_list.file_fd = -1;
+	}
+}
+
+
+// Helper Methods for General Use By Program
+
+
+//Used when conducting LS as it does a quick sort of directory content
+//to do comparison between items. The items are offsets into the names buffer
+int basic_comparison(const void *a, const void *b, void *names){
+	return strcmp((const char *)names + *(const size_t *)a, (const char *)names + *(const size_t *)b);
+}
+
+//This method will add text to the output buffer
+//Small pieces are copied into the buffer, large ones are written out together
+//with whatever is already buffered in a single writev
+void out_write(const char *text, size_t length){
+	if(length >= OUTPUT_BUFFER_SIZE / 2){
+		struct iovec parts[2] = { { output_buffer.data, output_buffer.used }, { (void *)text, length } };
+		writev_all(STDOUT_FILENO, parts, 2);
+		output_buffer.used = 0;
+		return;
+	}
+	if(output_buffer.used + length > OUTPUT_BUFFER_SIZE){
+		out_flush();
+	}
+	memcpy(output_buffer.data + output_buffer.used, text, length);
+	output_buffer.used += length;
+}
+
+//This method will format text straight into the output buffer, like printf
+void out_printf(const char *format, ...){
+	va_list args;
+	va_start(args, format);
+	size_t room = OUTPUT_BUFFER_SIZE - output_buffer.used;
+	int length = vsnprintf(output_buffer.data + output_buffer.used, room, format, args);
+	va_end(args);
+	if(length < 0){
+		return;
+	}
+	if((size_t)length < room){
+		output_buffer.used += length;
+		return;
+	}
+	//It didnt fit, so format it on its own and hand it to out_write
+	char *text = malloc(length + 1);
+	va_start(args, format);
+	vsnprintf(text, length + 1, format, args);
+	va_end(args);
+	out_write(text, length);
+	free(text);
+}
+
+//This method will write out everything in the output buffer
+//It must be called before stdout changes (redirections, pipes) and before a child
+//is started, so the shell's output always comes out in order
+void out_flush(){
+	if(output_buffer.used > 0){
+		write_all(STDOUT_FILENO, output_buffer.data, output_buffer.used);
+		output_buffer.used = 0;
+	}
+}
+
+//Used to write a set of buffers to a file, even if it takes more than one writev
+int writev_all(int fd, struct iovec *parts, int count){
+	while(count > 0){
+		ssize_t written = writev(fd, parts, count);
+		if(written < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			return -1;
+		}
+		//Skip past everything that was written
+		while(count > 0 && (size_t)written >= parts -> iov_len){
+			written -= parts -> iov_len;
+			++parts;
+			--count;
+		}
+		if(count > 0){
+			parts -> iov_base = (char *)parts -> iov_base + written;
+			parts -> iov_len -= written;
+		}
+	}
+	return 0;
+}
+
+//Used to write a whole buffer to a file, even if it takes more than one write
+int write_all(int fd, const char *buffer, size_t length){
+	while(length > 0){
+		ssize_t written = write(fd, buffer, length);
+		if(written < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			return -1;
+		}
+		buffer += written;
+		length -= written;
+	}
+	return 0;
+}
+
+//This method will read the entries of a directory (all but . and ..) into a listing
+//Entries come in with large getdents64 batches and their names are packed one
+//after another into a single buffer, with offsets recording where each one starts
+int read_directory_listing(const char *path, DirectoryListing *listing){
+	memset(listing, 0, sizeof(DirectoryListing));
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(fd == -1){
+		return -1;
+	}
+	char *batch = malloc(LS_BATCH_SIZE);
+	ssize_t bytes;
+	while((bytes = getdents64(fd, batch, LS_BATCH_SIZE)) > 0){
+		for(ssize_t position = 0; position < bytes;){
+			struct dirent64 *entry = (struct dirent64 *)(batch + position);
+			position += entry -> d_reclen;
+			//Ignore . and .., hidden files are left to the caller
+			if(entry -> d_name[0] == '.' && (entry -> d_name[1] == '\0' || (entry -> d_name[1] == '.' && entry -> d_name[2] == '\0'))){
+				continue;
+			}
+			size_t length = strlen(entry -> d_name) + 1;
+			if(listing -> names_size + length > listing -> names_capacity){
+				listing -> names_capacity = (listing -> names_size + length) * 2;
+				listing -> names = realloc(listing -> names, listing -> names_capacity);
+			}
+			if(listing -> count == listing -> capacity){
+				listing -> capacity = listing -> capacity ? listing -> capacity * 2 : 64;
+				listing -> offsets = realloc(listing -> offsets, listing -> capacity * sizeof(size_t));
+			}
+			memcpy(listing -> names + listing -> names_size, entry -> d_name, length);
+			listing -> offsets[listing -> count++] = listing -> names_size;
+			listing -> names_size += length;
+		}
+	}
+	int error = errno;
+	free(batch);
+	//close out directory once were done
+	close(fd);
+	if(bytes < 0){
+		free_directory_listing(listing);
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+//This method will free the names and offsets of a listing
+void free_directory_listing(DirectoryListing *listing){
+	free(listing -> names);
+	free(listing -> offsets);
+	memset(listing, 0, sizeof(DirectoryListing));
+}
+
+//Used to decide where redirections are applied.
+//It checks if the passed in name is one of the Built-In commands
+int is_builtin_command(const char *name){
+	return lookup_builtin(name) != NULL;
+}
+
+
+// Methods for the Builtin Registry
+
+
+//The registry itself, generated from the WSH_BUILTINS list in wsh.h
+static const Builtin builtin_registry[] = {
+#define WSH_REGISTER_BUILTIN(name, handler, min_args, max_args, add_to_history, changes_state, arity_error) \
+	{ name, handler, min_args, max_args, add_to_history, changes_state, arity_error },
+	WSH_BUILTINS(WSH_REGISTER_BUILTIN)
+	WSH_EXTRA_BUILTINS(WSH_REGISTER_BUILTIN)
+#undef WSH_REGISTER_BUILTIN
+};
+
+#define BUILTIN_COUNT (int)(sizeof(builtin_registry) / sizeof(builtin_registry[0]))
+
+//Slots of the registry's hash table, each holding a registry index + 1 (0 is empty)
+//They are filled in the first time a name is looked up
+static unsigned char builtin_slots[BUILTIN_SLOTS];
+static int builtin_slots_ready = 0;
+
+//Used to hash a builtin name from its length and its first and last characters
+//Only those three bytes are looked at, so a lookup costs one hash and one strcmp
+unsigned int hash_builtin_name(const char *name, size_t length){
+	return (unsigned int)(length * 31 + (unsigned char)name[0] * 7 + (unsigned char)name[length - 1]) & (BUILTIN_SLOTS - 1);
+}
+
+//This method will fill in the registry's hash table
+//Collisions are resolved by linear probing, so adding builtins never adds comparisons
+//for the names that were already there
+void init_builtin_registry(){
+	for(int i = 0; i < BUILTIN_COUNT; i++){
+		const char *name = builtin_registry[i].name;
+		unsigned int slot = hash_builtin_name(name, strlen(name));
+		while(builtin_slots[slot] != 0){
+			slot = (slot + 1) & (BUILTIN_SLOTS - 1);
+		}
+		builtin_slots[slot] = i + 1;
+	}
+	builtin_slots_ready = 1;
+}
+
+//This method will find a Built-In command by name
+//Will return NULL if the name isnt a Built-In command
+const Builtin *lookup_builtin(const char *name){
+	size_t length = strlen(name);
+	if(length == 0){
+		return NULL;
+	}
+	if(!builtin_slots_ready){
+		init_builtin_registry();
+	}
+	unsigned int slot = hash_builtin_name(name, length);
+	while(builtin_slots[slot] != 0){
+		const Builtin *builtin = &builtin_registry[builtin_slots[slot] - 1];
+		if(strcmp(builtin -> name, name) == 0){
+			return builtin;
+		}
+		slot = (slot + 1) & (BUILTIN_SLOTS - 1);
+	}
+	return NULL;
+}
+
+//Used in substitute variable method.
+//It checks though the existing shell variables and determines if
+//the passed in variable already exists
+char *retrieve_shell_variable(const char *name){
+	//Will return NULL if the variable isnt found
+	return lookup_variable(&variables, name);	
+}
+
+//This method will handle the substitution of variables after
+//process command is finished reading in the command and before
+//it prepares to execute it. The substituted command is built in the command
+//arena and grows as values are expanded, so it can be any length
+char *substitute_command_variables(const char *command, size_t length){
+	ExpansionBuffer output;
+	output.capacity = length + 64;
+	output.used = 0;
+	output.data = arena_alloc(&command_arena, output.capacity);
+	expand_variables(&output, command, length);
+	//Once finsihed, add on an end line to finish the command
+	append_expansion(&output, "", 1);
+	return output.data;
+}
+
+//This method will expand every variable in text onto the end of output
+//The text between variables is found with memchr and copied in one go, and every
+//lookup is a hash probe, so a line costs time in its length and not in the number
+//of variables that exist. Supported forms are $NAME, ${NAME}, ${NAME:-default}, $?
+//and $(command)
+void expand_variables(ExpansionBuffer *output, const char *text, size_t length){
+	const char *end = text + length;
+	while(text < end){
+		//$ denotes the start of a variable, everything before it is copied as is
+		const char *dollar = memchr(text, '$', end - text);
+		if(dollar == NULL){
+			append_expansion(output, text, end - text);
+			return;
+		}
+		append_expansion(output, text, dollar - text);
+		const char *name = dollar + 1;
+		//$? is the exit status of the last command
+		if(name < end && *name == '?'){
+			append_status(output);
+			text = name + 1;
+			continue;
+		}
+		//$(command) is whatever the command prints
+		const char *close = name < end && *name == '(' ? find_substitution_end(name, end) : NULL;
+		if(close != NULL){
+			expand_substitution(output, name + 1, close - name - 1);
+			text = close + 1;
+			continue;
+		}
+		if(name < end && *name == '{'){
+			text = expand_braced_variable(output, name, end);
+			continue;
+		}
+		size_t name_length = variable_name_length(name, end);
+		//A $ that doesnt start a name is just a $
+		if(name_length == 0){
+			append_expansion(output, "$", 1);
+			text = name;
+			continue;
+		}
+		const char *value = lookup_expansion_variable(name, name_length);
+		if(value != NULL){
+			append_expansion(output, value, strlen(value));
+		}
+		text = name + name_length;
+	}
+}
+
+//This method will expand a ${...} variable, brace points at its opening brace
+//Returns where the text after the closing brace starts
+const char *expand_braced_variable(ExpansionBuffer *output, const char *brace, const char *end){
+	//Find the matching brace, a default value can hold braced variables of its own
+	const char *close = brace + 1;
+	int depth = 1;
+	for(; close < end; close++){
+		if(*close == '{' && close[-1] == '$'){
+			++depth;
+		}
+		else if(*close == '}' && --depth == 0){
+			break;
+		}
+	}
+	//Without a closing brace, the text is left as it was
+	if(close == end){
+		append_expansion(output, "$", 1);
+		return brace;
+	}
+	const char *name = brace + 1;
+	size_t name_length = name < close && *name == '?' ? 1 : variable_name_length(name, close);
+	const char *rest = name + name_length;
+	int has_default = close - rest >= 2 && rest[0] == ':' && rest[1] == '-';
+	if(name_length == 0 || (rest != close && !has_default)){
+		fprintf(stderr, "wsh: %.*s: bad substitution\n", (int)(close - brace + 2), brace - 1);
+		return close + 1;
+	}
+	if(*name == '?'){
+		append_status(output);
+		return close + 1;
+	}
+	const char *value = lookup_expansion_variable(name, name_length);
+	//The default is used when the variable is unset or empty, and is expanded itself
+	if(value != NULL && *value != '\0'){
+		append_expansion(output, value, strlen(value));
+	}
+	else if(has_default){
+		expand_variables(output, rest + 2, close - rest - 2);
+	}
+	return close + 1;
+}
+
+//Used to find how long the variable name at the start of text is
+//Names are made of letters, digits and underscores
+size_t variable_name_length(const char *text, const char *end){
+	const char *name_end = text;
+	while(name_end < end && (*name_end == '_' || (*name_end >= 'a' && *name_end <= 'z') ||
+		(*name_end >= 'A' && *name_end <= 'Z') || (*name_end >= '0' && *name_end <= '9'))){
+		++name_end;
+	}
+	return name_end - text;
+}
+
+//Used to find the value of a variable while expanding
+//Enviroment variables come first, then the shell's own variables
+const char *lookup_expansion_variable(const char *name, size_t length){
+	const char *value = lookup_environment(name, length);
+	if(value == NULL){
+		value = lookup_variable_bytes(&variables, name, length);
+	}
+	return value;
+}
+
+//Used to add the last command's exit status to the output for $?
+void append_status(ExpansionBuffer *output){
+	char status[16];
+	int status_length = snprintf(status, sizeof(status), "%d", last_status);
+	append_expansion(output, status, status_length);
+}
+
+//Used to make room for length more bytes at the end of the output, growing it in the arena
+//Returns where they go, the caller fills them in and adds them to used
+char *reserve_expansion(ExpansionBuffer *output, size_t length){
+	if(output -> used + length > output -> capacity){
+		size_t new_capacity = (output -> used + length) * 2;
+		output -> data = arena_grow(&command_arena, output -> data, output -> capacity, new_capacity);
+		output -> capacity = new_capacity;
+	}
+	return output -> data + output -> used;
+}
+
+//Used to add length bytes of text to the end of the output
+void append_expansion(ExpansionBuffer *output, const char *text, size_t length){
+	memcpy(reserve_expansion(output, length), text, length);
+	output -> used += length;
+}
+
+
+// Methods for Command Substitution
+
+
+//Used to find the ) that closes the $( whose ( is at open
+//Parentheses inside, including nested substitutions, are skipped over in pairs.
+//Will return NULL if it is never closed
+const char *find_substitution_end(const char *open, const char *end){
+	int depth = 0;
+	for(const char *c = open; c < end; c++){
+		if(*c == '('){
+			++depth;
+		}
+		else if(*c == ')' && --depth == 0){
+			return c;
+		}
+	}
+	return NULL;
+}
+
+//This method will run the command of a $(...) and add what it printed to output
+//The command runs inside the shell with stdout pointed at a memory file, so builtins
+//and nested substitutions never fork a copy of the shell. Only a command that would
+//change the shell's own state (cd, local, exit...) or run in the background gets one.
+//Once it finishes, the whole capture is read in one pread straight into the output,
+//so even megabytes of output are copied once. Trailing newlines are dropped
+void expand_substitution(ExpansionBuffer *output, const char *command, size_t length){
+	int capture = retrieve_substitution_file();
+	if(capture < 0){
+		return;
+	}
+	CompiledCommand *compiled = compile_command(command, length, &command_arena);
+	if(compiled == NULL){
+		return;
+	}
+	compiled -> transient = 1;
+	++substitution.depth;
+	if(substitution_needs_fork(compiled)){
+		out_flush();
+		pid_t pid = fork();
+		if(pid < 0){
+			perror("Fork Failed");
+			last_status = 1;
+		}
+		else if(pid == 0){
+			//The shell itself keeps the history file
+			history_list.file_fd = -1;
+			dup2(capture, STDOUT_FILENO);
+			execute_compiled_command(compiled, 0);
+			out_flush();
+			_exit(last_status & 0xff);
+		}
+		else{
+			int status;
+			wait_for_child(pid, &status, 0);
+			last_status = exit_code(status);
+		}
+	}
+	else{
+		int fds[3] = { -1, capture, -1 };
+		int saved[3];
+		redirect_shell_fds(fds, saved);
+		execute_compiled_command(compiled, 0);
+		restore_shell_fds(saved);
+	}
+	--substitution.depth;
+
+	off_t size = lseek(capture, 0, SEEK_END);
+	char *target = size > 0 ? reserve_expansion(output, size) : NULL;
+	off_t offset = 0;
+	while(offset < size){
+		ssize_t bytes = pread(capture, target + offset, size - offset, offset);
+		if(bytes <= 0){
+			break;
+		}
+		offset += bytes;
+	}
+	while(offset > 0 && target[offset - 1] == '\n'){
+		--offset;
+	}
+	output -> used += offset;
+	//Empty the file for the next substitution at this depth
+	if(ftruncate(capture, 0) != 0 || lseek(capture, 0, SEEK_SET) != 0){
+		perror("wsh: substitution");
+	}
+}
+
+//Used to decide if a substitution has to run in a copy of the shell
+//That is when it runs in the background, or any stage is a Built-In command
+//that changes shell state or a name only known once it is expanded
+int substitution_needs_fork(CompiledCommand *compiled){
+	if(compiled -> background){
+		return 1;
+	}
+	for(int i = 0; i < compiled -> stage_count; i++){
+		CompiledStage *stage = &compiled -> stages[i];
+		int first = 0;
+		if(stage -> word_count > 1 && (strcmp(stage -> words[0].text, "command") == 0 || strcmp(stage -> words[0].text, "builtin") == 0)){
+			//command always runs the /bin version, which cant touch the shell
+			if(stage -> words[0].text[0] == 'c'){
+				continue;
+			}
+			first = 1;
+		}
+		if(stage -> word_count == 0){
+			continue;
+		}
+		Word *name = &stage -> words[first];
+		if(name -> dynamic){
+			return 1;
+		}
+		const Builtin *builtin = lookup_builtin(name -> text);
+		if(builtin != NULL && builtin -> changes_state){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+//Used to find the capture file for the substitution about to run
+//The file is kept above the standard fds, so pointing stdout at it never clobbers it.
+//Returns -1 if substitutions are nested too deeply or the file cant be made
+int retrieve_substitution_file(){
+	if(substitution.depth == SUBSTITUTION_DEPTH_MAXIMUM){
+		fprintf(stderr, "wsh: command substitution nested too deeply\n");
+		return -1;
+	}
+	int *file = &substitution.files[substitution.depth];
+	if(*file == 0){
+		int fd = memfd_create("wsh-substitution", MFD_CLOEXEC);
+		if(fd < 0){
+			perror("memfd_create");
+			return -1;
+		}
+		*file = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+		close(fd);
+	}
+	return *file;
+}
+
+
+// Methods for Glob Expansion
+
+
+//This method will compile a word into a glob pattern
+//Each / separated component is turned into tokens once, with [...] classes turned
+//into bitmaps, so matching a name never parses the pattern again.
+//Will return NULL if the word has no *, ? or [...] in it and isnt a pattern
+GlobPattern *compile_glob(const char *text, Arena *arena){
+	if(strpbrk(text, "*?[") == NULL){
+		return NULL;
+	}
+	GlobPattern *pattern = arena_alloc(arena, sizeof(GlobPattern));
+	pattern -> absolute = *text == '/';
+	pattern -> component_count = 0;
+	int capacity = 4;
+	pattern -> components = arena_alloc(arena, capacity * sizeof(GlobComponent));
+	int literal = 1;
+	while(*text != '\0'){
+		const char *slash = strchr(text, '/');
+		size_t length = slash != NULL ? (size_t)(slash - text) : strlen(text);
+		//Repeated slashes dont make empty components
+		if(length > 0){
+			if(pattern -> component_count == capacity){
+				pattern -> components = arena_grow(arena, pattern -> components, capacity * sizeof(GlobComponent), capacity * 2 * sizeof(GlobComponent));
+				capacity *= 2;
+			}
+			GlobComponent *component = &pattern -> components[pattern -> component_count++];
+			literal &= compile_glob_component(component, text, length, arena);
+		}
+		text += length + (slash != NULL);
+	}
+	return literal ? NULL : pattern;
+}
+
+//This method will compile one component of a glob pattern into tokens
+//Returns 1 if it turned out to be plain text (a [ without a closing ] is just a [)
+int compile_glob_component(GlobComponent *component, const char *text, size_t length, Arena *arena){
+	component -> text = arena_strndup(arena, text, length);
+	component -> tokens = arena_alloc(arena, length * sizeof(GlobToken));
+	component -> token_count = 0;
+	component -> literal = 1;
+	const char *end = text + length;
+	while(text < end){
+		GlobToken *token = &component -> tokens[component -> token_count++];
+		token -> type = GLOB_CHAR;
+		token -> c = (unsigned char)*text;
+		token -> set = NULL;
+		if(*text == '*'){
+			token -> type = GLOB_STAR;
+			component -> literal = 0;
+			//A run of stars matches the same as one
+			while(text < end && *text == '*'){
+				++text;
+			}
+			continue;
+		}
+		if(*text == '?'){
+			token -> type = GLOB_ANY;
+		}
+		else if(*text == '['){
+			const char *after = compile_glob_class(token, text, end, arena);
+			if(after != NULL){
+				text = after;
+				component -> literal = 0;
+				continue;
+			}
+		}
+		component -> literal &= token -> type == GLOB_CHAR;
+		++text;
+	}
+	return component -> literal;
+}
+
+//This method will compile a [...] class, open points at its [
+//The class becomes a bitmap of every byte it accepts, with [!...] or [^...] turning
+//it around and a-z adding a range. A ] right after the [ (or the !) is part of the set.
+//Returns where the text after the closing ] starts, or NULL if there isnt one
+const char *compile_glob_class(GlobToken *token, const char *open, const char *end, Arena *arena){
+	const char *c = open + 1;
+	int negate = c < end && (*c == '!' || *c == '^');
+	c += negate;
+	const char *first = c;
+	const char *close = c < end && *c == ']' ? c + 1 : c;
+	while(close < end && *close != ']'){
+		++close;
+	}
+	if(close >= end){
+		return NULL;
+	}
+	unsigned char *set = arena_alloc(arena, 32);
+	memset(set, 0, 32);
+	for(c = first; c < close; c++){
+		unsigned char low = (unsigned char)*c;
+		unsigned char high = low;
+		if(c + 2 < close && c[1] == '-'){
+			high = (unsigned char)c[2];
+			c += 2;
+		}
+		for(int byte = low; byte <= high; byte++){
+			set[byte >> 3] |= 1 << (byte & 7);
+		}
+	}
+	if(negate){
+		for(int i = 0; i < 32; i++){
+			set[i] = ~set[i];
+		}
+	}
+	token -> type = GLOB_CLASS;
+	token -> set = set;
+	return close + 1;
+}
+
+//This method will match a name against the tokens of a compiled component
+//On a mismatch, only the last * is given one more character, so a name is matched
+//in time proportional to its length times the pattern's, never exponentially.
+//Returns 1 if the whole name matches
+int match_glob(const GlobToken *tokens, int count, const char *name){
+	int t = 0;
+	int star = -1;
+	const char *star_name = NULL;
+	while(*name != '\0'){
+		if(t < count && tokens[t].type == GLOB_STAR){
+			star = t++;
+			star_name = name;
+			continue;
+		}
+		if(t < count){
+			unsigned char c = (unsigned char)*name;
+			const GlobToken *token = &tokens[t];
+			if(token -> type == GLOB_ANY || (token -> type == GLOB_CHAR && token -> c == c) ||
+				(token -> type == GLOB_CLASS && (token -> set[c >> 3] & (1 << (c & 7))))){
+				++t;
+				++name;
+				continue;
+			}
+		}
+		if(star < 0){
+			return 0;
+		}
+		t = star + 1;
+		name = ++star_name;
+	}
+	while(t < count && tokens[t].type == GLOB_STAR){
+		++t;
+	}
+	return t == count;
+}
+
+//This method will add every path that matches a pattern to values, in sorted order
+//values grows in the arena and always keeps room for one more entry after count.
+//Returns how many paths matched
+int expand_glob(GlobPattern *pattern, Arena *arena, char ***values, int *count, int *capacity){
+	int before = *count;
+	expand_glob_component(pattern, 0, pattern -> absolute ? "/" : "", arena, values, count, capacity);
+	return *count - before;
+}
+
+//This method will match the component at index inside the directory path
+//path is empty for the current directory and otherwise ends with a /
+void expand_glob_component(GlobPattern *pattern, int index, const char *path, Arena *arena, char ***values, int *count, int *capacity){
+	GlobComponent *component = &pattern -> components[index];
+	int last = index == pattern -> component_count - 1;
+	size_t path_length = strlen(path);
+	//A literal component is only checked for once a pattern before it has matched
+	if(component -> literal){
+		char *next = join_glob_path(arena, path, path_length, component -> text, !last);
+		struct stat info;
+		if(!last){
+			expand_glob_component(pattern, index + 1, next, arena, values, count, capacity);
+		}
+		else if(lstat(next, &info) == 0){
+			append_glob_match(arena, values, count, capacity, next);
+		}
+		return;
+	}
+	DirectorySnapshot *snapshot = retrieve_directory_snapshot(path_length > 0 ? path : ".");
+	if(snapshot == NULL){
+		return;
+	}
+	//Every match is copied out before looking inside any of them,
+	//reading the next directory could push this snapshot out of the cache
+	int first = *count;
+	for(size_t k = 0; k < snapshot -> listing.count; k++){
+		const char *name = snapshot -> listing.names + snapshot -> listing.offsets[k];
+		//Hidden names only match a pattern that starts with a .
+		if(name[0] == '.' && (component -> tokens[0].type != GLOB_CHAR || component -> tokens[0].c != '.')){
+			continue;
+		}
+		if(match_glob(component -> tokens, component -> token_count, name)){
+			append_glob_match(arena, values, count, capacity, join_glob_path(arena, path, path_length, name, !last));
+		}
+	}
+	if(last){
+		return;
+	}
+	//The directories matched so far are replaced by whatever matches inside them
+	int matched = *count - first;
+	char **directories = arena_alloc(arena, (matched + 1) * sizeof(char *));
+	memcpy(directories, *values + first, matched * sizeof(char *));
+	*count = first;
+	for(int m = 0; m < matched; m++){
+		expand_glob_component(pattern, index + 1, directories[m], arena, values, count, capacity);
+	}
+}
+
+//Used to join a directory path and a name in the arena, with a / after it when asked
+char *join_glob_path(Arena *arena, const char *path, size_t path_length, const char *name, int slash){
+	size_t name_length = strlen(name);
+	char *joined = arena_alloc(arena, path_length + name_length + 2);
+	memcpy(joined, path, path_length);
+	memcpy(joined + path_length, name, name_length);
+	if(slash){
+		joined[path_length + name_length++] = '/';
+	}
+	joined[path_length + name_length] = '\0';
+	return joined;
+}
+
+//Used to add one matching path to the end of values, growing it in the arena
+void append_glob_match(Arena *arena, char ***values, int *count, int *capacity, char *value){
+	// Keep room for the NULL at the end
+	if(*count + 1 >= *capacity){
+		*values = arena_grow(arena, *values, *capacity * sizeof(char *), *capacity * 2 * sizeof(char *));
+		*capacity *= 2;
+	}
+	(*values)[(*count)++] = value;
+}
+
+
+// Methods for the Export Table
+
+
+//This method will load the export table from the enviroment the shell started with
+//The first definition of a name wins, like getenv
+//Returns -1 if the table couldnt be allocated, it is loaded again on the next use
+int load_export_table(){
+	int count = 0;
+	while(environ != NULL && environ[count] != NULL){
+		++count;
+	}
+	//Keep the table at most half full so probe sequences stay short
+	int slot_count = 32;
+	while(slot_count < count * 2){
+		slot_count *= 2;
+	}
+	if(index_export_table(slot_count) != 0){
+		return -1;
+	}
+	for(int i = 0; i < count; i++){
+		char *equals = strchr(environ[i], '=');
+		if(equals == NULL){
+			continue;
+		}
+		int slot = find_export_slot(environ[i], equals - environ[i]);
+		if(export_table.slots[slot] == -1){
+			char *entry = strdup(environ[i]);
+			if(entry == NULL || add_export_entry(slot, entry) != 0){
+				free(entry);
+				return -1;
+			}
+		}
+	}
+	export_table.loaded = 1;
+	return 0;
+}
+
+//This method will find the slot for a name in the export table's hash table
+//It returns the slot holding the name, or the empty slot where it would go
+int find_export_slot(const char *name, size_t length){
+	int mask = export_table.slot_count - 1;
+	int slot = hash_bytes(name, length) & mask;
+	while(export_table.slots[slot] != -1){
+		const char *entry = export_table.entries[export_table.slots[slot]];
+		if(strncmp(entry, name, length) == 0 && entry[length] == '='){
+			return slot;
+		}
+		slot = (slot + 1) & mask;
+	}
+	return slot;
+}
+
+//This method will find the value of an exported variable
+//Will return NULL if the variable isnt found
+const char *lookup_environment(const char *name, size_t length){
+	if(!export_table.loaded && load_export_table() != 0){
+		return NULL;
+	}
+	int index = export_table.slots[find_export_slot(name, length)];
+	return index == -1 ? NULL : export_table.entries[index] + length + 1;
+}
+
+//This method will export a variable, or give an exported variable a new value
+//Only the one NAME=value string changes, envp is rebuilt on the next launch
+//Returns -1 and leaves the table as it was if there is no memory for the variable
+int set_environment_variable(const char *name, const char *value){
+	if(!export_table.loaded && load_export_table() != 0){
+		return -1;
+	}
+	if((export_table.count + 1) * 2 > export_table.slot_count && index_export_table(export_table.slot_count * 2) != 0){
+		return -1;
+	}
+	size_t name_length = strlen(name);
+	size_t value_length = strlen(value);
+	char *entry = malloc(name_length + value_length + 2);
+	if(entry == NULL){
+		return -1;
+	}
+	memcpy(entry, name, name_length);
+	entry[name_length] = '=';
+	memcpy(entry + name_length + 1, value, value_length + 1);
+	int slot = find_export_slot(name, name_length);
+	if(export_table.slots[slot] != -1){
+		free(export_table.entries[export_table.slots[slot]]);
+		export_table.entries[export_table.slots[slot]] = entry;
+		export_table.dirty = 1;
+		return 0;
+	}
+	if(add_export_entry(slot, entry) != 0){
+		free(entry);
+		return -1;
+	}
+	return 0;
+}
+
+//Used to add a new NAME=value string to the end of the table, in the given empty slot
+//Returns -1 if the table couldnt grow, the entry is then still the caller's
+int add_export_entry(int slot, char *entry){
+	if(export_table.count == export_table.capacity){
+		int capacity = export_table.capacity ? export_table.capacity * 2 : 64;
+		char **entries = realloc(export_table.entries, capacity * sizeof(char *));
+		if(entries == NULL){
+			return -1;
+		}
+		export_table.entries = entries;
+		export_table.capacity = capacity;
+	}
+	export_table.entries[export_table.count] = entry;
+	export_table.slots[slot] = export_table.count++;
+	export_table.dirty = 1;
+	return 0;
+}
+
+//This method will stop exporting a variable
+//The entries after it move down to keep their order, so the hash table is filled in again
+void unset_environment_variable(const char *name){
+	if(!export_table.loaded && load_export_table() != 0){
+		return;
+	}
+	int index = export_table.slots[find_export_slot(name, strlen(name))];
+	if(index == -1){
+		return;
+	}
+	free(export_table.entries[index]);
+	memmove(export_table.entries + index, export_table.entries + index + 1, (export_table.count - index - 1) * sizeof(char *));
+	--export_table.count;
+	index_export_table(export_table.slot_count);
+	export_table.dirty = 1;
+}
+
+//This method will make a hash table of slot_count slots and insert every entry into it
+//A table of the same size is filled in again where it is. Returns -1 and keeps the
+//old table if a new one couldnt be allocated
+int index_export_table(int slot_count){
+	if(slot_count != export_table.slot_count){
+		int *slots = malloc(slot_count * sizeof(int));
+		if(slots == NULL){
+			return -1;
+		}
+		free(export_table.slots);
+		export_table.slots = slots;
+		export_table.slot_count = slot_count;
+	}
+	for(int i = 0; i < slot_count; i++){
+		export_table.slots[i] = -1;
+	}
+	for(int i = 0; i < export_table.count; i++){
+		const char *entry = export_table.entries[i];
+		int slot = hash_bytes(entry, strchr(entry, '=') - entry) & (slot_count - 1);
+		while(export_table.slots[slot] != -1){
+			slot = (slot + 1) & (slot_count - 1);
+		}
+		export_table.slots[slot] = i;
+	}
+	return 0;
+}
+
+//This method will hand out the envp launched commands get
+//It is only built again when the table has changed since the last launch, and
+//envp[i] is always entries[i], which overlay_environment relies on
+//Will return NULL if there is no memory for it
+char **retrieve_environment(){
+	if(!export_table.loaded && load_export_table() != 0){
+		return NULL;
+	}
+	if(export_table.dirty || export_table.envp == NULL){
+		char **envp = realloc(export_table.envp, (export_table.count + 1) * sizeof(char *));
+		if(envp == NULL){
+			return NULL;
+		}
+		export_table.envp = envp;
+		memcpy(export_table.envp, export_table.entries, export_table.count * sizeof(char *));
+		export_table.envp[export_table.count] = NULL;
+		export_table.dirty = 0;
+	}
+	return export_table.envp;
+}
+
+//This method will make the envp of a command run with NAME=value words in front of it
+//Only the array of pointers is copied (into the command arena), the strings are shared
+//with the table. A name the table has is replaced in place through its slot, and a
+//new one goes on the end, so nothing is scanned. A later word for a name wins
+//Will return NULL if the shell's envp couldnt be built
+char **overlay_environment(char **assignments, int count){
+	char **base = retrieve_environment();
+	if(base == NULL){
+		return NULL;
+	}
+	int size = export_table.count;
+	char **envp = arena_alloc(&command_arena, (size + count + 1) * sizeof(char *));
+	memcpy(envp, base, size * sizeof(char *));
+	for(int a = 0; a < count; a++){
+		size_t length = strchr(assignments[a], '=') - assignments[a];
+		int index = export_table.slots[find_export_slot(assignments[a], length)];
+		//Names that are new to this command are only looked for among the others added here
+		for(int added = export_table.count; index == -1 && added < size; added++){
+			if(strncmp(envp[added], assignments[a], length + 1) == 0){
+				index = added;
+			}
+		}
+		if(index == -1){
+			index = size++;
+		}
+		envp[index] = assignments[a];
+	}
+	envp[size] = NULL;
+	return envp;
+}
+
+//Used to check if a word is a NAME=value assignment
+int is_assignment_word(const char *text, size_t length){
+	if(length == 0 || !(isalpha((unsigned char)text[0]) || text[0] == '_')){
+		return 0;
+	}
+	for(size_t i = 1; i < length; i++){
+		if(text[i] == '='){
+			return 1;
+		}
+		if(!isalnum((unsigned char)text[i]) && text[i] != '_'){
+			return 0;
+		}
+	}
+	return 0;
+}
+
+//This method will free the export table and its envp
+void free_export_table(){
+	for(int i = 0; i < export_table.count; i++){
+		free(export_table.entries[i]);
+	}
+	free(export_table.entries);
+	free(export_table.slots);
+	free(export_table.envp);
+	memset(&export_table, 0, sizeof(ExportTable));
+}
+
+
+// Methods for the Line Editor
+
+
+//This method will turn the line editor on if stdin and stdout are a terminal
+//Otherwise the shell keeps reading plain lines, like it does from a pipe
+void init_line_editor(){
+	if(!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO) || tcgetattr(STDIN_FILENO, &line_editor.saved) != 0){
+		return;
 	}
+	line_editor.enabled = 1;
+	reserve_editor_line(256);
 }
 
-//This method will handle retrieving the command path
-//so execv can call the new command
-char* retrieve_command_path(const char *command){
-	//Get the value of the path searching variable
-	char *path_env = getenv("PATH");
-	if(path_env == NULL){
-		return NULL;	
+//This method will free the line editor's buffers
+void free_line_editor(){
+	free(line_editor.line);
+	free(line_editor.pending);
+	line_editor.line = line_editor.pending = NULL;
+	line_editor.capacity = 0;
+	line_editor.enabled = 0;
+}
+
+//This method will read one line typed at the prompt
+//It goes through the line editor when it is on, and straight to the reader otherwise.
+//The line stays valid until the next call. Returns 0 once there are no more lines
+int read_interactive_line(BatchReader *reader, const char *prompt, const char **line, size_t *length){
+	if(line_editor.enabled){
+		return read_editor_line(prompt, line, length);
 	}
-	//Now, make a copy of the PATH variable and we will now
-	//split the PATH variable into its individual directories
-	char *path_copy = strdup(path_env);
-	char *dir = strtok(path_copy, ":");
-	static char full_path[COMMAND_MAXIMUM];
-	
-	//Finally, we need to search the directories for our command
-	while(dir != NULL){
-		snprintf(full_path, sizeof(full_path), "%s/%s", dir, command);
-		//If a matching path is found, we return it!
-		if(access(full_path, X_OK) == 0){
-			free(path_copy);
-			return full_path;	
+	out_printf("%s", prompt);
+	out_flush();
+	return next_batch_line(reader, line, length);
+}
+
+//This method will read a line from the terminal with editing
+//  Left, Right, Home, End, Ctrl-A/B/E/F     move the cursor
+//  Backspace, Delete, Ctrl-D/K/U/W          delete
+//  Up, Down, Ctrl-P/N                       step through the history
+//  Ctrl-R                                   search the history
+//  Tab                                      complete the word under the cursor
+//Ctrl-C drops the line and Ctrl-D on an empty line ends input
+int read_editor_line(const char *prompt, const char **line, size_t *length){
+	out_flush();
+	struct termios raw = line_editor.saved;
+	raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+	raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+	raw.c_cflag |= CS8;
+	raw.c_cc[VMIN] = 1;
+	raw.c_cc[VTIME] = 0;
+	if(tcsetattr(STDIN_FILENO, TCSADRAIN, &raw) != 0){
+		perror("wsh: terminal");
+		line_editor.enabled = 0;
+		return 0;
+	}
+	struct winsize size;
+	line_editor.columns = ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0 ? size.ws_col : 80;
+	line_editor.prompt = prompt;
+	line_editor.length = line_editor.cursor = 0;
+	line_editor.history_index = 0;
+	line_editor.last_key = 0;
+	refresh_editor_line();
+	int result = -1;
+	while(result == -1){
+		int key = read_editor_key();
+		if(key == EDITOR_CTRL('r')){
+			key = search_editor_history();
+		}
+		switch(key){
+			case -1:
+				result = 0;
+				break;
+			case '\r':
+			case '\n':
+				result = 1;
+				break;
+			case EDITOR_CTRL('c'):
+				write_all(STDOUT_FILENO, "^C\n", 3);
+				line_editor.length = line_editor.cursor = 0;
+				line_editor.history_index = 0;
+				break;
+			case EDITOR_CTRL('d'):
+				if(line_editor.length == 0){
+					result = 0;
+				}
+				else if(line_editor.cursor < line_editor.length){
+					delete_editor_text(line_editor.cursor, 1);
+				}
+				break;
+			case EDITOR_KEY_DELETE:
+				if(line_editor.cursor < line_editor.length){
+					delete_editor_text(line_editor.cursor, 1);
+				}
+				break;
+			case EDITOR_KEY_BACKSPACE:
+			case EDITOR_CTRL('h'):
+				if(line_editor.cursor > 0){
+					delete_editor_text(line_editor.cursor - 1, 1);
+				}
+				break;
+			case EDITOR_CTRL('u'):
+				delete_editor_text(0, line_editor.cursor);
+				break;
+			case EDITOR_CTRL('k'):
+				line_editor.length = line_editor.cursor;
+				break;
+			case EDITOR_CTRL('w'):{
+				size_t start = line_editor.cursor;
+				while(start > 0 && line_editor.line[start - 1] == ' '){
+					--start;
+				}
+				while(start > 0 && line_editor.line[start - 1] != ' '){
+					--start;
+				}
+				delete_editor_text(start, line_editor.cursor - start);
+				break;
+			}
+			case EDITOR_KEY_LEFT:
+			case EDITOR_CTRL('b'):
+				if(line_editor.cursor > 0){
+					--line_editor.cursor;
+				}
+				break;
+			case EDITOR_KEY_RIGHT:
+			case EDITOR_CTRL('f'):
+				if(line_editor.cursor < line_editor.length){
+					++line_editor.cursor;
+				}
+				break;
+			case EDITOR_KEY_HOME:
+			case EDITOR_CTRL('a'):
+				line_editor.cursor = 0;
+				break;
+			case EDITOR_KEY_END:
+			case EDITOR_CTRL('e'):
+				line_editor.cursor = line_editor.length;
+				break;
+			case EDITOR_KEY_UP:
+			case EDITOR_CTRL('p'):
+				step_editor_history(1);
+				break;
+			case EDITOR_KEY_DOWN:
+			case EDITOR_CTRL('n'):
+				step_editor_history(-1);
+				break;
+			case EDITOR_CTRL('l'):
+				write_all(STDOUT_FILENO, "\x1b[H\x1b[2J", 7);
+				break;
+			case '\t':
+				complete_editor_line();
+				break;
+			default:
+				//Everything else that isnt a control key is typed into the line
+				if(key >= ' ' && key < 256 && key != EDITOR_KEY_BACKSPACE){
+					char c = (char)key;
+					insert_editor_text(&c, 1);
+				}
+				break;
+		}
+		line_editor.last_key = key;
+		if(result == -1){
+			refresh_editor_line();
 		}
-		//If not found yet, we split the token and continue
-		dir = strtok(NULL, ":");
 	}
-	//The command couldnt be located, free the path and return
-	free(path_copy);
-	return NULL;	
+	//Move past the line so the command's output starts below it
+	line_editor.cursor = line_editor.length;
+	refresh_editor_line();
+	write_all(STDOUT_FILENO, "\n", 1);
+	tcsetattr(STDIN_FILENO, TCSADRAIN, &line_editor.saved);
+	*line = line_editor.line;
+	*length = line_editor.length;
+	return result;
 }
 
-//This method will handle redirection functionality.
-//Redirections will allow the file handles of commands be duplicated, opened, closed,
-//made to refer to different files, and change destination files for command reads and writes (Bash Reference Manual)
-//Redirection will occur in the event an input or output file exist
-void execute_redirection(char *input_file, char *output_file, char *error_file, int append) {
-    // Handle input redirection (stdin)
-    if (input_file != NULL) {
-        int fd = open(input_file, O_RDONLY);
-        if (fd == -1) {
-            perror("Error opening input file");
-            exit(1);
-        }
-        // Redirect stdin to input file
-        dup2(fd, STDIN_FILENO);
-        close(fd);
-    }
+//This method will read one key from the terminal
+//Escape sequences are turned into the EDITOR_KEY codes, an escape that nothing
+//follows within a few milliseconds is the escape key itself. Returns -1 at the end of input
+int read_editor_key(){
+	unsigned char c;
+	if(read_editor_byte(&c, -1) <= 0){
+		return -1;
+	}
+	if(c != EDITOR_KEY_ESCAPE){
+		return c;
+	}
+	unsigned char sequence[3];
+	if(read_editor_byte(&sequence[0], 50) <= 0 || read_editor_byte(&sequence[1], 50) <= 0){
+		return EDITOR_KEY_ESCAPE;
+	}
+	//Home, End and Delete can also come as ESC [ number ~
+	if(sequence[0] == '[' && isdigit(sequence[1])){
+		if(read_editor_byte(&sequence[2], 50) <= 0 || sequence[2] != '~'){
+			return EDITOR_KEY_ESCAPE;
+		}
+		switch(sequence[1]){
+			case '1': case '7': return EDITOR_KEY_HOME;
+			case '4': case '8': return EDITOR_KEY_END;
+			case '3': return EDITOR_KEY_DELETE;
+		}
+		return EDITOR_KEY_ESCAPE;
+	}
+	if(sequence[0] == '[' || sequence[0] == 'O'){
+		switch(sequence[1]){
+			case 'A': return EDITOR_KEY_UP;
+			case 'B': return EDITOR_KEY_DOWN;
+			case 'C': return EDITOR_KEY_RIGHT;
+			case 'D': return EDITOR_KEY_LEFT;
+			case 'H': return EDITOR_KEY_HOME;
+			case 'F': return EDITOR_KEY_END;
+		}
+	}
+	return EDITOR_KEY_ESCAPE;
+}
 
-    // Handle output redirection (stdout)
-    if (output_file != NULL) {
-        int fd;
-        // Open file for writing, either truncating or appending
-        if (!append) {
-            fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        } else {
-            fd = open(output_file, O_WRONLY | O_CREAT | O_APPEND, 0644);
-        }
-        if (fd == -1) {
-            perror("Error opening output file");
-            exit(1);
-        }
-        // Redirect stdout to output file
-        dup2(fd, STDOUT_FILENO);
-        close(fd);
-    }
+//Used to read a single byte from the terminal, waiting at most timeout milliseconds
+//(or for as long as it takes when timeout is -1). Returns 0 if nothing came in time
+int read_editor_byte(unsigned char *c, int timeout){
+	if(timeout >= 0){
+		struct pollfd ready = { STDIN_FILENO, POLLIN, 0 };
+		if(poll(&ready, 1, timeout) <= 0){
+			return 0;
+		}
+	}
+	ssize_t bytes;
+	while((bytes = read(STDIN_FILENO, c, 1)) < 0 && errno == EINTR){
+	}
+	return bytes;
+}
 
-    // Handle error redirection (stderr)
-    if (error_file == NULL && input_file != NULL) {
-        // Create output filename based on the input filename
-        char out_file[256];
-        strncpy(out_file, input_file, sizeof(out_file) - 1);
-        out_file[sizeof(out_file) - 1] = '\0'; // Null-terminate
-        
-        // Remove the extension if it exists
-        char *ext = strrchr(out_file, '.');
-        if (ext != NULL) {
-            *ext = '\0';  // Remove extension
-        }
-        strcat(out_file, "-out"); // Append -out to the filename
-        
-        // Open the -out file for writing
-        int fd = open(out_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (fd == -1) {
-            perror("Error opening error output file");
-            exit(1);
-        }
-        // Redirect stderr to the -out file
-        dup2(fd, STDERR_FILENO);
-        close(fd);
-    } else if (error_file != NULL) {
-        // If an error file is specified, handle it
-        int fd = open(error_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (fd == -1) {
-            perror("Error opening error output file");
-            exit(1);
-        }
-        // Redirect stderr to the user-specified error output file
-        dup2(fd, STDERR_FILENO);
-        close(fd);
-    }
+//This method will redraw the prompt and line, with the cursor in its place
+//A line wider than the terminal scrolls sideways to keep the cursor in view
+void refresh_editor_line(){
+	size_t prompt_length = strlen(line_editor.prompt);
+	size_t room = line_editor.columns > prompt_length + 1 ? line_editor.columns - prompt_length - 1 : 1;
+	size_t start = line_editor.cursor > room ? line_editor.cursor - room : 0;
+	size_t shown = line_editor.length - start < room ? line_editor.length - start : room;
+	char move[32];
+	int move_length = snprintf(move, sizeof(move), "\r\x1b[%zuC", prompt_length + line_editor.cursor - start);
+	if(prompt_length + line_editor.cursor - start == 0){
+		move_length = 1;
+	}
+	struct iovec parts[5] = {
+		{ "\r", 1 },
+		{ (char *)line_editor.prompt, prompt_length },
+		{ line_editor.line + start, shown },
+		{ "\x1b[K", 3 },
+		{ move, move_length }
+	};
+	writev_all(STDOUT_FILENO, parts, 5);
 }
 
+//Used to make room for a line of length bytes in the editor
+void reserve_editor_line(size_t length){
+	if(length <= line_editor.capacity){
+		return;
+	}
+	line_editor.capacity = length * 2;
+	line_editor.line = realloc(line_editor.line, line_editor.capacity);
+}
 
+//Used to type text into the line at the cursor
+void insert_editor_text(const char *text, size_t length){
+	reserve_editor_line(line_editor.length + length);
+	memmove(line_editor.line + line_editor.cursor + length, line_editor.line + line_editor.cursor, line_editor.length - line_editor.cursor);
+	memcpy(line_editor.line + line_editor.cursor, text, length);
+	line_editor.length += length;
+	line_editor.cursor += length;
+}
 
+//Used to remove length bytes of the line from start on, keeping the cursor on the same text
+void delete_editor_text(size_t start, size_t length){
+	memmove(line_editor.line + start, line_editor.line + start + length, line_editor.length - start - length);
+	line_editor.length -= length;
+	if(line_editor.cursor >= start + length){
+		line_editor.cursor -= length;
+	}
+	else if(line_editor.cursor > start){
+		line_editor.cursor = start;
+	}
+}
 
-// Methods for History Command
+//Used to replace the whole line, with the cursor at its end
+void set_editor_text(const char *text, size_t length){
+	reserve_editor_line(length);
+	memmove(line_editor.line, text, length);
+	line_editor.length = line_editor.cursor = length;
+}
 
+//This method will move step commands back (Up) or forward (Down) through the history
+//The line being typed is put aside on the way up and comes back at the bottom
+void step_editor_history(int step){
+	int index = line_editor.history_index + step;
+	if(index < 0 || (index > 0 && retrieve_from_history(index) == NULL)){
+		return;
+	}
+	if(line_editor.history_index == 0){
+		free(line_editor.pending);
+		line_editor.pending = strndup(line_editor.line, line_editor.length);
+		line_editor.pending_length = line_editor.length;
+	}
+	line_editor.history_index = index;
+	if(index == 0){
+		set_editor_text(line_editor.pending, line_editor.pending_length);
+		return;
+	}
+	const HistoryEntry *entry = retrieve_from_history(index);
+	set_editor_text(entry -> text, entry -> length);
+}
 
-//This Method will handle adding a new command to the history list
-//If the command is already there, it wont repeat it. If it isnt,
-//it will add it to the list and update its values accordingly
-void add_to_history(const char *command){
-	//Check if its already in the history list
-	if(history_list.command_count > 0 && strcmp(history_list.commands[0], command) == 0){
-		return;		
+//This method will search the history for what is typed, newest command first (Ctrl-R)
+//Ctrl-R again steps to older matches. Ctrl-G or Ctrl-C put the line back as it was,
+//any other key keeps the match in the line and is then handled as usual.
+//Returns the key that ended the search (0 if it was cancelled)
+int search_editor_history(){
+	char query[EDITOR_SEARCH_MAXIMUM];
+	size_t query_length = 0;
+	int match = 0;
+	int key;
+	while(1){
+		const HistoryEntry *entry = retrieve_from_history(match);
+		const char *label = query_length > 0 && entry == NULL ? "\r(failed reverse-i-search)`" : "\r(reverse-i-search)`";
+		struct iovec parts[5] = {
+			{ (char *)label, strlen(label) },
+			{ query, query_length },
+			{ "': ", 3 },
+			{ entry != NULL ? (char *)entry -> text : "", entry != NULL ? entry -> length : 0 },
+			{ "\x1b[K", 3 }
+		};
+		writev_all(STDOUT_FILENO, parts, 5);
+		key = read_editor_key();
+		if(key == EDITOR_CTRL('r')){
+			int older = find_history_match(query, query_length, match + 1);
+			match = older > 0 ? older : match;
+		}
+		else if(key == EDITOR_KEY_BACKSPACE || key == EDITOR_CTRL('h')){
+			if(query_length > 0){
+				--query_length;
+				match = query_length > 0 ? find_history_match(query, query_length, 1) : 0;
+			}
+		}
+		else if(key >= ' ' && key < 256){
+			if(query_length < sizeof(query)){
+				query[query_length++] = (char)key;
+				//The current match is checked first, it may still hold the longer query
+				match = find_history_match(query, query_length, match > 0 ? match : 1);
+			}
+		}
+		else{
+			break;
+		}
 	}
-	//If the command isnt in the history list, we continue
-	//If the history list is full, we need to evict the oldest one
-	//and replace it with the new command
-	if(history_list.maximum_size == history_list.command_count){
-		free(history_list.commands[history_list.maximum_size - 1]);
-		for(int j = history_list.maximum_size - 1; j > 0; j--){
-			history_list.commands[j] = history_list.commands[j - 1];
+	if(key == EDITOR_CTRL('g') || key == EDITOR_CTRL('c')){
+		return 0;
+	}
+	const HistoryEntry *entry = retrieve_from_history(match);
+	if(entry != NULL){
+		line_editor.history_index = 0;
+		set_editor_text(entry -> text, entry -> length);
+	}
+	return key;
+}
+
+//Used to find the newest command at or before history entry from that holds the query
+//Returns its history number, or 0 if no command holds it
+int find_history_match(const char *query, size_t length, int from){
+	for(int n = from; n <= history_list.command_count; n++){
+		const HistoryEntry *entry = retrieve_from_history(n);
+		if(memmem(entry -> text, entry -> length, query, length) != NULL){
+			return n;
 		}
-	} 
-	//if the history list isnt already full, we can add the new command
-	//without modifying the history list
+	}
+	return 0;
+}
+
+//This method will complete the word under the cursor (Tab)
+//The first word of a command completes to builtins and PATH executables, a word
+//starting with $ to variable names and any other word to file names. A single match
+//is filled in whole, several are filled in as far as they agree, and a second Tab
+//lists them
+void complete_editor_line(){
+	static const char *const keywords[] = { "if", "elif", "while", "then", "do", "else", "time", NULL };
+	const char *line = line_editor.line;
+	size_t end = line_editor.cursor;
+	size_t start = end;
+	while(start > 0 && strchr(" \t|&;<>(", line[start - 1]) == NULL){
+		--start;
+	}
+	//A word is in command position after a separator, or after a keyword that runs a command
+	size_t before = start;
+	while(before > 0 && line[before - 1] == ' '){
+		--before;
+	}
+	size_t previous = before;
+	while(previous > 0 && line[previous - 1] != ' '){
+		--previous;
+	}
+	int command = before == 0 || strchr("|&;(", line[before - 1]) != NULL;
+	for(int k = 0; !command && keywords[k] != NULL; k++){
+		command = before - previous == strlen(keywords[k]) && memcmp(line + previous, keywords[k], before - previous) == 0
+			&& (previous == 0 || strchr("|&;(", line[previous - 1]) != NULL);
+	}
+	const char *word = line + start;
+	size_t length = end - start;
+	CompletionMatches matches = { .count = 0, .capacity = 0, .shown = 0 };
+	if(length > 0 && word[0] == '$' && memchr(word, '/', length) == NULL){
+		matches.kind = COMPLETE_VARIABLE;
+		complete_variable_names(word + 1, length - 1, &matches);
+	}
+	else if(command && memchr(word, '/', length) == NULL){
+		matches.kind = COMPLETE_COMMAND;
+		complete_command_names(word, length, &matches);
+	}
 	else{
-		for(int k = history_list.command_count; k > 0; k--){
-			history_list.commands[k] = history_list.commands[k - 1];
+		matches.kind = COMPLETE_FILE;
+		complete_file_names(word, length, &matches);
+	}
+	if(matches.count == 0){
+		write_all(STDOUT_FILENO, "\a", 1);
+		arena_reset(&command_arena);
+		return;
+	}
+	//How far every match agrees
+	size_t common = strlen(matches.names[0]);
+	for(int i = 1; i < matches.count; i++){
+		size_t agree = 0;
+		while(agree < common && matches.names[i][agree] == matches.names[0][agree]){
+			++agree;
 		}
-		//because the list wasnt full, we update the number of commands in the list
-		++history_list.command_count;
+		common = agree;
 	}
-	//We now insert the new command into the now empty most recent spot
-	history_list.commands[0] = strdup(command);
+	if(matches.count == 1){
+		struct stat info;
+		int directory = matches.kind == COMPLETE_FILE && stat(matches.names[0], &info) == 0 && S_ISDIR(info.st_mode);
+		delete_editor_text(start, length);
+		insert_editor_text(matches.names[0], common);
+		insert_editor_text(directory ? "/" : " ", 1);
+	}
+	else if(common > length){
+		delete_editor_text(start, length);
+		insert_editor_text(matches.names[0], common);
+	}
+	else if(line_editor.last_key == '\t'){
+		list_completion_matches(&matches);
+	}
+	else{
+		write_all(STDOUT_FILENO, "\a", 1);
+	}
+	arena_reset(&command_arena);
+}
+
+//This method will list the matches below the line, as many to a row as fit
+//At most COMPLETION_LIST_MAXIMUM are listed, the line is drawn again under them
+void list_completion_matches(CompletionMatches *matches){
+	size_t widest = 0;
+	for(int i = 0; i < matches -> count; i++){
+		size_t width = strlen(matches -> names[i] + matches -> shown);
+		widest = width > widest ? width : widest;
+	}
+	widest += 2;
+	size_t per_row = line_editor.columns / widest > 0 ? line_editor.columns / widest : 1;
+	int listed = matches -> count < COMPLETION_LIST_MAXIMUM ? matches -> count : COMPLETION_LIST_MAXIMUM;
+	out_write("\n", 1);
+	for(int i = 0; i < listed; i++){
+		const char *name = matches -> names[i] + matches -> shown;
+		if((i + 1) % per_row == 0 || i == listed - 1){
+			out_printf("%s\n", name);
+		}
+		else{
+			out_printf("%-*s", (int)widest, name);
+		}
+	}
+	if(matches -> count > listed){
+		out_printf("... and %d more\n", matches -> count - listed);
+	}
+	out_flush();
 }
 
 
-//This method will be used when we want to execute a command from memory
-//It will access command and return the specified command
-const char* retrieve_from_history(int n){
-	if(n <= history_list.command_count && n > 0){
-		return history_list.commands[n - 1];
+// Methods for the Completion Index
+
+
+//This method will add the builtins and PATH executables starting with prefix to matches
+//The index is brought up to date first, which is one stat per PATH directory when
+//nothing has changed. They are found with a binary search and come out sorted
+void complete_command_names(const char *prefix, size_t length, CompletionMatches *matches){
+	refresh_completion_index();
+	char *key = arena_strndup(&command_arena, prefix, length);
+	size_t low = 0;
+	size_t high = completion_index.command_count;
+	while(low < high){
+		size_t middle = low + (high - low) / 2;
+		if(strcmp(completion_index.commands[middle], key) < 0){
+			low = middle + 1;
+		}
+		else{
+			high = middle;
+		}
+	}
+	for(size_t i = low; i < completion_index.command_count && strncmp(completion_index.commands[i], key, length) == 0; i++){
+		add_completion_match(matches, completion_index.commands[i]);
 	}
-        return NULL;	
 }
 
+//This method will add $NAME for the shell and enviroment variables starting with prefix to matches
+void complete_variable_names(const char *prefix, size_t length, CompletionMatches *matches){
+	for(int i = 0; i < variables.count; i++){
+		const char *name = variables.entries[i].name;
+		if(strncmp(name, prefix, length) == 0){
+			size_t name_length = strlen(name);
+			char *match = arena_alloc(&command_arena, name_length + 2);
+			match[0] = '$';
+			memcpy(match + 1, name, name_length + 1);
+			add_completion_match(matches, match);
+		}
+	}
+	if(!export_table.loaded){
+		load_export_table();
+	}
+	for(char **entry = export_table.entries; entry < export_table.entries + export_table.count; entry++){
+		const char *equals = strchr(*entry, '=');
+		if(equals != NULL && (size_t)(equals - *entry) >= length && strncmp(*entry, prefix, length) == 0){
+			char *match = arena_alloc(&command_arena, equals - *entry + 2);
+			match[0] = '$';
+			memcpy(match + 1, *entry, equals - *entry);
+			match[equals - *entry + 1] = '\0';
+			add_completion_match(matches, match);
+		}
+	}
+	//A name can be both a shell and an enviroment variable, it is only listed once
+	qsort(matches -> names, matches -> count, sizeof(char *), compare_completion_names);
+	int kept = 0;
+	for(int i = 0; i < matches -> count; i++){
+		if(kept == 0 || strcmp(matches -> names[kept - 1], matches -> names[i]) != 0){
+			matches -> names[kept++] = matches -> names[i];
+		}
+	}
+	matches -> count = kept;
+}
 
-// Helper Methods for General Use By Program
+//This method will add the paths that word can be completed to in its directory to matches
+//The directory is read through the snapshot cache, so it is shared with ls and globs.
+//Hidden names only match when the word's last part starts with a .
+void complete_file_names(const char *word, size_t length, CompletionMatches *matches){
+	const char *slash = memrchr(word, '/', length);
+	size_t directory_length = slash != NULL ? (size_t)(slash - word) + 1 : 0;
+	const char *base = word + directory_length;
+	size_t base_length = length - directory_length;
+	char *directory = arena_strndup(&command_arena, word, directory_length);
+	DirectorySnapshot *snapshot = retrieve_directory_snapshot(directory_length > 0 ? directory : ".");
+	if(snapshot == NULL){
+		return;
+	}
+	matches -> shown = directory_length;
+	for(size_t k = 0; k < snapshot -> listing.count; k++){
+		const char *name = snapshot -> listing.names + snapshot -> listing.offsets[k];
+		if((name[0] == '.' && (base_length == 0 || base[0] != '.')) || strncmp(name, base, base_length) != 0){
+			continue;
+		}
+		add_completion_match(matches, join_glob_path(&command_arena, directory, directory_length, name, 0));
+	}
+}
 
+//Used to add one match to the end of matches, growing it in the command arena
+void add_completion_match(CompletionMatches *matches, const char *name){
+	if(matches -> count == matches -> capacity){
+		int capacity = matches -> capacity ? matches -> capacity * 2 : 16;
+		matches -> names = arena_grow(&command_arena, matches -> names, matches -> capacity * sizeof(char *), capacity * sizeof(char *));
+		matches -> capacity = capacity;
+	}
+	matches -> names[matches -> count++] = name;
+}
 
-//Used when conducting LS as it does a quick sort of directory content
-//to do comparison between items
-int basic_comparison(const void *a, const void *b){
-	return strcmp(*(const char **)a, *(const char **)b);
+//Used to sort names for completion
+int compare_completion_names(const void *a, const void *b){
+	return strcmp(*(const char *const *)a, *(const char *const *)b);
 }
 
-//Used in substitute variable method.
-//It checks though the existing shell variables and determines if
-//the passed in variable already exists
-char *retrieve_shell_variable(const char *name){
-	//Retrieve a copy of the variable list
-	ShellVariables *vars = variables;
-	while(vars != NULL){
-		//If a match is found, return it
-		if(strcmp(vars -> name, name) == 0){
-			return vars -> value;
+//This method will bring the Completion Index up to date with PATH
+//Each PATH directory keeps its own sorted list of executables. It is read again only
+//when the directory is replaced or its modification time moves, with the same one
+//second rule as the directory snapshots, and the merged list is only rebuilt then
+void refresh_completion_index(){
+	const char *path = lookup_environment("PATH", 4);
+	if(path == NULL){
+		path = "";
+	}
+	if(completion_index.path == NULL || strcmp(completion_index.path, path) != 0){
+		load_completion_directories(path);
+	}
+	for(int i = 0; i < completion_index.directory_count; i++){
+		if(refresh_completion_directory(&completion_index.directories[i])){
+			completion_index.stale = 1;
 		}
-		vars = vars -> next;
 	}
-	//Will return NULL if the variable isnt found
-	return NULL;	
+	if(completion_index.stale){
+		merge_completion_index();
+	}
 }
 
-//This method will handle the substitution of variables after
-//process command is finished reading in the command and before
-//it prepares to execute it
-void substitute_command_variables(char *command){
-	char command_buffer[COMMAND_MAXIMUM];
-	char *buff = command_buffer;
-	char *com = command;
-	//While there are still commands in the buffer...
-	while(*com){
-		//$ denotes the start of a variable
-		if(*com == '$'){
-			//read in the variable
-			char var_name[COMMAND_MAXIMUM];
-			char *v = var_name;
-			++com;
-			//Continue to increment unless *com is a space or end line
-			while(*com && *com != ' ' && *com != '\0'){
-				*v++ = *com++;
-			}
-			*v = '\0';
-			//Check the shell for existing command
-			char *value = getenv(var_name);
-			if(value == NULL){
-				value = retrieve_shell_variable(var_name);
-			}
-			if(value){
-				while(*value) {
-					*buff++ = *value++;
-				}
+//This method will set up the index's directories for a new PATH
+//Directories that were already on the old PATH keep what was read from them
+void load_completion_directories(const char *path){
+	int capacity = 1;
+	for(const char *c = path; *c != '\0'; c++){
+		capacity += *c == ':';
+	}
+	CompletionDirectory *directories = calloc(capacity, sizeof(CompletionDirectory));
+	int count = 0;
+	char *path_copy = strdup(path);
+	//Empty entries are skipped, like when commands are looked up
+	for(char *dir = strtok(path_copy, ":"); dir != NULL; dir = strtok(NULL, ":")){
+		CompletionDirectory *directory = &directories[count++];
+		for(int i = 0; i < completion_index.directory_count; i++){
+			CompletionDirectory *old = &completion_index.directories[i];
+			if(old -> path != NULL && strcmp(old -> path, dir) == 0){
+				*directory = *old;
+				memset(old, 0, sizeof(CompletionDirectory));
+				break;
 			}
-		} 
+		}
+		if(directory -> path == NULL){
+			directory -> path = strdup(dir);
+		}
+	}
+	free(path_copy);
+	for(int i = 0; i < completion_index.directory_count; i++){
+		free(completion_index.directories[i].path);
+		free_directory_listing(&completion_index.directories[i].names);
+	}
+	free(completion_index.directories);
+	free(completion_index.path);
+	completion_index.directories = directories;
+	completion_index.directory_count = count;
+	completion_index.path = strdup(path);
+	completion_index.stale = 1;
+}
+
+//This method will read a PATH directory again if it has changed since it was read
+//Returns 1 if its list of executables was replaced
+int refresh_completion_directory(CompletionDirectory *directory){
+	struct stat info;
+	if(stat(directory -> path, &info) != 0 || !S_ISDIR(info.st_mode)){
+		if(!directory -> valid){
+			return 0;
+		}
+		free_directory_listing(&directory -> names);
+		directory -> valid = 0;
+		return 1;
+	}
+	if(directory -> valid && directory -> trusted && directory -> device == info.st_dev && directory -> inode == info.st_ino
+		&& directory -> modified.tv_sec == info.st_mtim.tv_sec && directory -> modified.tv_nsec == info.st_mtim.tv_nsec){
+		return 0;
+	}
+	struct timespec started;
+	clock_gettime(CLOCK_REALTIME, &started);
+	DirectoryListing listing;
+	if(read_executable_listing(directory -> path, &listing, &directory -> names) != 0){
+		memset(&listing, 0, sizeof(DirectoryListing));
+	}
+	free_directory_listing(&directory -> names);
+	directory -> names = listing;
+	directory -> device = info.st_dev;
+	directory -> inode = info.st_ino;
+	directory -> modified = info.st_mtim;
+	directory -> trusted = info.st_mtim.tv_sec < started.tv_sec - 1;
+	directory -> valid = 1;
+	return 1;
+}
+
+//This method will read the names of the executable files in a directory, sorted
+//Names that were already executable in the previous listing are kept without a stat,
+//so reading a directory again after one file was added only looks at that file.
+//Hidden names are left out
+int read_executable_listing(const char *path, DirectoryListing *listing, DirectoryListing *previous){
+	if(read_directory_listing(path, listing) != 0){
+		return -1;
+	}
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(fd == -1){
+		free_directory_listing(listing);
+		return -1;
+	}
+	//The offsets of the names that arent executables are dropped, the names stay in the buffer
+	size_t kept = 0;
+	for(size_t k = 0; k < listing -> count; k++){
+		const char *name = listing -> names + listing -> offsets[k];
+		struct stat info;
+		if(name[0] == '.'){
+			continue;
+		}
+		if(listing_has_name(previous, name)
+			|| (fstatat(fd, name, &info, 0) == 0 && S_ISREG(info.st_mode) && (info.st_mode & 0111) != 0)){
+			listing -> offsets[kept++] = listing -> offsets[k];
+		}
+	}
+	close(fd);
+	listing -> count = kept;
+	qsort_r(listing -> offsets, listing -> count, sizeof(size_t), basic_comparison, listing -> names);
+	return 0;
+}
+
+//Used to find a name in a sorted listing with a binary search
+int listing_has_name(DirectoryListing *listing, const char *name){
+	size_t low = 0;
+	size_t high = listing -> count;
+	while(low < high){
+		size_t middle = low + (high - low) / 2;
+		int order = strcmp(listing -> names + listing -> offsets[middle], name);
+		if(order == 0){
+			return 1;
+		}
+		if(order < 0){
+			low = middle + 1;
+		}
 		else{
-			*buff++ = *com++;
+			high = middle;
 		}
 	}
-	//Once finsihed, add on an end line to finish the command
-	*buff = '\0';
-	strcpy(command, command_buffer);	
+	return 0;
+}
+
+//This method will merge the builtins and every directory's executables into one
+//sorted list. A name found in more than one place is only kept once
+void merge_completion_index(){
+	size_t count = BUILTIN_COUNT;
+	for(int i = 0; i < completion_index.directory_count; i++){
+		count += completion_index.directories[i].names.count;
+	}
+	if(count > completion_index.command_capacity){
+		completion_index.command_capacity = count;
+		completion_index.commands = realloc(completion_index.commands, count * sizeof(char *));
+	}
+	const char **commands = completion_index.commands;
+	size_t used = 0;
+	for(int b = 0; b < BUILTIN_COUNT; b++){
+		commands[used++] = builtin_registry[b].name;
+	}
+	for(int i = 0; i < completion_index.directory_count; i++){
+		DirectoryListing *names = &completion_index.directories[i].names;
+		for(size_t k = 0; k < names -> count; k++){
+			commands[used++] = names -> names + names -> offsets[k];
+		}
+	}
+	qsort(commands, used, sizeof(char *), compare_completion_names);
+	size_t kept = 0;
+	for(size_t i = 0; i < used; i++){
+		if(kept == 0 || strcmp(commands[kept - 1], commands[i]) != 0){
+			commands[kept++] = commands[i];
+		}
+	}
+	completion_index.command_count = kept;
+	completion_index.stale = 0;
+}
+
+//This method will free the Completion Index
+void free_completion_index(){
+	for(int i = 0; i < completion_index.directory_count; i++){
+		free(completion_index.directories[i].path);
+		free_directory_listing(&completion_index.directories[i].names);
+	}
+	free(completion_index.directories);
+	free(completion_index.path);
+	free(completion_index.commands);
+	memset(&completion_index, 0, sizeof(CompletionIndex));
+}
+
+
+// Methods for the Command Arena
+
+
+//This method will hand out size bytes from the arena
+//Memory is carved out of large blocks, so a command line costs no per-token malloc
+void *arena_alloc(Arena *arena, size_t size){
+	//Keep every allocation aligned for any type
+	size = (size + 15) & ~(size_t)15;
+	ArenaBlock *block = arena -> current;
+	if(block == NULL || block -> used + size > block -> size){
+		//Move on to the next block, or add a new one big enough for the request
+		if(block != NULL && block -> next != NULL && block -> next -> size >= size){
+			block = block -> next;
+			block -> used = 0;
+		}
+		else{
+			size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+			ArenaBlock *new_block = malloc(sizeof(ArenaBlock) + block_size);
+			//Nothing that takes from the arena can run without it, so the shell stops
+			if(new_block == NULL){
+				perror("wsh");
+				exit(1);
+			}
+			new_block -> size = block_size;
+			new_block -> used = 0;
+			new_block -> next = block != NULL ? block -> next : NULL;
+			if(block != NULL){
+				block -> next = new_block;
+			}
+			else{
+				arena -> first = new_block;
+			}
+			block = new_block;
+		}
+		arena -> current = block;
+	}
+	void *memory = block -> data + block -> used;
+	block -> used += size;
+	return memory;
+}
+
+//This method will grow an allocation from old_size to new_size bytes
+//If it was the last thing handed out it simply grows in place, otherwise
+//it is copied into a new allocation
+void *arena_grow(Arena *arena, void *memory, size_t old_size, size_t new_size){
+	ArenaBlock *block = arena -> current;
+	size_t aligned_old = (old_size + 15) & ~(size_t)15;
+	size_t aligned_new = (new_size + 15) & ~(size_t)15;
+	if(memory != NULL && block != NULL && (char *)memory + aligned_old == block -> data + block -> used
+		&& block -> used - aligned_old + aligned_new <= block -> size){
+		block -> used = block -> used - aligned_old + aligned_new;
+		return memory;
+	}
+	void *grown = arena_alloc(arena, new_size);
+	if(memory != NULL){
+		memcpy(grown, memory, old_size);
+	}
+	return grown;
+}
+
+//This method will copy length bytes of text into the arena as a string
+char *arena_strndup(Arena *arena, const char *text, size_t length){
+	char *copy = arena_alloc(arena, length + 1);
+	memcpy(copy, text, length);
+	copy[length] = '\0';
+	return copy;
+}
+
+//This method will give every block of the arena back to the system
+void arena_free(Arena *arena){
+	ArenaBlock *block = arena -> first;
+	while(block != NULL){
+		ArenaBlock *next = block -> next;
+		free(block);
+		block = next;
+	}
+	arena -> first = NULL;
+	arena -> current = NULL;
+}
+
+//This method will release everything handed out by the arena at once
+//The blocks are kept and reused by the next command line
+void arena_reset(Arena *arena){
+	arena -> current = arena -> first;
+	if(arena -> current != NULL){
+		arena -> current -> used = 0;
+	}
 }
 
 
 //The main method in this program will determine if the shell is in batch or
 //interactive mode. Then, it will process the commands as necassary
 int main(int argc, char *argv[]){
-	char *path = getenv("PATH");
-	char command[COMMAND_MAXIMUM];
-	if(strlen(path) == 0){
-		setenv("PATH", "/bin", 1);	
+	//Commands are always looked up in /bin to start with, whatever PATH the shell was given
+	if(set_environment_variable("PATH", "/bin") != 0){
+		perror("wsh");
+		return 1;
 	}
-	if(path == NULL){
-		setenv("PATH", "/bin", 1);	
-    		printf("PATH=/bin");
+	//Background jobs are collected by the SIGCHLD handler
+	setup_job_control();
+	//WSH_PROFILE turns on per-command accounting, printed when the shell exits
+	char *profile = getenv("WSH_PROFILE");
+	profile_enabled = profile != NULL && *profile != '\0' && strcmp(profile, "0") != 0;
+	//Pick the launch backend for external commands, WSH_LAUNCH=fork or
+	//WSH_LAUNCH=spawn overrides the one chosen at build time
+	char *launch = getenv("WSH_LAUNCH");
+	if(launch != NULL && strcmp(launch, "fork") == 0){
+		launch_mode = LAUNCH_FORK;
+	}
+	else if(launch != NULL && strcmp(launch, "spawn") == 0){
+		launch_mode = LAUNCH_SPAWN;
+	}
+	else if(launch != NULL && strcmp(launch, "zygote") == 0){
+		launch_mode = LAUNCH_ZYGOTE;
+	}
+	//History is kept in WSH_HISTFILE if it is set, and interactive shells
+	//default to ~/.wsh_history. An empty WSH_HISTFILE turns the file off
+	char *history_file = getenv("WSH_HISTFILE");
+	char *home = getenv("HOME");
+	char default_history_file[4096];
+	if(history_file == NULL && argc == 1 && home != NULL){
+		snprintf(default_history_file, sizeof(default_history_file), "%s/.wsh_history", home);
+		history_file = default_history_file;
+	}
+	if(history_file != NULL && *history_file != '\0'){
+		load_history_file(history_file);
+	}
+	BatchReader reader;
+	const char *command;
+	size_t length;
+	CompileState state;
+	//With --serve, the shell answers requests on a Unix socket until it is stopped
+	if(argc == 3 && strcmp(argv[1], "--serve") == 0){
+		append_cache.enabled = 1;
+		int result = execute_serve(argv[2]);
+		clear_append_cache();
+		return result;
+	}
+	//With --dump-ast, the batch file is compiled and printed instead of run
+	if(argc == 3 && strcmp(argv[1], "--dump-ast") == 0){
+		if(open_batch_reader(&reader, argv[2]) != 0) {
+			perror("Error opening batch file");
+			return -1;
+		}
+		init_compile_state(&state, &reader, 0);
+		ScriptNode *script = compile_script(&state);
+		close_batch_reader(&reader);
+		if(state.error){
+			return -1;
+		}
+		out_printf("(script\n");
+		dump_script(script, 1);
+		out_printf(")\n");
+		out_flush();
+		arena_free(&script_arena);
+		return 0;
+	}
+	//If -j N is given before the batch file, this is PARALLEL BATCH mode
+	if(argc == 4 && strcmp(argv[1], "-j") == 0 && atoi(argv[2]) > 0){
+		if(open_batch_reader(&reader, argv[3]) != 0) {
+			perror("Error opening batch file");
+			return -1;
+		}
+		append_cache.enabled = 1;
+		//WSH_TIMEOUT limits how many seconds each line may run for
+		char *timeout = getenv("WSH_TIMEOUT");
+		execute_parallel_batch(&reader, atoi(argv[2]), timeout != NULL ? atof(timeout) : 0);
+		clear_append_cache();
+		close_batch_reader(&reader);
 	}
-  	setenv("PATH", "/bin", 1);
 	//If two arguments exist, this is BATCH mode
-	if(argc == 2){
+	else if(argc == 2){
 		//Open and read batch file
-		FILE *file = fopen(argv[1], "r");
-		if(file == NULL) {
+		if(open_batch_reader(&reader, argv[1]) != 0) {
 			perror("Error opening batch file");
 			return -1;
 		}
-		while (fgets(command, sizeof(command), file) != NULL){
-			process_command(command);
+		//The whole script is compiled once before any of it runs, so loops
+		//never parse their bodies again
+		init_compile_state(&state, &reader, 0);
+		ScriptNode *script = compile_script(&state);
+		close_batch_reader(&reader);
+		if(state.error){
+			return -1;
 		}
-		fclose(file);
+		//Scripts tend to append to the same logs over and over
+		append_cache.enabled = 1;
+		execute_script(script);
+		clear_append_cache();
+		arena_free(&script_arena);
 	} 
 	//If only 1 argument exists, this is INTERACTIVE mode
 	else if(argc == 1){
+		start_batch_reader(&reader, STDIN_FILENO);
+		//At a terminal, lines are typed through the line editor
+		init_line_editor();
+		enable_job_control();
 		while(1){
 			//print out curser to shell display
-			printf("wsh> ");
-			fflush(stdout);
-			if(fgets(command, sizeof(command), stdin) == NULL){
+			notify_finished_jobs(1);
+			if(!read_interactive_line(&reader, "wsh> ", &command, &length)){
 				break;	
 			}
-			process_command(command);
+			//An if, for or while typed at the prompt is read up to the end of its block
+			if(is_script_block(command, length)){
+				init_compile_state(&state, &reader, 1);
+				ScriptNode *block = compile_statement(&state, command, length);
+				if(!state.error){
+					execute_script(block);
+				}
+				arena_reset(&script_arena);
+				continue;
+			}
+			process_command(command, length);
+			arena_reset(&command_arena);
 		}
+		free_line_editor();
+		free_completion_index();
+		close_batch_reader(&reader);
 	} 
 	//If input isnt valid, specify usage and return -1
 	else{
-		fprintf(stderr, "Usage: %s [batch-file]\n", argv[0]);
+		fprintf(stderr, "Usage: %s [[-j N] batch-file | --dump-ast batch-file | --serve socket]\n", argv[0]);
 		return -1;
 	}
+	free_zygote_pool();
+	out_flush();
+	print_profile();
 	//If all is good, we return 0
 	return exit_value;
 }
@@ -1,74 +1,1090 @@
 #ifndef WSH_H
 #define WSH_H
 
+#define _GNU_SOURCE
+#include <ctype.h>
 #include <dirent.h>
 #include <errno.h>	
 #include <fcntl.h>	
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>	
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <termios.h>
+#include <time.h>
 #include <unistd.h>	
 //Global Defaults
-#define ARGS_MAXIMUM 10
-#define COMMAND_MAXIMUM 512
+#define ARENA_BLOCK_SIZE (64 * 1024)
 #define HISTORY_MAXIMUM 5
+#define PATH_CACHE_BUCKETS 64
+#define PIPE_BUFFER_SIZE (1024 * 1024)
+#define JOBS_MAXIMUM 64
+#define LS_BATCH_SIZE (256 * 1024)
+#define BATCH_READ_SIZE (64 * 1024)
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+#define BUILTIN_SLOTS 64
+#define APPEND_CACHE_SIZE 8
+#define SNAPSHOT_CACHE_SIZE 8
+#define SERVE_CLIENTS_MAXIMUM 256
+#define SERVE_REQUEST_MAXIMUM (1 << 20)
+#define CAPTURE_BUFFER_MAXIMUM (64 * 1024)
+#define SUPERVISOR_EVENTS 64
+#define PROFILE_BUCKETS 32
+#define SUBSTITUTION_DEPTH_MAXIMUM 16
+#define EDITOR_SEARCH_MAXIMUM 256
+#define ZYGOTE_POOL_SIZE 4
+#define ZYGOTE_MESSAGE_MAXIMUM (64 * 1024)
+#define COMPLETION_LIST_MAXIMUM 100
+//The characters expanded words are split on
+#define WORD_SEPARATORS " \t\n"
+
+//Job States for background jobs
+#define JOB_RUNNING 0
+#define JOB_STOPPED 1
+#define JOB_DONE 2
+
+//Event Kinds the Supervisor waits on, kept in the low bits of each epoll entry
+//next to the slot of the child they belong to
+#define SUPERVISE_EXIT 0
+#define SUPERVISE_STDOUT 1
+#define SUPERVISE_STDERR 2
+#define SUPERVISE_TIMER 3
+
+//Token Types of a compiled glob pattern
+#define GLOB_CHAR 0
+#define GLOB_ANY 1
+#define GLOB_STAR 2
+#define GLOB_CLASS 3
+
+//Keys of the Line Editor
+//Control keys are their byte, and keys sent as escape sequences are given
+//codes past the range of a single byte
+#define EDITOR_CTRL(c) ((c) & 0x1f)
+#define EDITOR_KEY_ESCAPE 27
+#define EDITOR_KEY_BACKSPACE 127
+#define EDITOR_KEY_UP 256
+#define EDITOR_KEY_DOWN 257
+#define EDITOR_KEY_RIGHT 258
+#define EDITOR_KEY_LEFT 259
+#define EDITOR_KEY_HOME 260
+#define EDITOR_KEY_END 261
+#define EDITOR_KEY_DELETE 262
+
+//Kinds of word the Line Editor completes
+#define COMPLETE_COMMAND 0
+#define COMPLETE_VARIABLE 1
+#define COMPLETE_FILE 2
+
+//Launch Backends for external commands
+//posix_spawn is the default, build with -DWSH_LAUNCH_FORK or run with
+//WSH_LAUNCH=fork to use the classic fork()+execv path instead. Build with
+//-DWSH_LAUNCH_ZYGOTE or run with WSH_LAUNCH=zygote to hand commands to
+//pre-forked helpers from the zygote pool
+#define LAUNCH_SPAWN 0
+#define LAUNCH_FORK 1
+#define LAUNCH_ZYGOTE 2
+#ifdef WSH_LAUNCH_FORK
+#define LAUNCH_DEFAULT LAUNCH_FORK
+#elif defined(WSH_LAUNCH_ZYGOTE)
+#define LAUNCH_DEFAULT LAUNCH_ZYGOTE
+#else
+#define LAUNCH_DEFAULT LAUNCH_SPAWN
+#endif
+
+extern char **environ;
+
+//This struct comprises a single entry of the History List
+//Entries loaded from the history file point straight into its mapping (owned = 0),
+//entries added while the shell runs are their own copies (owned = 1)
+typedef struct HistoryEntry {
+	const char *text;
+	size_t length;
+	int owned;
+} HistoryEntry;
 
 //This struct comprises the History List
-//It will hold a list of previously used commands
+//It will hold a list of previously used commands in a ring buffer of
+//maximum_size entries. commands[newest] is the most recent command, and the
+//older ones follow it around the ring, so adding and evicting are O(1)
 typedef struct History {
-	char *commands[HISTORY_MAXIMUM];
+	HistoryEntry *commands;
+	int newest;
 	int command_count;		
 	int maximum_size;	
+	int file_fd;
+	char *mapped;
+	size_t mapped_size;
 } History;
 
 extern History history_list;	
 
-//This struct comprises the Shell Variable List
-//If will hold shell variables when created by the local command
-typedef struct ShellVariables {
+//This struct comprises a single Shell Variable
+typedef struct ShellVariable {
 	char *name;
 	char *value;
-	struct ShellVariables *next;
+	unsigned int hash;
+} ShellVariable;
+
+//This struct comprises the Shell Variable Store
+//If will hold shell variables when created by the local command. The entries
+//array keeps them in insertion order, and slots is an open addressing hash table
+//(linear probing) of indexes into entries, so lookups and updates are O(1)
+typedef struct ShellVariables {
+	ShellVariable *entries;
+	int count;
+	int capacity;
+	int *slots;
+	int slot_count;
 } ShellVariables;
 
-extern ShellVariables *variables;
+extern ShellVariables variables;
+
+//This struct comprises the Export Table
+//The shell owns the enviroment its children get. It is loaded from environ the
+//first time it is needed, and after that export and unset only change the table.
+//Each variable is one NAME=value string in entries, in the order it was exported,
+//and slots is an open addressing hash table (linear probing) of indexes into entries.
+//envp is the NULL terminated array every launched command gets. It is built once
+//and reused by every launch until export or unset marks it dirty
+typedef struct ExportTable {
+	char **entries;
+	int count;
+	int capacity;
+	int *slots;
+	int slot_count;
+	char **envp;
+	int dirty;
+	int loaded;
+} ExportTable;
+
+extern ExportTable export_table;
+
+//This struct comprises the output of variable expansion
+//It is built in the command arena and grows as values are added
+typedef struct ExpansionBuffer {
+	char *data;
+	size_t used;
+	size_t capacity;
+} ExpansionBuffer;
+
+//This struct comprises the capture files of Command Substitution
+//Every level of nesting has a memory file of its own, made the first time it is
+//needed and emptied after each use (0 means it hasnt been made yet)
+typedef struct SubstitutionState {
+	int files[SUBSTITUTION_DEPTH_MAXIMUM];
+	int depth;
+} SubstitutionState;
+
+extern SubstitutionState substitution;
+
+//This struct comprises the Command Path Cache
+//Like the bash hash table, it remembers where commands were found on PATH
+//so we dont have to walk every PATH directory for each external command
+typedef struct PathCacheEntry {
+	char *name;
+	char *path;
+	int hits;
+	struct PathCacheEntry *next;
+} PathCacheEntry;
+
+typedef struct PathCache {
+	PathCacheEntry *buckets[PATH_CACHE_BUCKETS];
+	long hits;
+	long misses;
+} PathCache;
+
+extern PathCache path_cache;
+
+//This struct comprises an entry of the Append Cache
+//It holds an open O_APPEND fd for a path, along with the file it was opened on
+//and how many of the redirections being set up are still using it
+typedef struct AppendCacheEntry {
+	char *path;
+	dev_t device;
+	ino_t inode;
+	int fd;
+	int users;
+	unsigned long last_used;
+} AppendCacheEntry;
+
+//This struct comprises the Append Cache
+//Batch runs keep the files of their >> redirections open here (close-on-exec), so a
+//script appending to the same log over and over doesnt open it for every line
+typedef struct AppendCache {
+	AppendCacheEntry entries[APPEND_CACHE_SIZE];
+	unsigned long clock;
+	int enabled;
+} AppendCache;
+
+extern AppendCache append_cache;
+
+//This struct comprises the Redirections of a single command
+//It holds the files named by <, >, >> and 2> until the command is launched
+typedef struct Redirection {
+	char *input_file;
+	char *output_file;
+	char *error_file;
+	int append;
+} Redirection;
+
+//This struct comprises a Directory Listing
+//The visible names of a directory are packed into one names buffer,
+//and offsets holds where each name starts
+typedef struct DirectoryListing {
+	char *names;
+	size_t names_size;
+	size_t names_capacity;
+	size_t *offsets;
+	size_t count;
+	size_t capacity;
+} DirectoryListing;
+
+//This struct comprises a Directory Snapshot
+//It holds the names in a directory (hidden ones too, but not . and ..) sorted once,
+//along with the device, inode and modification time the directory had when it was
+//read. trusted is set when the directory hadnt changed for a while before the read,
+//only then can an unchanged modification time vouch for the names
+typedef struct DirectorySnapshot {
+	DirectoryListing listing;
+	dev_t device;
+	ino_t inode;
+	struct timespec modified;
+	int trusted;
+	int valid;
+	unsigned long last_used;
+} DirectorySnapshot;
+
+//This struct comprises the Directory Snapshot Cache
+//ls and glob expansion read directories through it, so a script that globs the same
+//large directory over and over reads it once
+typedef struct SnapshotCache {
+	DirectorySnapshot entries[SNAPSHOT_CACHE_SIZE];
+	unsigned long clock;
+} SnapshotCache;
+
+extern SnapshotCache snapshot_cache;
+
+//This struct comprises one token of a compiled glob pattern
+//A GLOB_CHAR token matches c, a GLOB_CLASS token any byte set in its 256 bit set
+typedef struct GlobToken {
+	int type;
+	unsigned char c;
+	const unsigned char *set;
+} GlobToken;
+
+//This struct comprises one path component of a compiled glob pattern
+//A literal component has no pattern characters and is only text
+typedef struct GlobComponent {
+	char *text;
+	GlobToken *tokens;
+	int token_count;
+	int literal;
+} GlobComponent;
+
+//This struct comprises a compiled glob pattern
+//The pattern is split on / into components that are matched one directory at a time
+typedef struct GlobPattern {
+	GlobComponent *components;
+	int component_count;
+	int absolute;
+} GlobPattern;
+
+//This struct comprises the Output Buffer
+//Everything the shell prints to stdout is gathered here and written out with
+//as few write/writev calls as possible, instead of one per line
+typedef struct OutputBuffer {
+	char data[OUTPUT_BUFFER_SIZE];
+	size_t used;
+} OutputBuffer;
+
+extern OutputBuffer output_buffer;
+
+//This struct comprises the Command Arena
+//Everything built while running one command line (the substituted text, tokens,
+//argument arrays) is bump allocated from its blocks and released all at once
+typedef struct ArenaBlock {
+	struct ArenaBlock *next;
+	size_t size;
+	size_t used;
+	char data[];
+} ArenaBlock;
+
+typedef struct Arena {
+	ArenaBlock *first;
+	ArenaBlock *current;
+} Arena;
+
+extern Arena command_arena;
+
+//This struct comprises a single Command of a pipeline
+//It holds the tokenized arguments and the redirections given for the command
+//dispatch says if a command or builtin prefix picked its implementation, and
+//environment is the envp it is launched with when NAME=value words came before
+//it (NULL means the shell's own)
+typedef struct Command {
+	char **args;
+	int arg_count;
+	int dispatch;
+	char **environment;
+	Redirection redirection;
+} Command;
+
+//These are the ways a Command can be dispatched
+#define DISPATCH_ANY 0
+#define DISPATCH_EXTERNAL 1
+#define DISPATCH_BUILTIN 2
+
+//This struct comprises the state of the test command's expression parser
+typedef struct TestParser {
+	char **operands;
+	int count;
+	int position;
+	int error;
+} TestParser;
+
+//This struct comprises a background Job in the Job Table
+//It holds the processes of a pipeline started with a trailing &. The SIGCHLD
+//handler updates pids, remaining and state as the processes finish. Under job
+//control the job has its own process_group (0 when it shares the shell's)
+typedef struct Job {
+	char *command;
+	pid_t *pids;
+	int pid_count;
+	volatile sig_atomic_t remaining;
+	volatile sig_atomic_t state;
+	int status;
+	unsigned long serial;
+	pid_t process_group;
+} Job;
+
+extern Job job_table[JOBS_MAXIMUM];
+extern unsigned long job_serial;
+extern int job_control;
+extern pid_t launch_process_group;
+
+//This struct comprises the Batch Reader
+//It hands out the lines of a batch file as (pointer, length) views, either
+//into a mapping of the whole file or into a buffer filled by large reads
+typedef struct BatchReader {
+	int fd;
+	char *mapped;
+	size_t mapped_size;
+	size_t position;
+	char *buffer;
+	size_t buffer_size;
+	size_t buffer_capacity;
+	int eof;
+} BatchReader;
+
+//This struct comprises a Word of a compiled command
+//A dynamic word holds a $ and is expanded every time the command runs,
+//any other word is used as it was compiled. A word that is a glob pattern keeps
+//the pattern compiled in glob, and is matched against the files every time it runs
+typedef struct Word {
+	char *text;
+	size_t length;
+	int dynamic;
+	GlobPattern *glob;
+} Word;
+
+//This struct comprises one compiled stage of a pipeline
+//Redirection targets are words too, with a NULL text when not given.
+//assignments are the NAME=value words in front of the command, which only go
+//into the enviroment of that command
+typedef struct CompiledStage {
+	Word *words;
+	int word_count;
+	Word *assignments;
+	int assignment_count;
+	Word input_file;
+	Word output_file;
+	Word error_file;
+	int append;
+} CompiledStage;
+
+//This struct comprises a Compiled Command
+//It is a command line parsed once into stages, along with the line itself for
+//the history list. A transient command runs once, so its words are not copied
+typedef struct CompiledCommand {
+	char *text;
+	size_t length;
+	CompiledStage *stages;
+	int stage_count;
+	int background;
+	int timed;
+	int syntax_error;
+	int transient;
+} CompiledCommand;
+
+//These are the kinds of Script Nodes
+#define NODE_COMMAND 0
+#define NODE_IF 1
+#define NODE_FOR 2
+#define NODE_WHILE 3
+
+//This struct comprises a statement of a compiled script
+//command is the command to run, or the condition of an if or while. body holds
+//the statements inside a block and otherwise the else branch of an if.
+//A for loop sets variable to each of its expanded words in turn
+typedef struct ScriptNode {
+	int type;
+	int line;
+	CompiledCommand *command;
+	char *variable;
+	Word *words;
+	int word_count;
+	struct ScriptNode *body;
+	struct ScriptNode *otherwise;
+	struct ScriptNode *next;
+} ScriptNode;
+
+//This struct comprises the state of the Script Compiler
+//terminator holds the keyword that ended the last block (fi, done, else...) and
+//terminator_rest the rest of its line, like the condition of an elif
+typedef struct CompileState {
+	BatchReader *reader;
+	Arena *arena;
+	int line;
+	int interactive;
+	int error;
+	const char *terminator;
+	const char *terminator_rest;
+	size_t terminator_rest_length;
+} CompileState;
+
+extern Arena script_arena;
+
+//This struct comprises one request of Server Mode running on a worker
+//It holds the worker and the files capturing its output
+typedef struct BatchJob {
+	pid_t pid;
+	int pidfd;
+	int out_fd;
+	int err_fd;
+	int finished;
+	int status;
+} BatchJob;
+
+//This struct comprises the captured output of one stream of a supervised child
+//Up to CAPTURE_BUFFER_MAXIMUM bytes are kept in data. Past that, everything moves
+//into the anonymous memory file spill_fd, so a noisy child never grows the heap
+typedef struct CaptureBuffer {
+	char *data;
+	size_t used;
+	size_t capacity;
+	int spill_fd;
+} CaptureBuffer;
+
+//This struct comprises one child run by the Supervisor
+//Its exit is watched through pidfd, its stdout and stderr through the read ends in
+//pipes and its time limit through timer_fd (-1 once each is done with). The child
+//is done once it has exited and both pipes are drained
+typedef struct SupervisedChild {
+	pid_t pid;
+	int pidfd;
+	int timer_fd;
+	int pipes[2];
+	CaptureBuffer output[2];
+	char *command;
+	int status;
+	int exited;
+	int timed_out;
+	int done;
+} SupervisedChild;
+
+//This struct comprises the Supervisor, a single epoll loop over many children
+//Children live in a fixed table of slots, running counts the ones not done yet and
+//timeout is how many seconds each child may run for (0 for no limit)
+typedef struct Supervisor {
+	int epoll_fd;
+	SupervisedChild *children;
+	int capacity;
+	int running;
+	double timeout;
+} Supervisor;
+
+//This struct comprises the header of a Server Mode response
+//The Server Mode protocol frames everything with 32 bit integers in network byte order.
+//A request is the length of the command followed by the command, which can hold
+//several lines. A response is this header followed by the captured stdout and stderr
+typedef struct ServeResponseHeader {
+	uint32_t status;
+	uint32_t out_length;
+	uint32_t err_length;
+} ServeResponseHeader;
+
+//This struct comprises a Server Mode response on its way to the client
+//Client sockets never block, so whatever didnt fit yet is sent once the socket
+//has room again: the rest of the header, then the capture files from their offsets
+typedef struct ServeResponse {
+	ServeResponseHeader header;
+	size_t header_sent;
+	int capture_fds[2];
+	off_t capture_lengths[2];
+	off_t capture_offsets[2];
+	int active;
+} ServeResponse;
+
+//This struct comprises a client of Server Mode (wsh --serve)
+//Requests are read into buffer until a whole one has arrived. While busy, the
+//client's request is running on the worker in job. While waiting, it is a wait or fg
+//for wait_job (-1 for every job), answered once the job table says it is done
+typedef struct ServeClient {
+	int fd;
+	char *buffer;
+	size_t used;
+	size_t capacity;
+	int busy;
+	BatchJob job;
+	int waiting;
+	int wait_job;
+	unsigned long wait_serial;
+	ServeResponse response;
+	int closing;
+} ServeClient;
+
+//This struct comprises an entry of the Builtin Registry
+//It maps a Built-In command's name to its method, how many arguments it takes
+//(max_args of -1 means any number), whether it goes into the history list and
+//whether it changes shell state (which makes it a barrier in parallel batch mode)
+typedef struct Builtin {
+	const char *name;
+	void (*handler)(char *args[]);
+	int min_args;
+	int max_args;
+	int add_to_history;
+	int changes_state;
+	const char *arity_error;
+} Builtin;
+
+//This struct comprises the Timing of the current command
+//While active, it collects the shell-side time spent in each phase and the
+//resource usage of the command's children as they are waited on
+typedef struct CommandTiming {
+	int active;
+	double parse;
+	double substitute;
+	double resolve;
+	double spawn;
+	double child_user;
+	double child_sys;
+	long child_maxrss;
+	long child_nvcsw;
+	long child_nivcsw;
+} CommandTiming;
+
+extern CommandTiming command_timing;
+extern int profile_enabled;
+
+//This struct comprises the Profile of a command name (WSH_PROFILE)
+//It adds up every run of the command and keeps a histogram of wall times
+typedef struct ProfileEntry {
+	char *name;
+	long count;
+	double wall;
+	double user;
+	double sys;
+	long maxrss;
+	long nvcsw;
+	long nivcsw;
+	double parse;
+	double substitute;
+	double resolve;
+	double spawn;
+	long histogram[PROFILE_BUCKETS];
+	struct ProfileEntry *next;
+} ProfileEntry;
+
+extern ProfileEntry *profile_entries;
+
+//This struct comprises the Line Editor used at an interactive terminal
+//line holds what has been typed so far and cursor is where the next key goes.
+//The terminal is only put in raw mode while a line is being typed, so commands
+//run with the settings saved when the shell started. history_index is how far
+//back Up has gone (0 is the line being typed, kept in pending meanwhile)
+typedef struct LineEditor {
+	int enabled;
+	struct termios saved;
+	char *line;
+	size_t length;
+	size_t capacity;
+	size_t cursor;
+	const char *prompt;
+	size_t columns;
+	int history_index;
+	char *pending;
+	size_t pending_length;
+	int last_key;
+} LineEditor;
+
+extern LineEditor line_editor;
+
+//This struct comprises one PATH directory of the Completion Index
+//names holds the executables in it, sorted, as they were when the directory had
+//the recorded device, inode and modification time
+typedef struct CompletionDirectory {
+	char *path;
+	DirectoryListing names;
+	dev_t device;
+	ino_t inode;
+	struct timespec modified;
+	int trusted;
+	int valid;
+} CompletionDirectory;
+
+//This struct comprises the Completion Index
+//commands is every builtin and PATH executable merged into one sorted array
+//without repeats, so the commands starting with a prefix are found with a binary
+//search. path is the PATH it was built for. Each directory is read again only
+//when it changes, and commands is only merged again after one was
+typedef struct CompletionIndex {
+	char *path;
+	CompletionDirectory *directories;
+	int directory_count;
+	const char **commands;
+	size_t command_count;
+	size_t command_capacity;
+	int stale;
+} CompletionIndex;
+
+extern CompletionIndex completion_index;
+
+//This struct comprises the Matches of one completion, sorted and kept in the
+//command arena. Only the part of each match from shown on is listed to the user
+typedef struct CompletionMatches {
+	const char **names;
+	int count;
+	int capacity;
+	int kind;
+	size_t shown;
+} CompletionMatches;
+
+//This struct comprises one helper of the Zygote Pool
+//It is a child of the shell waiting on its end of a socket pair (fd) to be
+//told what to exec
+typedef struct ZygoteHelper {
+	pid_t pid;
+	int fd;
+} ZygoteHelper;
+
+//This struct comprises the Zygote Pool
+//The zygote is a small copy of the shell made when the pool starts. Asked over
+//control_fd, it makes helpers with CLONE_PARENT, so they are children of the shell,
+//and sends each one's pid and socket back. The shell keeps up to ZYGOTE_POOL_SIZE of
+//them ready in helpers, and asks for a new one each time it uses one up, so the pool
+//is refilled while the shell goes on. requested counts the helpers asked for and
+//not yet sent back, missing the ones the pool is short that couldnt be asked for yet.
+//owner is the shell that started it, copies of the shell made by fork dont use it
+typedef struct ZygotePool {
+	pid_t zygote;
+	pid_t owner;
+	int control_fd;
+	ZygoteHelper helpers[ZYGOTE_POOL_SIZE];
+	int count;
+	int requested;
+	int missing;
+	int failed;
+	long hits;
+	long misses;
+} ZygotePool;
+
+extern ZygotePool zygote_pool;
+
+//This struct comprises the Header of a request sent to a zygote helper
+//It is followed by the path, the arguments and the enviroment as NUL terminated
+//strings, and carries the command's stdin, stdout, stderr and working directory
+//as SCM_RIGHTS
+typedef struct ZygoteRequest {
+	uint32_t argc;
+	uint32_t envc;
+	pid_t process_group;
+} ZygoteRequest;
+
+//This variable holds which launch backend external commands use
+extern int launch_mode;
 
 //This variable will hold the value the program will return with incase the program
 //ends from the end of the main method. It should return 0 in most situations, unless we
 //run a command that isnt recognized by the system (TEST 11)
 extern int exit_value;
 
+//This variable holds the exit status of the last command, expanded by $?
+extern int last_status;
+
+//These Instantiate the methods that turn a command line into
+//its pipeline stages and dispatch them
+void process_command(const char *line, size_t length);
+int exit_code(int status);
+void execute_compiled_command(CompiledCommand *compiled, double parse_seconds);
+void expand_compiled_stage(CompiledStage *compiled, Command *stage, int transient);
+char *expand_word(Word *word, int transient);
+void execute_builtin(char *args[]);
+
+//These Instantiate the helper methods for Script Compilation and Execution
+//Scripts are parsed once into ScriptNodes, which are run without parsing them again
+void init_compile_state(CompileState *state, BatchReader *reader, int interactive);
+CompiledCommand *compile_command(const char *line, size_t length, Arena *arena);
+void compile_stage(char *text, CompiledStage *stage, Arena *arena);
+char *next_command_word(char **cursor);
+char *find_unsubstituted(char *text, char c);
+Word make_word(char *text);
+ScriptNode *compile_script(CompileState *state);
+ScriptNode *compile_statements(CompileState *state, const char *const terminators[]);
+ScriptNode *compile_statement(CompileState *state, const char *line, size_t length);
+void compile_else(CompileState *state, ScriptNode *node);
+CompiledCommand *compile_condition(CompileState *state, const char *text, size_t length, const char *keyword);
+int compile_for_header(CompileState *state, ScriptNode *node, const char *text, size_t length);
+int script_keyword(const char *line, size_t length, const char *keyword);
+void trim_script_line(const char **line, size_t *length);
+int is_script_block(const char *line, size_t length);
+void execute_script(ScriptNode *node);
+int execute_condition(CompiledCommand *condition);
+void execute_for(ScriptNode *node);
+void dump_script(ScriptNode *node, int depth);
+void dump_command(CompiledCommand *compiled, int line);
+void dump_word(const char *kind, Word *word);
+
 //These Instantiate the Built-In methods and functionality
 //of the shell
 void execute_exit(char *args[]);
 void execute_cd(char *args[]);
-void execute_export(char *command);
-void execute_local(char *command);
-void execute_vars();
+void execute_export(char *args[]);
+void execute_local(char *args[]);
+void execute_vars(char *args[]);
+void execute_unset(char *args[]);
 void execute_history(char *args[]);
-void execute_ls();
+void execute_ls(char *args[]);
+void execute_hash(char *args[]);
+void execute_jobs(char *args[]);
+void execute_wait(char *args[]);
+void execute_fg(char *args[]);
+void execute_bg(char *args[]);
+
+//These Instantiate the fast Built-In methods, in-process versions of
+//the /bin commands scripts run the most, and their helpers
+void execute_echo(char *args[]);
+void execute_true(char *args[]);
+void execute_false(char *args[]);
+void execute_cat(char *args[]);
+void execute_printf(char *args[]);
+void execute_test(char *args[]);
+int copy_fd(int in, int out);
+int write_format(const char *format, char ***next, int *used);
+long long parse_printf_number(const char *argument);
+double parse_printf_double(const char *argument);
+int write_escaped(const char *text, int printf_octal);
+size_t write_escape(const char *text, int printf_octal, int *stop);
+int test_or(TestParser *parser);
+int test_and(TestParser *parser);
+int test_not(TestParser *parser);
+int test_primary(TestParser *parser);
+int test_unary(char op, const char *operand);
+int test_binary(TestParser *parser, const char *left, const char *op, const char *right);
+int parse_test_integer(const char *text, long long *value);
+int is_test_binary(const char *word);
+int test_peek(TestParser *parser, int offset, const char *word);
+void run_external_builtin(char *args[]);
+
+//This is the Builtin Registry
+//Every Built-In command is listed once here as
+//	X(name, method, min args, max args, add to history, changes state, arity error)
+//and the registry table in wsh.c is generated from it. More in-process builtins can
+//be registered at build time by defining WSH_EXTRA_BUILTINS(X) in the same format
+//(for example in a header pulled in with -include)
+#define WSH_BUILTINS(X) \
+	X("exit", execute_exit, 0, 0, 1, 1, "Too many Arguments") \
+	X("cd", execute_cd, 1, 1, 1, 1, "Wrong number of arguments") \
+	X("export", execute_export, 0, -1, 1, 1, "") \
+	X("local", execute_local, 0, -1, 1, 1, "") \
+	X("vars", execute_vars, 0, -1, 1, 0, "") \
+	X("unset", execute_unset, 1, -1, 1, 1, "Not enough Arguments") \
+	X("history", execute_history, 0, -1, 0, 1, "") \
+	X("hash", execute_hash, 0, -1, 1, 1, "") \
+	X("ls", execute_ls, 0, -1, 1, 0, "") \
+	X("jobs", execute_jobs, 0, -1, 1, 1, "") \
+	X("wait", execute_wait, 0, 1, 1, 1, "Too many Arguments") \
+	X("fg", execute_fg, 0, 1, 1, 1, "Too many Arguments") \
+	X("bg", execute_bg, 0, 1, 1, 1, "Too many Arguments") \
+	X("echo", execute_echo, 0, -1, 1, 0, "") \
+	X("true", execute_true, 0, -1, 1, 0, "") \
+	X("false", execute_false, 0, -1, 1, 0, "") \
+	X("cat", execute_cat, 0, -1, 1, 0, "") \
+	X("printf", execute_printf, 0, -1, 1, 0, "") \
+	X("test", execute_test, 0, -1, 1, 0, "") \
+	X("[", execute_test, 0, -1, 1, 0, "")
+
+#ifndef WSH_EXTRA_BUILTINS
+#define WSH_EXTRA_BUILTINS(X)
+#endif
 
 //These Instantiate the Non Built-In methods and functionality
 //of the shell. Noteworthly, they handle the ability to call 
 //basic shell functions not explicitly covered by wsh shell using
 //fork() and execv()
-void execute_shell_command(char *args[]);
+void execute_shell_command(char *args[], Redirection *redirection, char **envp);
 char* retrieve_command_path(const char *command);
-void execute_fork_and_execv(const char *path, char *args[]);
-void execute_redirection(char *input_file, char *output_file, char *error_file, int append);
+int execute_fork_and_execv(const char *path, char *args[], Redirection *redirection, char **envp);
+int launch_command(const char *path, char *args[], int fds[3], pid_t *pid, char **envp);
+int execute_spawn(const char *path, char *args[], int fds[3], pid_t *pid, char **envp);
+void execute_pipeline(Command *stages, int count, const char *job_text);
+int fork_builtin(char *args[], int fds[3], pid_t *pid);
+const Builtin *stage_builtin(Command *stage);
+void redirect_shell_fds(int fds[3], int saved[3]);
+void restore_shell_fds(int saved[3]);
+int open_redirection_files(Redirection *redirection, int fds[3]);
+void close_redirection_files(int fds[3]);
+
+//These Instantiate the helper methods for the Zygote Pool
+//They start the zygote, keep the pool of helpers filled and hand commands to them
+int start_zygote_pool();
+void run_zygote(int control_fd);
+void run_zygote_helper(int fd);
+int execute_zygote(const char *path, char *args[], int fds[3], pid_t *pid, char **envp);
+void collect_zygote_helpers(int block);
+void request_zygote_helpers(int count);
+void free_zygote_pool();
+
+//These Instantiate the helper methods for the Append Cache
+//They keep the files of repeated >> redirections open during a batch run
+int retrieve_append_fd(const char *path);
+int release_append_fd(int fd);
+void forget_append_fd(AppendCacheEntry *entry);
+void clear_append_cache();
+
+//These Instantiate the helper methods for the Command Path Cache
+//They handle looking up, adding and clearing resolved command paths
+unsigned int hash_string(const char *name);
+unsigned int hash_bytes(const char *name, size_t length);
+unsigned int hash_command_name(const char *name);
+PathCacheEntry *lookup_cached_path(const char *name);
+char *add_cached_path(const char *name, const char *path);
+void forget_cached_path(const char *name);
+void clear_path_cache();
+
+//These Instantiate the helper methods for Job Control
+//They handle adding, reaping, waiting on and continuing background jobs
+void handle_sigchld(int signal_number);
+void reap_jobs();
+void block_sigchld(int block);
+void setup_job_control();
+int add_job(pid_t *pids, int count, const char *command, pid_t process_group);
+void wait_for_job(int index);
+void join_launch_group(pid_t pid);
+void enable_job_control();
+void hand_terminal(pid_t process_group);
+void continue_job(int index);
+int retrieve_job_index(const char *id);
+void notify_finished_jobs(int print);
+
+//These Instantiate the helper methods for the Batch Reader
+//They hand out the lines of a batch file or stdin without copying them
+int open_batch_reader(BatchReader *reader, const char *path);
+void start_batch_reader(BatchReader *reader, int fd);
+int next_batch_line(BatchReader *reader, const char **line, size_t *length);
+void close_batch_reader(BatchReader *reader);
+
+//These Instantiate the helper methods for Parallel Batch mode (wsh -j N)
+//They handle starting lines on workers, collecting them and writing their output in order
+void execute_parallel_batch(BatchReader *reader, int workers, double timeout);
+int is_barrier_command(const char *line, size_t length);
+void finish_batch_job(BatchJob *job, int block);
+int send_capture(int target, int source, off_t size);
+
+//These Instantiate the helper methods for the Supervisor
+//They handle running many children from one epoll loop, draining their output,
+//reaping them through pidfds and enforcing time limits with timerfds
+int init_supervisor(Supervisor *supervisor, int capacity, double timeout);
+int supervise_command(Supervisor *supervisor, int slot, const char *line, size_t length);
+int watch_supervised_fd(Supervisor *supervisor, int fd, int slot, int kind);
+void unwatch_supervised_fd(Supervisor *supervisor, int *fd);
+int run_supervisor(Supervisor *supervisor);
+void drain_supervised_output(Supervisor *supervisor, SupervisedChild *child, int stream);
+void reap_supervised_child(Supervisor *supervisor, SupervisedChild *child);
+void expire_supervised_child(Supervisor *supervisor, SupervisedChild *child);
+void stop_supervised_child(Supervisor *supervisor, SupervisedChild *child);
+void settle_supervised_child(Supervisor *supervisor, SupervisedChild *child);
+void wait_for_supervised_child(Supervisor *supervisor, int slot);
+void emit_supervised_child(Supervisor *supervisor, int slot);
+void release_supervised_child(Supervisor *supervisor, int slot);
+void free_supervisor(Supervisor *supervisor);
+int append_capture(CaptureBuffer *buffer, const char *data, size_t length);
+void emit_capture(CaptureBuffer *buffer, int target);
+void free_capture(CaptureBuffer *buffer);
+
+//These Instantiate the helper methods for Server Mode (wsh --serve)
+//They handle accepting clients, running their requests and sending the responses
+void handle_serve_signal(int signal_number);
+int execute_serve(const char *path);
+void accept_serve_client(int listen_fd, ServeClient *clients);
+int read_serve_client(ServeClient *client);
+void serve_next_request(ServeClient *client, int null_fd);
+void serve_request(ServeClient *client, uint32_t length, int null_fd);
+int park_serve_wait(ServeClient *client, const char *line, size_t length);
+void answer_serve_waits(ServeClient *clients);
+int script_changes_state(const char *text, size_t length);
+void execute_serve_script(const char *text, size_t length);
+int start_serve_job(const char *line, size_t length, int script, BatchJob *job, int null_fd);
+int queue_serve_response(ServeClient *client, int status, int out_fd, int err_fd);
+int flush_serve_response(ServeClient *client);
+void close_serve_client(ServeClient *client);
+
+//These Instantiate the helper methods for the Shell Variable Store
+//They handle finding, setting and freeing variables in the hash table
+int find_variable_slot(ShellVariables *store, const char *name, size_t length, unsigned int hash);
+char *lookup_variable(ShellVariables *store, const char *name);
+char *lookup_variable_bytes(ShellVariables *store, const char *name, size_t length);
+void set_variable(ShellVariables *store, const char *name, const char *value);
+void grow_variable_slots(ShellVariables *store);
+void unset_variable(ShellVariables *store, const char *name);
+void free_variables(ShellVariables *store);
+
+//These Instantiate the helper methods for Command Timing and Profiling
+//They handle waiting on children with wait4 and reporting time and WSH_PROFILE
+double monotonic_seconds();
+double timeval_seconds(struct timeval value);
+pid_t wait_for_child(pid_t pid, int *status, int options);
+void report_command_timing(const char *name, double started, struct rusage *self_start, int timed);
+void print_profile();
 
 //These Instantiate the helper methods for the History Command
-//Specifically, these two methods assist in adding and retrieving
-//commands from the History struct
-void add_to_history(const char *command);
-const char* retrieve_from_history(int n);
+//Specifically, these methods assist in adding and retrieving commands
+//from the History struct, resizing it and keeping the history file
+void add_to_history(const char *command, size_t length);
+const HistoryEntry* retrieve_from_history(int n);
+int resize_history(int new_size);
+void load_history_file(const char *path);
+void free_history();
+
+//These Instantiate the helper methods for the Line Editor
+//They read a line in raw mode with editing, history search (Ctrl-R) and completion (Tab)
+void init_line_editor();
+void free_line_editor();
+int read_interactive_line(BatchReader *reader, const char *prompt, const char **line, size_t *length);
+int read_editor_line(const char *prompt, const char **line, size_t *length);
+int read_editor_key();
+int read_editor_byte(unsigned char *c, int timeout);
+void refresh_editor_line();
+void reserve_editor_line(size_t length);
+void insert_editor_text(const char *text, size_t length);
+void delete_editor_text(size_t start, size_t length);
+void set_editor_text(const char *text, size_t length);
+void step_editor_history(int step);
+int search_editor_history();
+int find_history_match(const char *query, size_t length, int from);
+void complete_editor_line();
+void list_completion_matches(CompletionMatches *matches);
+
+//These Instantiate the helper methods for the Completion Index
+//They find the commands, variables and files a word can be completed to
+void complete_command_names(const char *prefix, size_t length, CompletionMatches *matches);
+void complete_variable_names(const char *prefix, size_t length, CompletionMatches *matches);
+void complete_file_names(const char *word, size_t length, CompletionMatches *matches);
+void add_completion_match(CompletionMatches *matches, const char *name);
+int compare_completion_names(const void *a, const void *b);
+void refresh_completion_index();
+void load_completion_directories(const char *path);
+int refresh_completion_directory(CompletionDirectory *directory);
+int read_executable_listing(const char *path, DirectoryListing *listing, DirectoryListing *previous);
+int listing_has_name(DirectoryListing *listing, const char *name);
+void merge_completion_index();
+void free_completion_index();
+
+//These Instantiate the helper methods for the Output Buffer
+//All of the shell's own stdout output goes through these
+void out_write(const char *text, size_t length);
+void out_printf(const char *format, ...);
+void out_flush();
 
 //These Instantiate the helper methods that are used more generally
 //by the general shell main loop and command processing
-int basic_comparison(const void *a, const void *b);
+int basic_comparison(const void *a, const void *b, void *names);
+int write_all(int fd, const char *buffer, size_t length);
+int writev_all(int fd, struct iovec *parts, int count);
+int read_directory_listing(const char *path, DirectoryListing *listing);
+void free_directory_listing(DirectoryListing *listing);
+int is_builtin_command(const char *name);
+
+//These Instantiate the helper methods for the Directory Snapshot Cache
+//They hand out sorted directory listings shared by ls and glob expansion
+DirectorySnapshot *retrieve_directory_snapshot(const char *path);
+void forget_directory_snapshot(DirectorySnapshot *snapshot);
+void clear_directory_snapshots();
+
+//These Instantiate the helper methods for Glob Expansion
+//They compile *, ? and [...] patterns once and match them against directory snapshots
+GlobPattern *compile_glob(const char *text, Arena *arena);
+int compile_glob_component(GlobComponent *component, const char *text, size_t length, Arena *arena);
+const char *compile_glob_class(GlobToken *token, const char *open, const char *end, Arena *arena);
+int match_glob(const GlobToken *tokens, int count, const char *name);
+int expand_glob(GlobPattern *pattern, Arena *arena, char ***values, int *count, int *capacity);
+void expand_glob_component(GlobPattern *pattern, int index, const char *path, Arena *arena, char ***values, int *count, int *capacity);
+char *join_glob_path(Arena *arena, const char *path, size_t path_length, const char *name, int slash);
+void append_glob_match(Arena *arena, char ***values, int *count, int *capacity, char *value);
+
+//These Instantiate the helper methods for the Builtin Registry
+//They build the registry's hash table and look names up in it
+unsigned int hash_builtin_name(const char *name, size_t length);
+void init_builtin_registry();
+const Builtin *lookup_builtin(const char *name);
+
+//These Instantiate the helper methods for Variable Expansion
+//They expand $NAME, ${NAME}, ${NAME:-default} and $? into an ExpansionBuffer
 char *retrieve_shell_variable(const char *name);
-void substitute_command_variables(char *command);
+char *substitute_command_variables(const char *command, size_t length);
+void expand_variables(ExpansionBuffer *output, const char *text, size_t length);
+const char *expand_braced_variable(ExpansionBuffer *output, const char *brace, const char *end);
+size_t variable_name_length(const char *text, const char *end);
+const char *lookup_expansion_variable(const char *name, size_t length);
+void append_status(ExpansionBuffer *output);
+char *reserve_expansion(ExpansionBuffer *output, size_t length);
+void append_expansion(ExpansionBuffer *output, const char *text, size_t length);
+
+//These Instantiate the helper methods for Command Substitution
+//They run the command inside $(...) and expand to what it printed
+const char *find_substitution_end(const char *open, const char *end);
+void expand_substitution(ExpansionBuffer *output, const char *command, size_t length);
+int substitution_needs_fork(CompiledCommand *compiled);
+int retrieve_substitution_file();
+
+//These Instantiate the helper methods for the Export Table
+//They keep the exported variables, and the envp handed to launched commands
+int load_export_table();
+int find_export_slot(const char *name, size_t length);
+const char *lookup_environment(const char *name, size_t length);
+int set_environment_variable(const char *name, const char *value);
+int add_export_entry(int slot, char *entry);
+void unset_environment_variable(const char *name);
+int index_export_table(int slot_count);
+char **retrieve_environment();
+char **overlay_environment(char **assignments, int count);
+int is_assignment_word(const char *text, size_t length);
+void free_export_table();
+
+//These Instantiate the helper methods for the Command Arena
+//They hand out memory for the current command line and release it all at once
+void *arena_alloc(Arena *arena, size_t size);
+void *arena_grow(Arena *arena, void *memory, size_t old_size, size_t new_size);
+char *arena_strndup(Arena *arena, const char *text, size_t length);
+void arena_free(Arena *arena);
+void arena_reset(Arena *arena);
 
 #endif 